@@ -0,0 +1,252 @@
+//
+//  archive.c
+//  UEFIRomExtract
+//
+//  Sequential tar output for bulk extraction.
+//
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "archive.h"
+
+typedef struct {
+    char Name[100];
+    char Mode[8];
+    char Uid[8];
+    char Gid[8];
+    char Size[12];
+    char MTime[12];
+    char ChkSum[8];
+    char TypeFlag;
+    char LinkName[100];
+    char Magic[6];
+    char Version[2];
+    char UName[32];
+    char GName[32];
+    char DevMajor[8];
+    char DevMinor[8];
+    char Prefix[155];
+    char Pad[12];
+} TAR_HEADER;
+
+typedef struct {
+    char Data[8192];
+    size_t Used;
+    int Overflow;
+} PAX_RECORDS;
+
+static const uint8_t mZeroBlock[ARCHIVE_BLOCK_SIZE];
+
+static int ArchiveWriteFd(int Fd, const uint8_t *Data, size_t Size) {
+    while (Size != 0) {
+        ssize_t Written = write(Fd, Data, Size);
+
+        if (Written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        Data += Written;
+        Size -= (size_t) Written;
+    }
+
+    return 0;
+}
+
+static int ArchiveFlush(ROM_ARCHIVE *Ar) {
+    int Status = ArchiveWriteFd(Ar->mFd, Ar->mIoBuffer, Ar->mIoUsed);
+
+    Ar->mIoUsed = 0;
+
+    return Status;
+}
+
+static int ArchiveBuffered(ROM_ARCHIVE *Ar, const void *Data, size_t Size) {
+    if (Ar->mIoUsed + Size > ARCHIVE_IO_BUFFER) {
+        if (ArchiveFlush(Ar)) {
+            return -1;
+        }
+
+        // Big images go straight out rather than through the buffer
+        if (Size >= ARCHIVE_IO_BUFFER) {
+            return ArchiveWriteFd(Ar->mFd, Data, Size);
+        }
+    }
+
+    memcpy(Ar->mIoBuffer + Ar->mIoUsed, Data, Size);
+    Ar->mIoUsed += (uint32_t) Size;
+
+    return 0;
+}
+
+// Write Data and pad it with zeros to the next block boundary
+static int ArchiveWrite(ROM_ARCHIVE *Ar, const void *Data, size_t Size) {
+    size_t Tail = Size % ARCHIVE_BLOCK_SIZE;
+
+    if (ArchiveBuffered(Ar, Data, Size)) {
+        return -1;
+    }
+
+    if (Tail != 0) {
+        return ArchiveBuffered(Ar, mZeroBlock, ARCHIVE_BLOCK_SIZE - Tail);
+    }
+
+    return 0;
+}
+
+static int ArchiveWriteHeader(ROM_ARCHIVE *Ar, const char *Name, char TypeFlag, uint64_t Size) {
+    TAR_HEADER Hdr;
+
+    memset(&Hdr, 0, sizeof (Hdr));
+
+    // Long names travel in the pax header, this one only needs to be recognisable
+    strncpy(Hdr.Name, Name, sizeof (Hdr.Name) - 1);
+    snprintf(Hdr.Mode, sizeof (Hdr.Mode), "%07o", 0644);
+    snprintf(Hdr.Uid, sizeof (Hdr.Uid), "%07o", 0);
+    snprintf(Hdr.Gid, sizeof (Hdr.Gid), "%07o", 0);
+    snprintf(Hdr.Size, sizeof (Hdr.Size), "%011llo", (unsigned long long) Size);
+    snprintf(Hdr.MTime, sizeof (Hdr.MTime), "%011llo", (unsigned long long) Ar->mMTime);
+    Hdr.TypeFlag = TypeFlag;
+    memcpy(Hdr.Magic, "ustar", 6);
+    memcpy(Hdr.Version, "00", 2);
+
+    memset(Hdr.ChkSum, ' ', sizeof (Hdr.ChkSum));
+
+    uint32_t Sum = 0;
+    for (size_t Index = 0; Index < sizeof (Hdr); Index++) {
+        Sum += ((uint8_t *) &Hdr)[Index];
+    }
+
+    snprintf(Hdr.ChkSum, sizeof (Hdr.ChkSum), "%06o", Sum);
+
+    return ArchiveWrite(Ar, &Hdr, sizeof (Hdr));
+}
+
+// Append one "length key=value\n" pax record, where length counts the whole record
+static void ArchivePaxRecord(PAX_RECORDS *Pax, const char *Key, const char *Value) {
+    size_t Body = strlen(Key) + strlen(Value) + 3;
+    size_t Length = Body + 1;
+
+    // The length prefix includes its own digits
+    while (Length != Body + (size_t) snprintf(NULL, 0, "%zu", Length)) {
+        Length = Body + (size_t) snprintf(NULL, 0, "%zu", Length);
+    }
+
+    if (Pax->Used + Length >= sizeof (Pax->Data)) {
+        Pax->Overflow = 1;
+        return;
+    }
+
+    snprintf(Pax->Data + Pax->Used, sizeof (Pax->Data) - Pax->Used, "%zu %s=%s\n", Length, Key, Value);
+    Pax->Used += Length;
+}
+
+int ArchiveOpen(ROM_ARCHIVE *Ar, const char *Path) {
+    memset(Ar, 0, sizeof (*Ar));
+
+    if (strcmp(Path, "-") == 0) {
+        Ar->mFd = STDOUT_FILENO;
+    } else {
+        Ar->mFd = open(Path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        Ar->mOwnsFd = 1;
+    }
+
+    if (Ar->mFd < 0) {
+        return -1;
+    }
+
+    Ar->mIoBuffer = malloc(ARCHIVE_IO_BUFFER);
+
+    if (Ar->mIoBuffer == NULL) {
+        if (Ar->mOwnsFd) {
+            close(Ar->mFd);
+        }
+
+        return -1;
+    }
+
+    Ar->mMTime = (uint64_t) time(NULL);
+
+    return 0;
+}
+
+int ArchiveAddImage(ROM_ARCHIVE *Ar, const char *InFile, const EFI_ROM_INFO *RomInfo, const void *Data, uint32_t Size) {
+    char Name[4096];
+    char Value[32];
+    PAX_RECORDS Pax;
+
+    if (strcmp(InFile, "-") == 0) {
+        InFile = "stdin";
+    }
+
+    // Archive members are relative, so drop leading slashes of absolute inputs
+    while (*InFile == '/') {
+        InFile++;
+    }
+
+    if ((size_t) snprintf(Name, sizeof (Name), "%s.efi", InFile) >= sizeof (Name)) {
+        return -1;
+    }
+
+    Pax.Used = 0;
+    Pax.Overflow = 0;
+
+    ArchivePaxRecord(&Pax, "path", Name);
+    ArchivePaxRecord(&Pax, ARCHIVE_PAX_PREFIX "source", InFile);
+
+    snprintf(Value, sizeof (Value), "0x%x", RomInfo->RomOffset);
+    ArchivePaxRecord(&Pax, ARCHIVE_PAX_PREFIX "rom_offset", Value);
+
+    snprintf(Value, sizeof (Value), "0x%04x", RomInfo->VendorId);
+    ArchivePaxRecord(&Pax, ARCHIVE_PAX_PREFIX "vendor_id", Value);
+
+    snprintf(Value, sizeof (Value), "0x%04x", RomInfo->DeviceId);
+    ArchivePaxRecord(&Pax, ARCHIVE_PAX_PREFIX "device_id", Value);
+
+    snprintf(Value, sizeof (Value), "0x%04x", RomInfo->EfiMachineType);
+    ArchivePaxRecord(&Pax, ARCHIVE_PAX_PREFIX "machine_type", Value);
+
+    snprintf(Value, sizeof (Value), "%u", RomInfo->CompSize);
+    ArchivePaxRecord(&Pax, ARCHIVE_PAX_PREFIX "comp_size", Value);
+
+    if (Pax.Overflow) {
+        return -1;
+    }
+
+    if (ArchiveWriteHeader(Ar, "PaxHeader", 'x', Pax.Used) || ArchiveWrite(Ar, Pax.Data, Pax.Used)) {
+        return -1;
+    }
+
+    if (ArchiveWriteHeader(Ar, Name, '0', Size) || ArchiveWrite(Ar, Data, Size)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int ArchiveClose(ROM_ARCHIVE *Ar) {
+    int Status = 0;
+
+    // Two zero blocks mark the end of the archive
+    if (ArchiveWrite(Ar, mZeroBlock, sizeof (mZeroBlock)) ||
+        ArchiveWrite(Ar, mZeroBlock, sizeof (mZeroBlock)) ||
+        ArchiveFlush(Ar)) {
+        Status = -1;
+    }
+
+    if (Ar->mOwnsFd && close(Ar->mFd) != 0) {
+        Status = -1;
+    }
+
+    free(Ar->mIoBuffer);
+    memset(Ar, 0, sizeof (*Ar));
+
+    return Status;
+}
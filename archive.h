@@ -0,0 +1,69 @@
+//
+//  archive.h
+//  UEFIRomExtract
+//
+//  Sequential tar output for bulk extraction.
+//
+
+#ifndef UEFIRomExtract_archive_h
+#define UEFIRomExtract_archive_h
+
+#include <stdint.h>
+#include "main.h"
+
+#define ARCHIVE_BLOCK_SIZE  512
+#define ARCHIVE_IO_BUFFER   (1U << 20)
+
+//
+// Image metadata is stored as pax user xattr records, which tar accepts
+// silently and restores onto the extracted files with --xattrs.
+//
+#define ARCHIVE_PAX_PREFIX  "SCHILY.xattr.user.uefiromextract."
+
+typedef struct {
+    int mFd;
+    uint8_t *mIoBuffer;  // Entries are gathered here and leave in few large writes
+    uint32_t mIoUsed;
+    uint64_t mMTime;
+    uint8_t mOwnsFd;
+} ROM_ARCHIVE;
+
+/**
+ Open a tar archive stream for writing.
+
+ @param  Ar   The archive to initialise.
+ @param  Path The file to create, or - for stdout.
+
+ @retval  0 OK.
+ @retval  -1 The archive could not be opened.
+ **/
+int ArchiveOpen(ROM_ARCHIVE *Ar, const char *Path);
+
+/**
+ Append one extracted image to the archive.
+
+ The entry is named after the input path with .efi appended and is preceded
+ by a pax extended header carrying the source path and ROM metadata.
+
+ @param  Ar      The archive.
+ @param  InFile  The input the image was extracted from.
+ @param  RomInfo Where the image was found and its PCI identity.
+ @param  Data    The decompressed image.
+ @param  Size    The size of the decompressed image.
+
+ @retval  0 OK.
+ @retval  -1 Write error.
+ **/
+int ArchiveAddImage(ROM_ARCHIVE *Ar, const char *InFile, const EFI_ROM_INFO *RomInfo, const void *Data, uint32_t Size);
+
+/**
+ Write the end-of-archive marker, flush and close the stream.
+
+ @param  Ar The archive.
+
+ @retval  0 OK.
+ @retval  -1 Write error.
+ **/
+int ArchiveClose(ROM_ARCHIVE *Ar);
+
+#endif
@@ -0,0 +1,127 @@
+//
+//  arena.c
+//  UEFIRomExtract
+//
+//  Size-classed pool of large buffers, recycled between images so bulk runs
+//  stop mapping, faulting in and unmapping an output buffer per image.
+//
+#define _GNU_SOURCE
+#include <string.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+uint32_t gArenaFlags;
+
+void ArenaInit(BUFFER_ARENA *Arena, uint32_t Flags) {
+    memset(Arena, 0, sizeof (*Arena));
+    Arena->mFlags = Flags;
+    pthread_mutex_init(&Arena->mLock, NULL);
+}
+
+void ArenaDestroy(BUFFER_ARENA *Arena) {
+    for (int Class = 0; Class < ARENA_CLASS_COUNT; Class++) {
+        while (Arena->mFree[Class] != NULL) {
+            void *Buffer = Arena->mFree[Class];
+
+            memcpy(&Arena->mFree[Class], Buffer, sizeof (void *));
+            munmap(Buffer, 1ULL << (Class + ARENA_MIN_SHIFT));
+        }
+    }
+
+    pthread_mutex_destroy(&Arena->mLock);
+}
+
+static int ArenaClass(uint64_t Size) {
+    int Class = 0;
+
+    while (Class < ARENA_CLASS_COUNT && (1ULL << (Class + ARENA_MIN_SHIFT)) < Size) {
+        Class++;
+    }
+
+    return Class;
+}
+
+static void *ArenaMap(const BUFFER_ARENA *Arena, uint64_t Size) {
+    if (Size >= ARENA_HUGE_PAGE_SIZE && (Arena->mFlags & ARENA_HUGE_EXPLICIT) != 0) {
+        void *Buffer = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        // Nothing reserved in the hugetlb pool, fall back to normal pages
+        if (Buffer != MAP_FAILED) {
+            return Buffer;
+        }
+    }
+
+    if (Size < ARENA_HUGE_PAGE_SIZE || (Arena->mFlags & ARENA_HUGE_TRANSPARENT) == 0) {
+        void *Buffer = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        return Buffer != MAP_FAILED ? Buffer : NULL;
+    }
+
+    // Transparent huge pages need 2 MiB aligned ranges: map more and trim
+    uint8_t *Mapping = mmap(NULL, Size + ARENA_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (Mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    uint8_t *Buffer = (uint8_t *) (((uintptr_t) Mapping + ARENA_HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (ARENA_HUGE_PAGE_SIZE - 1));
+
+    if (Buffer != Mapping) {
+        munmap(Mapping, (size_t) (Buffer - Mapping));
+    }
+
+    munmap(Buffer + Size, (size_t) (Mapping + ARENA_HUGE_PAGE_SIZE - Buffer));
+    madvise(Buffer, Size, MADV_HUGEPAGE);
+
+    return Buffer;
+}
+
+void *ArenaAlloc(BUFFER_ARENA *Arena, uint64_t Size, uint64_t *Capacity) {
+    int Class = ArenaClass(Size);
+
+    if (Class == ARENA_CLASS_COUNT) {
+        return NULL;
+    }
+
+    *Capacity = 1ULL << (Class + ARENA_MIN_SHIFT);
+
+    pthread_mutex_lock(&Arena->mLock);
+
+    void *Buffer = Arena->mFree[Class];
+
+    if (Buffer != NULL) {
+        memcpy(&Arena->mFree[Class], Buffer, sizeof (void *));
+        Arena->mRetained -= *Capacity;
+        Arena->Reuses++;
+    } else {
+        Arena->Maps++;
+    }
+
+    pthread_mutex_unlock(&Arena->mLock);
+
+    // Mapping happens outside the lock, it is the slow part
+    return Buffer != NULL ? Buffer : ArenaMap(Arena, *Capacity);
+}
+
+void ArenaRecycle(BUFFER_ARENA *Arena, void *Buffer, uint64_t Capacity) {
+    if (Buffer == NULL) {
+        return;
+    }
+
+    int Class = ArenaClass(Capacity);
+
+    pthread_mutex_lock(&Arena->mLock);
+
+    if (Arena->mRetained + Capacity <= ARENA_RETAIN_LIMIT) {
+        memcpy(Buffer, &Arena->mFree[Class], sizeof (void *));
+        Arena->mFree[Class] = Buffer;
+        Arena->mRetained += Capacity;
+        Buffer = NULL;
+    }
+
+    pthread_mutex_unlock(&Arena->mLock);
+
+    if (Buffer != NULL) {
+        munmap(Buffer, Capacity);
+    }
+}
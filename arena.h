@@ -0,0 +1,82 @@
+//
+//  arena.h
+//  UEFIRomExtract
+//
+//  Size-classed pool of large buffers, recycled between images so bulk runs
+//  stop mapping, faulting in and unmapping an output buffer per image.
+//
+
+#ifndef UEFIRomExtract_arena_h
+#define UEFIRomExtract_arena_h
+
+#include <stdint.h>
+#include <pthread.h>
+
+//
+// gArenaFlags
+//
+#define ARENA_HUGE_TRANSPARENT 0x00000001  // madvise(MADV_HUGEPAGE) buffers of 2 MiB and more
+#define ARENA_HUGE_EXPLICIT    0x00000002  // MAP_HUGETLB for those, normal pages if none are reserved
+
+//
+// Power of two classes from 64 KiB up to the largest OrigSize.
+//
+#define ARENA_MIN_SHIFT    16
+#define ARENA_MAX_SHIFT    32
+#define ARENA_CLASS_COUNT  (ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+
+#define ARENA_HUGE_PAGE_SIZE  (2ULL * 1024 * 1024)
+
+//
+// Free buffers kept beyond this are unmapped instead.
+//
+#define ARENA_RETAIN_LIMIT  (256ULL * 1024 * 1024)
+
+//
+// One arena per worker. Freed buffers are linked through their first bytes.
+// The lock is uncontended unless another thread returns a buffer, as the
+// firmware volume walker does.
+//
+typedef struct {
+    void *mFree[ARENA_CLASS_COUNT];
+    uint64_t mRetained;
+    uint32_t mFlags;
+    pthread_mutex_t mLock;
+
+    uint64_t Maps;      // Buffers mapped from the kernel
+    uint64_t Reuses;    // Buffers handed out again from a free list
+} BUFFER_ARENA;
+
+//
+// Huge page flags for the arenas of this run, set from the command line.
+//
+extern uint32_t gArenaFlags;
+
+void ArenaInit(BUFFER_ARENA *Arena, uint32_t Flags);
+
+/**
+ Unmap every free buffer. Buffers still handed out must not be returned after.
+ **/
+void ArenaDestroy(BUFFER_ARENA *Arena);
+
+/**
+ Hand out a buffer of at least Size bytes.
+
+ @param  Arena    The arena.
+ @param  Size     The number of bytes needed.
+ @param  Capacity Receives the usable size, to pass back to ArenaRecycle().
+
+ @return The buffer, or NULL if it could not be mapped.
+ **/
+void *ArenaAlloc(BUFFER_ARENA *Arena, uint64_t Size, uint64_t *Capacity);
+
+/**
+ Return a buffer for reuse, or unmap it when the arena holds enough.
+
+ @param  Arena    The arena it came from.
+ @param  Buffer   The buffer, NULL is ignored.
+ @param  Capacity The capacity ArenaAlloc() returned for it.
+ **/
+void ArenaRecycle(BUFFER_ARENA *Arena, void *Buffer, uint64_t Capacity);
+
+#endif
@@ -0,0 +1,255 @@
+//
+//  bench.c
+//  UEFIRomExtract
+//
+//  In-process decoder benchmark.
+//
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "main.h"
+#include "bench.h"
+#include "interleave.h"
+
+typedef struct {
+    const char *Name;
+    uint32_t Flags;
+} BENCH_MODE;
+
+static const BENCH_MODE mBenchModes[] = {
+    { "unchecked", 0 },
+    { "hardened", DECOMPRESS_HARDENED },
+    { "pipelined", DECOMPRESS_PIPELINED }
+};
+
+#define BENCH_MODE_COUNT (sizeof (mBenchModes) / sizeof (mBenchModes[0]))
+
+static long BenchMinorFaults(void) {
+    struct rusage Usage;
+
+    getrusage(RUSAGE_SELF, &Usage);
+
+    return Usage.ru_minflt;
+}
+
+// Resident set size in bytes, from /proc/self/statm
+static uint64_t BenchResident(void) {
+    unsigned long long Pages = 0;
+    FILE *File = fopen("/proc/self/statm", "r");
+
+    if (File != NULL) {
+        if (fscanf(File, "%*u %llu", &Pages) != 1) {
+            Pages = 0;
+        }
+
+        fclose(File);
+    }
+
+    return Pages * (uint64_t) sysconf(_SC_PAGESIZE);
+}
+
+//
+// Decode into a fresh output buffer per image the way a bulk run would,
+// either malloc'd and freed each time or taken from and returned to an arena.
+//
+static int BenchAllocation(const uint8_t *Stream, uint32_t StreamSize, uint32_t OrigSize, SCRATCH_DATA *Scratch,
+                           const uint8_t *Reference, int Iterations) {
+    BUFFER_ARENA Arena;
+    int Status = 0;
+
+    ArenaInit(&Arena, gArenaFlags);
+
+    for (int Pooled = 0; Status == 0 && Pooled <= 1; Pooled++) {
+        struct timespec Start;
+        struct timespec End;
+        long Faults = BenchMinorFaults();
+
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+
+        for (int Iteration = 0; Iteration < Iterations; Iteration++) {
+            uint64_t Capacity = 0;
+            uint8_t *Buffer = Pooled ? ArenaAlloc(&Arena, OrigSize, &Capacity) : malloc(OrigSize > 0 ? OrigSize : 1);
+
+            if (Buffer == NULL) {
+                Status = -7;
+                break;
+            }
+
+            if (UefiDecompressEx(Stream, StreamSize, Buffer, OrigSize, Scratch, DECOMPRESS_HARDENED) != RETURN_SUCCESS ||
+                memcmp(Buffer, Reference, OrigSize) != 0) {
+                printf("%s: decode does not match the reference!\n", Pooled ? "arena" : "malloc");
+                Status = -8;
+            }
+
+            if (Pooled) {
+                ArenaRecycle(&Arena, Buffer, Capacity);
+            } else {
+                free(Buffer);
+            }
+
+            if (Status != 0) {
+                break;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &End);
+
+        if (Status == 0) {
+            printf("%-10s avg %8.1f us  %8.1f minor faults  rss %6.1f MB\n", Pooled ? "arena" : "malloc",
+                   ElapsedNs(&Start, &End) / 1e3 / Iterations, (double) (BenchMinorFaults() - Faults) / Iterations,
+                   BenchResident() / 1e6);
+        }
+    }
+
+    ArenaDestroy(&Arena);
+
+    return Status;
+}
+
+//
+// Decode Streams copies of the stream in lockstep, each with its own scratch
+// data and output, and report the time per image against decoding them in
+// turn with DecodeHardened().
+//
+static int BenchInterleaved(const uint8_t *Stream, uint32_t StreamSize, uint32_t OrigSize, const uint8_t *Reference,
+                            uint32_t Streams, int Iterations) {
+    INTERLEAVE_STREAM Interleave[INTERLEAVE_MAX_STREAMS];
+    uint8_t *Outputs = malloc((size_t) Streams * (OrigSize > 0 ? OrigSize : 1));
+    SCRATCH_DATA *Scratch = malloc(Streams * sizeof (SCRATCH_DATA));
+    uint64_t Best = UINT64_MAX;
+    int Status = 0;
+
+    if (Outputs == NULL || Scratch == NULL) {
+        free(Outputs);
+        free(Scratch);
+        return -7;
+    }
+
+    for (int Iteration = 0; Status == 0 && Iteration < Iterations; Iteration++) {
+        struct timespec Start;
+        struct timespec End;
+
+        for (uint32_t Index = 0; Index < Streams; Index++) {
+            Interleave[Index].Source = Stream;
+            Interleave[Index].SourceSize = StreamSize;
+            Interleave[Index].Destination = Outputs + (size_t) Index * OrigSize;
+            Interleave[Index].DestinationSize = OrigSize;
+            Interleave[Index].Scratch = &Scratch[Index];
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+        UefiDecompressInterleaved(Interleave, Streams);
+        clock_gettime(CLOCK_MONOTONIC, &End);
+
+        for (uint32_t Index = 0; Index < Streams; Index++) {
+            if (Interleave[Index].Status != RETURN_SUCCESS || memcmp(Interleave[Index].Destination, Reference, OrigSize) != 0) {
+                printf("interleaved x%u: decode does not match the reference!\n", Streams);
+                Status = -8;
+                break;
+            }
+        }
+
+        uint64_t Elapsed = ElapsedNs(&Start, &End);
+
+        if (Elapsed < Best) {
+            Best = Elapsed;
+        }
+    }
+
+    if (Status == 0) {
+        printf("interleaved x%u best %8.1f us per image  %7.1f MB/s\n", Streams, Best / 1e3 / Streams,
+               (double) OrigSize * Streams / (Best / 1e9) / 1e6);
+    }
+
+    free(Outputs);
+    free(Scratch);
+
+    return Status;
+}
+
+int BenchDecode(const char *InFile, int Iterations) {
+    EXTRACT_CONTEXT Ctx;
+    EFI_ROM_INFO RomInfo;
+    EXTRACT_STATS Stats;
+    uint8_t *Rom;
+    uint32_t RomSize;
+    uint8_t *Reference = NULL;
+    int Status = 0;
+
+    if (LoadInputFile(InFile, &Rom, &RomSize)) {
+        return -1;
+    }
+
+    if (ExtractContextInit(&Ctx)) {
+        free(Rom);
+        return -6;
+    }
+
+    // Locate the stream and size the buffers once, timing only the decodes below
+    Status = ExtractEfiImageFromBuffer(&Ctx, Rom, RomSize, &RomInfo, &Stats);
+
+    if (Status == 0) {
+        Reference = malloc(RomInfo.OrigSize);
+
+        if (Reference == NULL) {
+            Status = -7;
+        } else {
+            memcpy(Reference, Ctx.OutBuffer, RomInfo.OrigSize);
+        }
+    }
+
+    const uint8_t *Stream = Rom + RomInfo.RomOffset;
+    uint32_t StreamSize = RomSize - RomInfo.RomOffset;
+
+    for (size_t Mode = 0; Status == 0 && Mode < BENCH_MODE_COUNT; Mode++) {
+        uint64_t Best = UINT64_MAX;
+        uint64_t Total = 0;
+
+        for (int Iteration = 0; Iteration < Iterations; Iteration++) {
+            struct timespec Start;
+            struct timespec End;
+
+            memset(Ctx.OutBuffer, 0, RomInfo.OrigSize);
+
+            clock_gettime(CLOCK_MONOTONIC, &Start);
+            RETURN_STATUS Result = UefiDecompressEx(Stream, StreamSize, Ctx.OutBuffer, Ctx.OutCapacity, Ctx.Scratch,
+                                                    mBenchModes[Mode].Flags);
+            clock_gettime(CLOCK_MONOTONIC, &End);
+
+            if (Result != RETURN_SUCCESS || memcmp(Ctx.OutBuffer, Reference, RomInfo.OrigSize) != 0) {
+                printf("%s: decode does not match the reference!\n", mBenchModes[Mode].Name);
+                Status = -8;
+                break;
+            }
+
+            uint64_t Elapsed = ElapsedNs(&Start, &End);
+
+            Total += Elapsed;
+            if (Elapsed < Best) {
+                Best = Elapsed;
+            }
+        }
+
+        if (Status == 0) {
+            printf("%-10s best %8.1f us  avg %8.1f us  %7.1f MB/s\n", mBenchModes[Mode].Name,
+                   Best / 1e3, Total / 1e3 / Iterations, RomInfo.OrigSize / (Best / 1e9) / 1e6);
+        }
+    }
+
+    for (uint32_t Streams = INTERLEAVE_MIN_STREAMS; Status == 0 && Streams <= INTERLEAVE_MAX_STREAMS; Streams *= 2) {
+        Status = BenchInterleaved(Stream, StreamSize, RomInfo.OrigSize, Reference, Streams, Iterations);
+    }
+
+    // Hardened decodes per image, with the output buffer cost included
+    if (Status == 0) {
+        Status = BenchAllocation(Stream, StreamSize, RomInfo.OrigSize, Ctx.Scratch, Reference, Iterations);
+    }
+
+    free(Reference);
+    ExtractContextFree(&Ctx);
+    free(Rom);
+
+    return Status;
+}
@@ -0,0 +1,26 @@
+//
+//  bench.h
+//  UEFIRomExtract
+//
+//  In-process decoder benchmark.
+//
+
+#ifndef UEFIRomExtract_bench_h
+#define UEFIRomExtract_bench_h
+
+/**
+ Decode the compressed EFI image of InFile Iterations times with every
+ decoder mode and print the throughput of each, checking that all modes
+ produce the same output, and of 2 and 4 copies decoded interleaved. Then
+ compare a malloc'd output buffer per image against one recycled through a
+ BUFFER_ARENA in time, minor page faults and resident memory.
+
+ @param  InFile     The option ROM or raw compressed file.
+ @param  Iterations The number of decodes per mode.
+
+ @retval  0 OK.
+ @retval  <0 The input could not be decoded or the modes disagree.
+ **/
+int BenchDecode(const char *InFile, int Iterations);
+
+#endif
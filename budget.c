@@ -0,0 +1,253 @@
+//
+//  budget.c
+//  UEFIRomExtract
+//
+//  Memory budget for the workers of multi-threaded runs: an image is only
+//  decoded once its input and output fit in what the other workers leave.
+//
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "budget.h"
+
+int BudgetInit(MEMORY_BUDGET *Budget, uint64_t Limit, int Workers) {
+    memset(Budget, 0, sizeof (*Budget));
+
+    Budget->Limit = Limit;
+    Budget->Keep = Limit / ((uint64_t) BUDGET_KEEP_DIVISOR * (uint64_t) Workers);
+    // Room for one image next to the warm input and output of every worker, its own included
+    Budget->MaxImage = Limit - 2 * (uint64_t) Workers * Budget->Keep;
+
+    if (Budget->MaxImage == 0) {
+        return -1;
+    }
+
+    pthread_mutex_init(&Budget->mLock, NULL);
+    pthread_cond_init(&Budget->mWake, NULL);
+
+    return 0;
+}
+
+void BudgetFree(MEMORY_BUDGET *Budget) {
+    pthread_cond_destroy(&Budget->mWake);
+    pthread_mutex_destroy(&Budget->mLock);
+}
+
+// Called with the lock held
+static void BudgetCharge(MEMORY_BUDGET *Budget, uint64_t Bytes) {
+    Budget->mInUse += Bytes;
+
+    if (Budget->mInUse > Budget->Peak) {
+        Budget->Peak = Budget->mInUse;
+    }
+}
+
+static void BudgetAcquire(MEMORY_BUDGET *Budget, uint64_t Bytes) {
+    pthread_mutex_lock(&Budget->mLock);
+
+    uint64_t Ticket = Budget->mNextTicket++;
+    int Waited = 0;
+
+    // The head of the line waits for room, everyone else for the head
+    while (Ticket != Budget->mServing || Budget->mInUse + Bytes > Budget->Limit) {
+        Waited = 1;
+        pthread_cond_wait(&Budget->mWake, &Budget->mLock);
+    }
+
+    Budget->mServing++;
+    Budget->Waits += (uint64_t) Waited;
+    BudgetCharge(Budget, Bytes);
+
+    pthread_cond_broadcast(&Budget->mWake);
+    pthread_mutex_unlock(&Budget->mLock);
+}
+
+// Charge Bytes only if nobody is waiting and they fit right away
+static int BudgetTryAcquire(MEMORY_BUDGET *Budget, uint64_t Bytes) {
+    int Status = -1;
+
+    pthread_mutex_lock(&Budget->mLock);
+
+    if (Budget->mServing == Budget->mNextTicket && Budget->mInUse + Bytes <= Budget->Limit) {
+        BudgetCharge(Budget, Bytes);
+        Status = 0;
+    }
+
+    pthread_mutex_unlock(&Budget->mLock);
+
+    return Status;
+}
+
+static void BudgetReject(MEMORY_BUDGET *Budget) {
+    pthread_mutex_lock(&Budget->mLock);
+    Budget->Rejected++;
+    pthread_mutex_unlock(&Budget->mLock);
+}
+
+void BudgetRelease(MEMORY_BUDGET *Budget, uint64_t Bytes) {
+    if (Bytes == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&Budget->mLock);
+    Budget->mInUse -= Bytes;
+    pthread_cond_broadcast(&Budget->mWake);
+    pthread_mutex_unlock(&Budget->mLock);
+}
+
+static void BudgetDropInput(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, uint8_t **InBuffer, uint32_t *InCapacity) {
+    free(*InBuffer);
+    *InBuffer = NULL;
+    *InCapacity = 0;
+    BudgetRelease(Budget, Ctx->mBudgetInput);
+    Ctx->mBudgetInput = 0;
+}
+
+// Read Fd into a buffer of exactly the charged size; LoadInputFd() only grows it if the input grew
+static int BudgetReadInput(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, int Fd, uint8_t **InBuffer, uint32_t *InCapacity,
+                           uint32_t *InSize) {
+    if (*InCapacity < Ctx->mBudgetInput) {
+        free(*InBuffer);
+        *InCapacity = 0;
+
+        if ((*InBuffer = malloc((size_t) Ctx->mBudgetInput)) == NULL) {
+            BudgetDropInput(Budget, Ctx, InBuffer, InCapacity);
+            return -7;
+        }
+
+        *InCapacity = (uint32_t) Ctx->mBudgetInput;
+    }
+
+    if (LoadInputFd(Fd, InBuffer, InCapacity, InSize) || *InCapacity > Ctx->mBudgetInput) {
+        if (*InCapacity > Ctx->mBudgetInput) {
+            BudgetDropInput(Budget, Ctx, InBuffer, InCapacity);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+int BudgetLoadInput(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, int Fd, uint8_t **InBuffer, uint32_t *InCapacity,
+                    uint32_t *InSize) {
+    struct stat St;
+
+    *InSize = 0;
+
+    if (fstat(Fd, &St) != 0 || !S_ISREG(St.st_mode) || (uint64_t) St.st_size + 1 > Budget->MaxImage) {
+        BudgetReject(Budget);
+        return -12;
+    }
+
+    // LoadInputFd() reads into one byte more than the size, to see the end
+    uint64_t Need = (uint64_t) St.st_size + 1;
+
+    if (Ctx->mBudgetInput < Need) {
+        BudgetDropInput(Budget, Ctx, InBuffer, InCapacity);
+        BudgetAcquire(Budget, Need);
+        Ctx->mBudgetInput = Need;
+    }
+
+    return BudgetReadInput(Budget, Ctx, Fd, InBuffer, InCapacity, InSize);
+}
+
+int BudgetAdmitImage(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, int Fd, uint8_t **InBuffer, uint32_t *InCapacity,
+                     uint32_t *InSize, EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats) {
+    uint32_t OrigSize = RomInfo->OrigSize;
+    uint32_t Admitted = *InSize;
+    uint64_t Input = (uint64_t) Admitted + 1;
+
+    if (Input + OrigSize > Budget->MaxImage) {
+        BudgetReject(Budget);
+        return -12;
+    }
+
+    if (Ctx->OutCapacity >= OrigSize) {
+        return 0;
+    }
+
+    // A buffer about to be replaced is given back before waiting, never held while waiting
+    ExtractContextDropOutput(Ctx);
+    BudgetRelease(Budget, Ctx->mBudgetHeld);
+    Ctx->mBudgetHeld = 0;
+
+    if (BudgetTryAcquire(Budget, OrigSize) == 0) {
+        Ctx->mBudgetHeld = OrigSize;
+        return 0;
+    }
+
+    // Held while waiting, the input could keep the head of the line from ever fitting
+    BudgetDropInput(Budget, Ctx, InBuffer, InCapacity);
+    BudgetAcquire(Budget, Input + OrigSize);
+    Ctx->mBudgetInput = Input;
+    Ctx->mBudgetHeld = OrigSize;
+
+    int Result = BudgetReadInput(Budget, Ctx, Fd, InBuffer, InCapacity, InSize);
+
+    if (Result == 0) {
+        Result = LocateEfiStream(Ctx, *InBuffer, *InSize, RomInfo, Stats);
+    }
+
+    // Replaced while we waited: the admission no longer matches it
+    if (Result == 0 && (*InSize != Admitted || RomInfo->OrigSize != OrigSize)) {
+        Result = -1;
+    }
+
+    return Result;
+}
+
+void BudgetFinishImage(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, uint8_t **InBuffer, uint32_t *InCapacity) {
+    if (*InCapacity > Budget->Keep) {
+        BudgetDropInput(Budget, Ctx, InBuffer, InCapacity);
+    }
+
+    if (Ctx->OutCapacity > Budget->Keep) {
+        ExtractContextDropOutput(Ctx);
+    }
+
+    // What was charged for an output that failed to allocate or was just freed
+    uint64_t Unused = Ctx->mBudgetHeld - Ctx->OutCapacity;
+
+    Ctx->mBudgetHeld = Ctx->OutCapacity;
+    BudgetRelease(Budget, Unused);
+}
+
+void BudgetLeave(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, uint8_t **InBuffer, uint32_t *InCapacity) {
+    BudgetDropInput(Budget, Ctx, InBuffer, InCapacity);
+    ExtractContextDropOutput(Ctx);
+    BudgetRelease(Budget, Ctx->mBudgetHeld);
+    Ctx->mBudgetHeld = 0;
+}
+
+int BudgetAcquireDecode(MEMORY_BUDGET *Budget, uint64_t Bytes) {
+    int Waited = 0;
+
+    pthread_mutex_lock(&Budget->mLock);
+
+    while (Budget->mInUse + Bytes > Budget->Limit && Budget->mInFlight != 0) {
+        Waited = 1;
+        pthread_cond_wait(&Budget->mWake, &Budget->mLock);
+    }
+
+    int Fits = Budget->mInUse + Bytes <= Budget->Limit;
+
+    if (Fits) {
+        Budget->mInFlight++;
+        BudgetCharge(Budget, Bytes);
+        Budget->Waits += (uint64_t) Waited;
+    } else {
+        Budget->Rejected++;
+    }
+
+    pthread_mutex_unlock(&Budget->mLock);
+
+    return Fits ? 0 : -12;
+}
+
+void BudgetDecodeDone(MEMORY_BUDGET *Budget) {
+    pthread_mutex_lock(&Budget->mLock);
+    Budget->mInFlight--;
+    pthread_cond_broadcast(&Budget->mWake);
+    pthread_mutex_unlock(&Budget->mLock);
+}
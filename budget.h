@@ -0,0 +1,117 @@
+//
+//  budget.h
+//  UEFIRomExtract
+//
+//  Memory budget for the workers of multi-threaded runs: an image is only
+//  decoded once its input and output fit in what the other workers leave.
+//
+
+#ifndef UEFIRomExtract_budget_h
+#define UEFIRomExtract_budget_h
+
+#include <stdint.h>
+#include <pthread.h>
+#include "main.h"
+
+//
+// Warm input and output buffers of up to Limit / (BUDGET_KEEP_DIVISOR *
+// Workers) each stay with their worker between images and stay charged to
+// the budget; bigger ones are freed after every image. Whatever the idle
+// workers keep, an image of up to MaxImage bytes can always be admitted
+// eventually.
+//
+#define BUDGET_KEEP_DIVISOR  8
+
+typedef struct {
+    pthread_mutex_t mLock;
+    pthread_cond_t mWake;
+    uint64_t mInUse;
+    uint64_t mNextTicket;      // Admissions are granted in arrival order, so
+    uint64_t mServing;         // large images are not starved by small ones
+    uint32_t mInFlight;        // Decodes admitted by BudgetAcquireDecode() and not yet done
+
+    uint64_t Limit;
+    uint64_t Keep;             // Largest warm input or output buffer a worker keeps
+    uint64_t MaxImage;         // Largest input plus output admitted
+    uint64_t Peak;             // Most ever charged at once
+    uint64_t Waits;            // Admissions that had to wait for memory
+    uint64_t Rejected;
+} MEMORY_BUDGET;
+
+/**
+ Set up a budget of Limit bytes shared by Workers threads.
+
+ @retval  0 OK.
+ @retval  -1 The budget is too small to admit anything.
+ **/
+int BudgetInit(MEMORY_BUDGET *Budget, uint64_t Limit, int Workers);
+
+void BudgetFree(MEMORY_BUDGET *Budget);
+
+/**
+ Charge the input of a worker before reading it, then read it. Only
+ descriptors whose size fstat() knows, regular files and memfds, can be
+ charged up front. The input buffer is malloc'd to exactly the size charged
+ and kept, charged, for the next input if it is small enough.
+
+ @param  Budget     The budget.
+ @param  Ctx        The worker's context, which tracks what it has charged.
+ @param  Fd         The input, left open for BudgetAdmitImage().
+ @param  InBuffer   The worker's reusable input buffer.
+ @param  InCapacity Its allocated size.
+ @param  InSize     Receives the number of bytes read.
+
+ @retval  0 Read.
+ @retval  -1 Read error, or the input changed size while being read.
+ @retval  -7 The buffer could not be allocated.
+ @retval  -12 The input alone exceeds the budget or has no known size.
+ **/
+int BudgetLoadInput(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, int Fd, uint8_t **InBuffer, uint32_t *InCapacity,
+                    uint32_t *InSize);
+
+/**
+ Charge the output of the image LocateEfiStream() found in an input read
+ by BudgetLoadInput(). If it has to wait for memory, the input is given
+ back first and read again from Fd, and located again, once the input and
+ output are admitted together, so a waiting worker never holds more than
+ its warm buffers. The output buffer of Ctx must come from malloc, not an
+ arena.
+
+ @retval  0 Admitted.
+ @retval  -1 The input changed while waiting.
+ @retval  -7 The input buffer could not be allocated again.
+ @retval  -12 The image alone exceeds the budget and is rejected.
+ **/
+int BudgetAdmitImage(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, int Fd, uint8_t **InBuffer, uint32_t *InCapacity,
+                     uint32_t *InSize, EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats);
+
+/**
+ Free the warm input and output buffers larger than Budget->Keep once an
+ image is done, whether or not it was admitted, and return the charge of
+ what was freed or never allocated.
+ **/
+void BudgetFinishImage(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, uint8_t **InBuffer, uint32_t *InCapacity);
+
+/**
+ Free the warm buffers of a worker that stops and return their charge.
+ **/
+void BudgetLeave(MEMORY_BUDGET *Budget, EXTRACT_CONTEXT *Ctx, uint8_t **InBuffer, uint32_t *InCapacity);
+
+/**
+ Charge Bytes for a decode whose output outlives it, as the sections of
+ -F do while their children are walked. Waits only while another decode
+ admitted this way is still running: buffers still referenced by queued
+ jobs are only freed once those jobs run, so waiting for them with
+ nothing running would wait forever.
+
+ @retval  0 Admitted; call BudgetDecodeDone() once the decode is over and
+            BudgetRelease() once its output is freed.
+ @retval  -12 Bytes do not fit next to what is held and nothing else runs.
+ **/
+int BudgetAcquireDecode(MEMORY_BUDGET *Budget, uint64_t Bytes);
+
+void BudgetDecodeDone(MEMORY_BUDGET *Budget);
+
+void BudgetRelease(MEMORY_BUDGET *Budget, uint64_t Bytes);
+
+#endif
@@ -0,0 +1,485 @@
+//
+//  dedupe.c
+//  UEFIRomExtract
+//
+//  Cross-input deduplication of extracted images within a batch.
+//
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "dedupe.h"
+#include "profile.h"
+#include "manifest.h"
+
+void DigestIndexInit(DIGEST_INDEX *Index) {
+    memset(Index, 0, sizeof (*Index));
+}
+
+void DigestIndexFree(DIGEST_INDEX *Index) {
+    free(Index->mEntries);
+    memset(Index, 0, sizeof (*Index));
+}
+
+// Digests are uniformly distributed already, their first bytes make a fine hash
+static uint32_t DigestSlot(const DIGEST_INDEX *Index, const uint8_t *Key) {
+    uint32_t Hash;
+
+    memcpy(&Hash, Key, sizeof (Hash));
+
+    return Hash & (Index->mCapacity - 1);
+}
+
+DIGEST_ENTRY *DigestIndexFind(const DIGEST_INDEX *Index, const uint8_t *Key) {
+    if (Index->mCapacity == 0) {
+        return NULL;
+    }
+
+    for (uint32_t Slot = DigestSlot(Index, Key);; Slot = (Slot + 1) & (Index->mCapacity - 1)) {
+        DIGEST_ENTRY *Entry = &Index->mEntries[Slot];
+
+        if (!Entry->Used) {
+            return NULL;
+        }
+
+        if (memcmp(Entry->Key, Key, SHA256_DIGEST_SIZE) == 0) {
+            return Entry;
+        }
+    }
+}
+
+static int DigestIndexGrow(DIGEST_INDEX *Index) {
+    DIGEST_INDEX Grown;
+
+    Grown.mCapacity = Index->mCapacity != 0 ? Index->mCapacity * 2 : 256;
+    Grown.mCount = 0;
+    Grown.mEntries = calloc(Grown.mCapacity, sizeof (DIGEST_ENTRY));
+
+    if (Grown.mEntries == NULL) {
+        return -1;
+    }
+
+    for (uint32_t Slot = 0; Slot < Index->mCapacity; Slot++) {
+        if (Index->mEntries[Slot].Used) {
+            DigestIndexInsert(&Grown, Index->mEntries[Slot].Key, Index->mEntries[Slot].Value);
+        }
+    }
+
+    free(Index->mEntries);
+    *Index = Grown;
+
+    return 0;
+}
+
+int DigestIndexInsert(DIGEST_INDEX *Index, const uint8_t *Key, const uint8_t *Value) {
+    DIGEST_ENTRY *Entry = DigestIndexFind(Index, Key);
+
+    if (Entry == NULL) {
+        // Keep the load factor under 3/4
+        if ((Index->mCount + 1) * 4 > Index->mCapacity * 3 && DigestIndexGrow(Index)) {
+            return -1;
+        }
+
+        uint32_t Slot = DigestSlot(Index, Key);
+
+        while (Index->mEntries[Slot].Used) {
+            Slot = (Slot + 1) & (Index->mCapacity - 1);
+        }
+
+        Entry = &Index->mEntries[Slot];
+        Entry->Used = 1;
+        memcpy(Entry->Key, Key, SHA256_DIGEST_SIZE);
+        Index->mCount++;
+    }
+
+    memcpy(Entry->Value, Value, SHA256_DIGEST_SIZE);
+
+    return 0;
+}
+
+int DedupeImagePresent(const char *Path, uint32_t Size) {
+    struct stat St;
+
+    return stat(Path, &St) == 0 && S_ISREG(St.st_mode) && (uint64_t) St.st_size == Size;
+}
+
+// Write an image under a hidden temporary name and rename it into place once it is on disk
+static int DedupeWriteImage(const char *OutDir, const char *Hex, mode_t Mode, const uint8_t *Data, uint32_t Size) {
+    char Path[4096];
+    char TempPath[4096];
+
+    if ((size_t) snprintf(Path, sizeof (Path), "%s/%s.efi", OutDir, Hex) >= sizeof (Path) ||
+        (size_t) snprintf(TempPath, sizeof (TempPath), "%s/.%s.efi.XXXXXX", OutDir, Hex) >= sizeof (TempPath)) {
+        Print("Output path in %s is too long!\n", OutDir);
+        return -9;
+    }
+
+    int Fd = mkostemp(TempPath, O_CLOEXEC);
+
+    if (Fd < 0) {
+        Print("Error opening output file %s!\n", TempPath);
+        return -9;
+    }
+
+    int Failed = fchmod(Fd, Mode) != 0;
+
+    for (uint32_t Done = 0; !Failed && Done < Size;) {
+        ssize_t Put = write(Fd, Data + Done, Size - Done);
+
+        if (Put < 0 && errno == EINTR) {
+            continue;
+        }
+
+        Failed = Put <= 0;
+        Done += Put > 0 ? (uint32_t) Put : 0;
+    }
+
+    Failed |= fsync(Fd) != 0;
+    Failed |= close(Fd) != 0;
+
+    if (Failed || rename(TempPath, Path) != 0) {
+        Print("Failed to write output file %s!\n", Path);
+        unlink(TempPath);
+        return -9;
+    }
+
+    return 0;
+}
+
+/**
+ Write a manifest under a temporary name and rename it over Path once it is
+ on disk, so Path always holds a complete manifest.
+
+ @param  Path     The manifest to replace.
+ @param  Mode     The mode to give it.
+ @param  Manifest The records to write.
+ @param  InFiles  Only write the records of these inputs, in their order, or NULL for all.
+ @param  InCount  The number of inputs.
+
+ @retval  0 OK.
+ @retval  -9 The manifest could not be written.
+ **/
+static int DedupeReplaceManifest(const char *Path, mode_t Mode, const MANIFEST *Manifest, const char *const *InFiles,
+                                 int InCount) {
+    char TempPath[4096];
+
+    if ((size_t) snprintf(TempPath, sizeof (TempPath), "%s.XXXXXX", Path) >= sizeof (TempPath)) {
+        return -9;
+    }
+
+    int Fd = mkostemp(TempPath, O_CLOEXEC);
+
+    if (Fd < 0) {
+        return -9;
+    }
+
+    FILE *File = fdopen(Fd, "w");
+
+    if (File == NULL) {
+        close(Fd);
+        unlink(TempPath);
+        return -9;
+    }
+
+    int Failed = fchmod(Fd, Mode) != 0;
+
+    for (uint32_t Index = 0; InFiles == NULL && Index < Manifest->mCount; Index++) {
+        ManifestWriteRecord(File, &Manifest->mRecords[Index]);
+    }
+
+    for (int Index = 0; InFiles != NULL && Index < InCount; Index++) {
+        const MANIFEST_RECORD *Record = ManifestFind(Manifest, InFiles[Index]);
+
+        if (Record != NULL) {
+            ManifestWriteRecord(File, Record);
+        }
+    }
+
+    Failed |= fflush(File) != 0 || fsync(Fd) != 0;
+    Failed |= fclose(File) != 0;
+
+    if (Failed || rename(TempPath, Path) != 0) {
+        unlink(TempPath);
+        return -9;
+    }
+
+    return 0;
+}
+
+// Failures caused by the input itself come back the same on every run
+static int DedupeResultFinal(int Result) {
+    return Result != -6 && Result != -7 && Result != -9;
+}
+
+// Whether an earlier record still stands: same decoder checks and, for an image, still on disk
+static int DedupeReusable(const char *OutDir, const MANIFEST_RECORD *Previous, uint32_t DecompressFlags) {
+    char Hex[SHA256_HEX_SIZE];
+    char Path[4096];
+
+    if (Previous->Hardened != ((DecompressFlags & DECOMPRESS_HARDENED) != 0) || !DedupeResultFinal(Previous->Result)) {
+        return 0;
+    }
+
+    if (Previous->Result != 0) {
+        return 1;
+    }
+
+    Sha256Hex(Previous->Content, Hex);
+
+    if ((size_t) snprintf(Path, sizeof (Path), "%s/%s.efi", OutDir, Hex) >= sizeof (Path)) {
+        return 0;
+    }
+
+    // Images written before they were renamed into place may have been left torn
+    return Previous->HasContent && DedupeImagePresent(Path, Previous->RomInfo.OrigSize);
+}
+
+int ExtractDeduplicated(const char *OutDir, const char *ManifestName, uint32_t DecompressFlags, int Incremental,
+                        EXTRACT_REPORT *Report, const char *const *InFiles, int InCount) {
+    EXTRACT_CONTEXT Ctx;
+    BUFFER_ARENA Arena;
+    DIGEST_INDEX Payloads;
+    DIGEST_INDEX Images;
+    MANIFEST Previous;
+    char ManifestPath[4096];
+    char TempPath[4096];
+    char Path[4096];
+    int Status = 0;
+    int Decodes = 0;
+    int Unchanged = 0;
+
+    if (mkdir(OutDir, 0755) != 0 && errno != EEXIST) {
+        Print("Failed to create output directory %s!\n", OutDir);
+        return -9;
+    }
+
+    if ((size_t) snprintf(ManifestPath, sizeof (ManifestPath), "%s/%s", OutDir, ManifestName) >= sizeof (ManifestPath) ||
+        (size_t) snprintf(TempPath, sizeof (TempPath), "%s%s", ManifestPath, MANIFEST_TEMP_SUFFIX) >= sizeof (TempPath)) {
+        Print("Manifest path in %s is too long!\n", OutDir);
+        return -9;
+    }
+
+    // Images get the mode fopen() would have given them
+    mode_t Mask = umask(0);
+
+    umask(Mask);
+
+    ManifestInit(&Previous);
+    DigestIndexInit(&Payloads);
+    DigestIndexInit(&Images);
+
+    // The records an interrupted run left in the temporary manifest are newer
+    if (Incremental && (ManifestLoad(&Previous, ManifestPath) || ManifestLoad(&Previous, TempPath))) {
+        Print("Failed to load manifest %s!\n", ManifestPath);
+        ManifestFree(&Previous);
+        return -7;
+    }
+
+    // Images still on disk need neither decoding nor writing again
+    for (uint32_t Index = 0; Index < Previous.mCount; Index++) {
+        const MANIFEST_RECORD *Record = &Previous.mRecords[Index];
+
+        if (Record->HasPayload && DedupeReusable(OutDir, Record, DecompressFlags) && Record->Result == 0 &&
+            (DigestIndexInsert(&Payloads, Record->Payload, Record->Content) ||
+             DigestIndexInsert(&Images, Record->Content, Record->Content))) {
+            Print("Failed to load manifest %s!\n", ManifestPath);
+            Status = -7;
+            break;
+        }
+    }
+
+    // A resumed run carries the records it loaded over, so being interrupted
+    // again loses none of them; later records of an input replace earlier ones
+    if (Status == 0 && Incremental && DedupeReplaceManifest(TempPath, 0666 & ~Mask, &Previous, NULL, 0)) {
+        Print("Error writing manifest %s!\n", TempPath);
+        Status = -9;
+    }
+
+    // Written as the run goes and renamed over the manifest at the end
+    FILE *Manifest = Status == 0 ? fopen(TempPath, Incremental ? "a" : "w") : NULL;
+
+    if (Manifest == NULL) {
+        if (Status == 0) {
+            Print("Error opening manifest %s!\n", TempPath);
+        }
+
+        DigestIndexFree(&Payloads);
+        DigestIndexFree(&Images);
+        ManifestFree(&Previous);
+        return Status != 0 ? Status : -9;
+    }
+
+    if (ExtractContextInit(&Ctx)) {
+        Print("Scratch buffer allocation failed!\n");
+        fclose(Manifest);
+        DigestIndexFree(&Payloads);
+        DigestIndexFree(&Images);
+        ManifestFree(&Previous);
+        return -6;
+    }
+
+    ArenaInit(&Arena, gArenaFlags);
+    Ctx.Arena = &Arena;
+    Ctx.DecompressFlags = DecompressFlags;
+
+    for (int Index = 0; Index < InCount; Index++) {
+        MANIFEST_RECORD Record;
+        EXTRACT_STATS Stats;
+        struct stat St;
+        uint8_t *Rom = NULL;
+        uint32_t RomSize;
+
+        memset(&Record, 0, sizeof (Record));
+        Record.Input = (char *) InFiles[Index];
+        Record.Hardened = (DecompressFlags & DECOMPRESS_HARDENED) != 0;
+
+        if (strcmp(InFiles[Index], "-") != 0 && stat(InFiles[Index], &St) == 0) {
+            Record.Size = (uint64_t) St.st_size;
+            Record.MTimeNs = (int64_t) St.st_mtim.tv_sec * 1000000000LL + St.st_mtim.tv_nsec;
+        }
+
+        const MANIFEST_RECORD *Known = Incremental && Record.Size != 0 ? ManifestFind(&Previous, InFiles[Index]) : NULL;
+
+        if (Known != NULL && !DedupeReusable(OutDir, Known, DecompressFlags)) {
+            Known = NULL;
+        }
+
+        // Unchanged by size and time: not even read
+        if (Known != NULL && Known->Size == Record.Size && Known->MTimeNs == Record.MTimeNs) {
+            ManifestWriteRecord(Manifest, Known);
+            fflush(Manifest);
+            Unchanged++;
+            continue;
+        }
+
+        ExtractStatsInit(&Stats);
+        PhaseBegin(&Stats, EXTRACT_PHASE_PARSE);
+
+        int Result = LoadInputFile(InFiles[Index], &Rom, &RomSize);
+
+        if (Result == 0) {
+            Sha256(Rom, RomSize, Record.InputHash);
+            Record.HasInputHash = 1;
+
+            // Touched but not changed: keep the record, with the new time
+            if (Known != NULL && Known->HasInputHash && memcmp(Known->InputHash, Record.InputHash, SHA256_DIGEST_SIZE) == 0) {
+                MANIFEST_RECORD Touched = *Known;
+
+                Touched.Size = Record.Size;
+                Touched.MTimeNs = Record.MTimeNs;
+                ManifestWriteRecord(Manifest, &Touched);
+                fflush(Manifest);
+                free(Rom);
+                Unchanged++;
+                continue;
+            }
+
+            Result = LocateEfiStream(&Ctx, Rom, RomSize, &Record.RomInfo, &Stats);
+        }
+
+        if (Result == 0) {
+            // The same payload inside another container decodes to the same image
+            Sha256(Rom + Record.RomInfo.RomOffset, (size_t) Record.RomInfo.CompSize + 8, Record.Payload);
+            Record.HasPayload = 1;
+
+            DIGEST_ENTRY *Cached = DigestIndexFind(&Payloads, Record.Payload);
+
+            if (Cached != NULL) {
+                memcpy(Record.Content, Cached->Value, sizeof (Record.Content));
+            } else {
+                Result = DecodeEfiStream(&Ctx, Rom, RomSize, &Record.RomInfo, &Stats);
+
+                if (Result == 0) {
+                    Record.Decoded = 1;
+                    Decodes++;
+                    Sha256(Ctx.OutBuffer, Record.RomInfo.OrigSize, Record.Content);
+
+                    if (DigestIndexInsert(&Payloads, Record.Payload, Record.Content)) {
+                        Result = -7;
+                    }
+                }
+            }
+        }
+
+        // Different payloads can still decode to the same image, write each one once
+        if (Result == 0 && Record.Decoded && DigestIndexFind(&Images, Record.Content) == NULL) {
+            char Hex[SHA256_HEX_SIZE];
+
+            PhaseBegin(&Stats, EXTRACT_PHASE_WRITE);
+            Sha256Hex(Record.Content, Hex);
+
+            // Content addressed and renamed into place complete, so a copy of the right size is right
+            if ((size_t) snprintf(Path, sizeof (Path), "%s/%s.efi", OutDir, Hex) >= sizeof (Path)) {
+                Print("Output path in %s is too long!\n", OutDir);
+                Result = -9;
+            } else if (!DedupeImagePresent(Path, Record.RomInfo.OrigSize)) {
+                Result = DedupeWriteImage(OutDir, Hex, 0666 & ~Mask, Ctx.OutBuffer, Record.RomInfo.OrigSize);
+            }
+
+            if (Result == 0 && DigestIndexInsert(&Images, Record.Content, Record.Content)) {
+                Result = -7;
+            }
+        }
+
+        PhaseEnd(&Stats);
+        free(Rom);
+
+        Record.HasContent = Result == 0;
+        Record.Result = Result;
+
+        // Flushed per input, so an interrupted run keeps what it finished
+        ManifestWriteRecord(Manifest, &Record);
+        fflush(Manifest);
+        ReportImage(Report, InFiles[Index], &Record.RomInfo, &Stats, Result);
+        ProfileImage(InFiles[Index]);
+
+        if (Result != 0) {
+            Print("Skipping %s (error %d)\n", InFiles[Index], Result);
+            Status = Result;
+        }
+    }
+
+    if (Incremental) {
+        Print("%d inputs, %d unchanged, %d payloads decoded, %u distinct images\n", InCount, Unchanged, Decodes, Images.mCount);
+    } else {
+        Print("%d inputs, %d payloads decoded, %u distinct images\n", InCount, Decodes, Images.mCount);
+    }
+
+    DigestIndexFree(&Payloads);
+    DigestIndexFree(&Images);
+    ManifestFree(&Previous);
+    ExtractContextFree(&Ctx);
+    ArenaDestroy(&Arena);
+
+    // Only a complete manifest replaces the previous one
+    int Failed = fflush(Manifest) != 0 || fsync(fileno(Manifest)) != 0;
+
+    Failed |= fclose(Manifest) != 0;
+
+    // Keeping only the records of this run's inputs, once each
+    if (!Failed && Incremental) {
+        MANIFEST Final;
+
+        ManifestInit(&Final);
+        Failed = ManifestLoad(&Final, TempPath) || DedupeReplaceManifest(ManifestPath, 0666 & ~Mask, &Final, InFiles, InCount);
+        ManifestFree(&Final);
+
+        if (!Failed) {
+            unlink(TempPath);
+        }
+    } else if (!Failed) {
+        Failed = rename(TempPath, ManifestPath) != 0;
+    }
+
+    if (Failed) {
+        Print("Failed to write manifest!\n");
+        return -9;
+    }
+
+    return Status;
+}
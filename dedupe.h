@@ -0,0 +1,87 @@
+//
+//  dedupe.h
+//  UEFIRomExtract
+//
+//  Cross-input deduplication of extracted images within a batch.
+//
+
+#ifndef UEFIRomExtract_dedupe_h
+#define UEFIRomExtract_dedupe_h
+
+#include <stdint.h>
+#include "report.h"
+#include "sha256.h"
+
+#define DEDUPE_MANIFEST "manifest.ndjson"
+
+//
+// Open addressing map from one SHA-256 digest to another.
+//
+typedef struct {
+    uint8_t Key[SHA256_DIGEST_SIZE];
+    uint8_t Value[SHA256_DIGEST_SIZE];
+    uint8_t Used;
+} DIGEST_ENTRY;
+
+typedef struct {
+    DIGEST_ENTRY *mEntries;
+    uint32_t mCapacity;      // Always a power of two
+    uint32_t mCount;
+} DIGEST_INDEX;
+
+void DigestIndexInit(DIGEST_INDEX *Index);
+
+void DigestIndexFree(DIGEST_INDEX *Index);
+
+/**
+ Look a digest up.
+
+ @return The entry holding Key, or NULL if it is not in the index.
+ **/
+DIGEST_ENTRY *DigestIndexFind(const DIGEST_INDEX *Index, const uint8_t *Key);
+
+/**
+ Add or replace the value stored for Key.
+
+ @retval  0 OK.
+ @retval  -1 The index could not grow.
+ **/
+int DigestIndexInsert(DIGEST_INDEX *Index, const uint8_t *Key, const uint8_t *Value);
+
+/**
+ Check that an image of a deduplicated directory is complete. Images are
+ renamed into place once written, but a directory may hold images an older
+ run wrote in place and left torn.
+
+ @param  Path The image file.
+ @param  Size The size the manifest records for it.
+
+ @retval  1 The image is a regular file of Size bytes.
+ @retval  0 It is missing or of a different size.
+ **/
+int DedupeImagePresent(const char *Path, uint32_t Size);
+
+/**
+ Extract a batch of inputs, decoding every distinct compressed payload once
+ and writing every distinct image once as <sha256>.efi into OutDir, along
+ with a manifest mapping each input to its payload and image hashes.
+ Images and the manifest are renamed into place once complete.
+
+ @param  OutDir          The directory to write to, created if missing.
+ @param  ManifestName    The name of the manifest in OutDir, DEDUPE_MANIFEST
+                         unless the batch is one shard of a larger one.
+ @param  DecompressFlags Flags for UefiDecompressEx().
+ @param  Incremental     Skip inputs whose size and modification time, or
+                         else content hash, match their record in the
+                         manifest of an earlier, possibly interrupted, run.
+ @param  Report          The report to add a record per input to, or NULL.
+ @param  InFiles         The input files.
+ @param  InCount         The number of input files.
+
+ @retval  0 Every input was extracted.
+ @retval  <0 The output could not be written, or the code of the last failed input.
+ **/
+int ExtractDeduplicated(const char *OutDir, const char *ManifestName, uint32_t DecompressFlags, int Incremental,
+                        EXTRACT_REPORT *Report, const char *const *InFiles, int InCount);
+
+#endif
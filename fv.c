@@ -0,0 +1,681 @@
+//
+//  fv.c
+//  UEFIRomExtract
+//
+//  UEFI firmware volume walker: finds the EFI_SECTION_COMPRESSION sections
+//  of FFS files, decodes them on a pool of threads and writes out the PE32
+//  and TE images they and the volumes contain.
+//
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "fv.h"
+#include "dedupe.h"
+#include "budget.h"
+
+#define EFI_FILE_DATA_VALID     0x04
+#define EFI_FILE_DELETED        0x20
+#define EFI_FILE_HEADER_INVALID 0x40
+
+// On-disk size of EFI_COMPRESSION_SECTION_DATA, which C pads to 8
+#define EFI_COMPRESSION_SECTION_DATA_SIZE 5
+
+#define FV_NAME_SIZE 128
+
+//
+// A buffer sections point into: the input, or the output of a decoded
+// section. Queued jobs hold a reference so it outlives its parser.
+//
+typedef struct {
+    uint8_t *Data;
+    BUFFER_ARENA *Arena;            // Of the worker that decoded it, NULL for the input
+    uint64_t Capacity;
+    MEMORY_BUDGET *Budget;          // Charged Capacity while alive, NULL if unbudgeted
+    _Atomic uint32_t Refs;
+} FV_BUFFER;
+
+typedef struct {
+    const uint8_t *Source;          // The compressed stream, CompSize/OrigSize prefix included
+    uint32_t SourceSize;
+    uint32_t UncompressedLength;    // From the section header
+    uint32_t Depth;
+    FV_BUFFER *Owner;
+    EFI_GUID File;
+    char Name[FV_NAME_SIZE];        // User interface name of the file, may be empty
+} FV_JOB;
+
+typedef struct {
+    pthread_mutex_t mLock;
+    pthread_cond_t mWake;
+    FV_JOB *mJobs;                  // Stack of sections waiting to be decoded
+    uint32_t mCount;
+    uint32_t mCapacity;
+    uint32_t mPending;              // Jobs queued or being decoded
+    DIGEST_INDEX mNames;            // SHA-256 of every output name taken
+
+    const char *OutDir;
+    uint32_t DecompressFlags;
+    MEMORY_BUDGET *Budget;          // NULL without -M
+
+    _Atomic uint32_t Volumes;
+    _Atomic uint32_t Files;
+    _Atomic uint32_t Compressed;
+    _Atomic uint32_t Decoded;
+    _Atomic uint32_t Guided;        // Sections needing a decoder other than ours
+    _Atomic uint32_t Images;
+    _Atomic int Status;
+} FV_WALK;
+
+static void FvParseSections(FV_WALK *Walk, FV_BUFFER *Owner, const uint8_t *Data, uint64_t Size, uint32_t Depth,
+                            const EFI_GUID *File, const char *Name);
+
+static void FvBufferRelease(FV_BUFFER *Buffer) {
+    if (atomic_fetch_sub(&Buffer->Refs, 1) == 1) {
+        if (Buffer->Arena != NULL) {
+            ArenaRecycle(Buffer->Arena, Buffer->Data, Buffer->Capacity);
+        } else {
+            free(Buffer->Data);
+        }
+
+        if (Buffer->Budget != NULL) {
+            BudgetRelease(Buffer->Budget, Buffer->Capacity);
+        }
+
+        free(Buffer);
+    }
+}
+
+static uint32_t Read24(const uint8_t *Size) {
+    return Size[0] | (Size[1] << 8) | ((uint32_t) Size[2] << 16);
+}
+
+static void FvFail(FV_WALK *Walk, int Status) {
+    atomic_store(&Walk->Status, Status);
+}
+
+// Keep names to what is safe in a file name
+static void FvUiName(const uint8_t *Data, uint64_t Size, char *Name) {
+    size_t Length = 0;
+
+    for (uint64_t Index = 0; Index + 1 < Size && Length < FV_NAME_SIZE - 1; Index += 2) {
+        uint16_t Char = Data[Index] | (Data[Index + 1] << 8);
+
+        if (Char == 0) {
+            break;
+        }
+
+        Name[Length++] = (Char < 0x80 && (Char == '-' || Char == '.' || (Char >= '0' && Char <= '9') ||
+                                         ((Char | 0x20) >= 'a' && (Char | 0x20) <= 'z'))) ? (char) Char : '_';
+    }
+
+    Name[Length] = 0;
+}
+
+static void FvWriteImage(FV_WALK *Walk, const uint8_t *Data, uint64_t Size, const EFI_GUID *File, const char *Name,
+                         const char *Extension) {
+    char Base[64 + FV_NAME_SIZE];
+    char Path[4096];
+    uint8_t Key[SHA256_DIGEST_SIZE];
+
+    snprintf(Base, sizeof (Base), "%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X%s%s",
+             File->Data1, File->Data2, File->Data3, File->Data4[0], File->Data4[1], File->Data4[2], File->Data4[3],
+             File->Data4[4], File->Data4[5], File->Data4[6], File->Data4[7], Name[0] != 0 ? "_" : "", Name);
+
+    // Firmware carries the same file in several volumes, number the copies
+    pthread_mutex_lock(&Walk->mLock);
+
+    for (uint32_t Copy = 0;; Copy++) {
+        if (Copy == 0) {
+            snprintf(Path, sizeof (Path), "%s/%s.%s", Walk->OutDir, Base, Extension);
+        } else {
+            snprintf(Path, sizeof (Path), "%s/%s_%u.%s", Walk->OutDir, Base, Copy, Extension);
+        }
+
+        Sha256(Path, strlen(Path), Key);
+
+        if (DigestIndexFind(&Walk->mNames, Key) == NULL) {
+            break;
+        }
+    }
+
+    int Status = DigestIndexInsert(&Walk->mNames, Key, Key) ? -7 : 0;
+
+    pthread_mutex_unlock(&Walk->mLock);
+
+    if (Status == 0 && Size <= UINT32_MAX) {
+        Status = WriteOutputFile(Path, Data, (uint32_t) Size);
+    }
+
+    if (Status != 0) {
+        FvFail(Walk, Status);
+        return;
+    }
+
+    atomic_fetch_add(&Walk->Images, 1);
+    Print("%s (%llu bytes)\n", Path, (unsigned long long) Size);
+}
+
+static void FvQueue(FV_WALK *Walk, const FV_JOB *Job) {
+    pthread_mutex_lock(&Walk->mLock);
+
+    if (Walk->mCount == Walk->mCapacity) {
+        uint32_t Capacity = Walk->mCapacity != 0 ? Walk->mCapacity * 2 : 64;
+        FV_JOB *Jobs = realloc(Walk->mJobs, Capacity * sizeof (FV_JOB));
+
+        if (Jobs == NULL) {
+            pthread_mutex_unlock(&Walk->mLock);
+            FvFail(Walk, -7);
+            return;
+        }
+
+        Walk->mJobs = Jobs;
+        Walk->mCapacity = Capacity;
+    }
+
+    atomic_fetch_add(&Job->Owner->Refs, 1);
+    Walk->mJobs[Walk->mCount++] = *Job;
+    Walk->mPending++;
+
+    pthread_cond_signal(&Walk->mWake);
+    pthread_mutex_unlock(&Walk->mLock);
+}
+
+/**
+ Walk the files of the firmware volume at Data.
+
+ @return The length of the volume, 0 if Data does not hold a valid one.
+ **/
+static uint64_t FvParseVolume(FV_WALK *Walk, FV_BUFFER *Owner, const uint8_t *Data, uint64_t Size, uint32_t Depth) {
+    EFI_FIRMWARE_VOLUME_HEADER Fv;
+    EFI_FIRMWARE_VOLUME_EXT_HEADER FvExt;
+    EFI_FFS_FILE_HEADER Ffs;
+    uint16_t Sum = 0;
+
+    if (Depth > FV_MAX_DEPTH || Size < sizeof (Fv)) {
+        return 0;
+    }
+
+    memcpy(&Fv, Data, sizeof (Fv));
+
+    if (Fv.Signature != EFI_FVH_SIGNATURE || Fv.HeaderLength < sizeof (Fv) || (Fv.HeaderLength & 1) != 0 ||
+        Fv.FvLength < Fv.HeaderLength || Fv.FvLength > Size) {
+        return 0;
+    }
+
+    for (uint16_t Offset = 0; Offset < Fv.HeaderLength; Offset += 2) {
+        Sum = (uint16_t) (Sum + (Data[Offset] | (Data[Offset + 1] << 8)));
+    }
+
+    if (Sum != 0) {
+        return 0;
+    }
+
+    atomic_fetch_add(&Walk->Volumes, 1);
+
+    uint64_t Offset = Fv.HeaderLength;
+
+    if (Fv.ExtHeaderOffset != 0 && (uint64_t) Fv.ExtHeaderOffset + sizeof (FvExt) <= Fv.FvLength) {
+        memcpy(&FvExt, Data + Fv.ExtHeaderOffset, sizeof (FvExt));
+        Offset = (uint64_t) Fv.ExtHeaderOffset + FvExt.ExtHeaderSize;
+    }
+
+    uint8_t Erased = (Fv.Attributes & EFI_FVB2_ERASE_POLARITY) != 0 ? 0xFF : 0x00;
+
+    // Files are 8 byte aligned relative to the start of the volume
+    for (Offset = (Offset + 7) & ~7ULL; Offset + sizeof (Ffs) <= Fv.FvLength; Offset = (Offset + 7) & ~7ULL) {
+        const uint8_t *File = Data + Offset;
+        uint64_t HeaderSize = sizeof (Ffs);
+        uint64_t FileSize;
+        uint64_t Index;
+
+        // Erased flash marks the end of the files
+        for (Index = 0; Index < sizeof (Ffs) && File[Index] == Erased; Index++) {
+        }
+
+        if (Index == sizeof (Ffs)) {
+            break;
+        }
+
+        memcpy(&Ffs, File, sizeof (Ffs));
+        FileSize = Read24(Ffs.Size);
+
+        if ((Ffs.Attributes & FFS_ATTRIB_LARGE_FILE) != 0) {
+            EFI_FFS_FILE_EXTENDED_SIZE ExtendedSize;
+
+            if (Offset + sizeof (Ffs) + sizeof (ExtendedSize) > Fv.FvLength) {
+                break;
+            }
+
+            memcpy(&ExtendedSize, File + sizeof (Ffs), sizeof (ExtendedSize));
+            HeaderSize += sizeof (ExtendedSize);
+            FileSize = ExtendedSize;
+        }
+
+        if (FileSize < HeaderSize || FileSize > Fv.FvLength - Offset) {
+            Print("Bad FFS file size at 0x%llx, skipping the rest of the volume\n", (unsigned long long) Offset);
+            break;
+        }
+
+        atomic_fetch_add(&Walk->Files, 1);
+
+        // State bits are written by flipping them away from the erase polarity
+        uint8_t State = Erased != 0 ? (uint8_t) ~Ffs.State : Ffs.State;
+
+        if ((State & EFI_FILE_DATA_VALID) != 0 && (State & (EFI_FILE_DELETED | EFI_FILE_HEADER_INVALID)) == 0 &&
+            Ffs.Type != EFI_FV_FILETYPE_RAW && Ffs.Type != EFI_FV_FILETYPE_FFS_PAD) {
+            FvParseSections(Walk, Owner, File + HeaderSize, FileSize - HeaderSize, Depth, &Ffs.Name, "");
+        }
+
+        Offset += FileSize;
+    }
+
+    return Fv.FvLength;
+}
+
+static void FvParseSections(FV_WALK *Walk, FV_BUFFER *Owner, const uint8_t *Data, uint64_t Size, uint32_t Depth,
+                            const EFI_GUID *File, const char *Name) {
+    EFI_COMMON_SECTION_HEADER Section;
+    char UiName[FV_NAME_SIZE];
+
+    if (Depth > FV_MAX_DEPTH) {
+        Print("Sections nested too deep, skipped\n");
+        return;
+    }
+
+    // The user interface section names the images next to it, wherever it comes in the file
+    strcpy(UiName, Name);
+
+    for (int Pass = 0; Pass < 2; Pass++) {
+        // Sections are 4 byte aligned relative to the start of the file data
+        for (uint64_t Offset = 0; Offset + sizeof (Section) <= Size; Offset = (Offset + 3) & ~3ULL) {
+            const uint8_t *Start = Data + Offset;
+            uint64_t HeaderSize = sizeof (Section);
+
+            memcpy(&Section, Start, sizeof (Section));
+
+            uint64_t SectionSize = Read24(Section.Size);
+
+            if (SectionSize == 0xFFFFFF) {
+                EFI_SECTION_EXTENDED_SIZE ExtendedSize;
+
+                if (Offset + sizeof (Section) + sizeof (ExtendedSize) > Size) {
+                    break;
+                }
+
+                memcpy(&ExtendedSize, Start + sizeof (Section), sizeof (ExtendedSize));
+                HeaderSize += sizeof (ExtendedSize);
+                SectionSize = ExtendedSize;
+            }
+
+            if (SectionSize < HeaderSize || SectionSize > Size - Offset) {
+                break;
+            }
+
+            const uint8_t *SectionData = Start + HeaderSize;
+            uint64_t DataSize = SectionSize - HeaderSize;
+
+            Offset += SectionSize;
+
+            if (Pass == 0) {
+                if (Section.Type == EFI_SECTION_USER_INTERFACE) {
+                    FvUiName(SectionData, DataSize, UiName);
+                }
+
+                continue;
+            }
+
+            switch (Section.Type) {
+                case EFI_SECTION_COMPRESSION: {
+                    FV_JOB Job;
+
+                    if (DataSize < EFI_COMPRESSION_SECTION_DATA_SIZE) {
+                        break;
+                    }
+
+                    uint8_t CompressionType = SectionData[4];
+                    const uint8_t *Stream = SectionData + EFI_COMPRESSION_SECTION_DATA_SIZE;
+                    uint64_t StreamSize = DataSize - EFI_COMPRESSION_SECTION_DATA_SIZE;
+
+                    if (CompressionType == EFI_NOT_COMPRESSED) {
+                        FvParseSections(Walk, Owner, Stream, StreamSize, Depth + 1, File, UiName);
+                        break;
+                    }
+
+                    atomic_fetch_add(&Walk->Compressed, 1);
+
+                    if (CompressionType != EFI_STANDARD_COMPRESSION || StreamSize > UINT32_MAX) {
+                        Print("Unsupported compression type %u, section skipped\n", CompressionType);
+                        break;
+                    }
+
+                    memset(&Job, 0, sizeof (Job));
+                    Job.Source = Stream;
+                    Job.SourceSize = (uint32_t) StreamSize;
+                    Job.UncompressedLength = ReadUnaligned32((const uint32_t *) SectionData);
+                    Job.Depth = Depth + 1;
+                    Job.Owner = Owner;
+                    Job.File = *File;
+                    strcpy(Job.Name, UiName);
+
+                    FvQueue(Walk, &Job);
+                    break;
+                }
+
+                case EFI_SECTION_GUID_DEFINED: {
+                    EFI_GUID_DEFINED_SECTION_DATA Guided;
+
+                    if (DataSize < sizeof (Guided)) {
+                        break;
+                    }
+
+                    memcpy(&Guided, SectionData, sizeof (Guided));
+
+                    // Without PROCESSING_REQUIRED the data is plain sections, an integrity check aside
+                    if ((Guided.Attributes & EFI_GUIDED_SECTION_PROCESSING_REQUIRED) != 0 ||
+                        Guided.DataOffset < HeaderSize + sizeof (Guided) || Guided.DataOffset > SectionSize) {
+                        atomic_fetch_add(&Walk->Guided, 1);
+                        break;
+                    }
+
+                    FvParseSections(Walk, Owner, Start + Guided.DataOffset, SectionSize - Guided.DataOffset, Depth + 1,
+                                    File, UiName);
+                    break;
+                }
+
+                case EFI_SECTION_PE32:
+                    FvWriteImage(Walk, SectionData, DataSize, File, UiName, "efi");
+                    break;
+
+                case EFI_SECTION_TE:
+                    FvWriteImage(Walk, SectionData, DataSize, File, UiName, "te");
+                    break;
+
+                case EFI_SECTION_FIRMWARE_VOLUME_IMAGE:
+                    FvParseVolume(Walk, Owner, SectionData, DataSize, Depth + 1);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+// Returns 1 if the decode was admitted to the budget and BudgetDecodeDone() is still due
+static int FvDecode(FV_WALK *Walk, const FV_JOB *Job, SCRATCH_DATA *Scratch, BUFFER_ARENA *Arena) {
+    uint32_t OrigSize;
+    uint32_t ScratchSize;
+
+    if (Scratch == NULL) {
+        FvFail(Walk, -6);
+        return 0;
+    }
+
+    if (Job->SourceSize < 8 || UefiDecompressGetInfo(Job->Source, Job->SourceSize, &OrigSize, &ScratchSize) ||
+        OrigSize != Job->UncompressedLength || UefiDecompressCheck(Job->Source, Job->SourceSize, Scratch)) {
+        Print("Not a valid compressed section in file %08X!\n", Job->File.Data1);
+        FvFail(Walk, -11);
+        return 0;
+    }
+
+    // The output stays charged until the last section in it has been decoded
+    if (Walk->Budget != NULL && BudgetAcquireDecode(Walk->Budget, OrigSize)) {
+        Print("Section in file %08X does not fit in the memory budget!\n", Job->File.Data1);
+        FvFail(Walk, -12);
+        return 0;
+    }
+
+    FV_BUFFER *Output = malloc(sizeof (FV_BUFFER));
+
+    // Budgeted buffers are malloc'd to their exact size so the charge matches
+    if (Output != NULL && Walk->Budget != NULL) {
+        Output->Arena = NULL;
+        Output->Capacity = OrigSize;
+        Output->Data = malloc(OrigSize);
+    } else if (Output != NULL) {
+        Output->Arena = Arena;
+        Output->Data = ArenaAlloc(Arena, OrigSize, &Output->Capacity);
+    }
+
+    if (Output == NULL || Output->Data == NULL) {
+        free(Output);
+
+        if (Walk->Budget != NULL) {
+            BudgetRelease(Walk->Budget, OrigSize);
+        }
+
+        FvFail(Walk, -7);
+        return Walk->Budget != NULL;
+    }
+
+    Output->Budget = Walk->Budget;
+
+    atomic_init(&Output->Refs, 1);
+
+    // Whole BIOS images are untrusted input, and the workers are already the parallelism
+    uint32_t Flags = (Walk->DecompressFlags | DECOMPRESS_HARDENED) & ~(DECOMPRESS_PIPELINED | DECOMPRESS_PROFILED);
+
+    if (UefiDecompressEx(Job->Source, Job->SourceSize, Output->Data, OrigSize, Scratch, Flags)) {
+        Print("Decompression of a section in file %08X failed!\n", Job->File.Data1);
+        FvFail(Walk, -8);
+    } else {
+        atomic_fetch_add(&Walk->Decoded, 1);
+        FvParseSections(Walk, Output, Output->Data, OrigSize, Job->Depth, &Job->File, Job->Name);
+    }
+
+    FvBufferRelease(Output);
+
+    return Walk->Budget != NULL;
+}
+
+static void *FvWorker(void *Arg) {
+    FV_WALK *Walk = Arg;
+    SCRATCH_DATA *Scratch = malloc(sizeof (SCRATCH_DATA));
+    BUFFER_ARENA Arena;
+
+    // Another worker may drop the last reference to one of our buffers, but
+    // only while a job is pending, and we stay until none is
+    ArenaInit(&Arena, gArenaFlags);
+
+    pthread_mutex_lock(&Walk->mLock);
+
+    for (;;) {
+        // A running job may still queue more, only stop once none is pending
+        while (Walk->mCount == 0 && Walk->mPending != 0) {
+            pthread_cond_wait(&Walk->mWake, &Walk->mLock);
+        }
+
+        if (Walk->mCount == 0) {
+            break;
+        }
+
+        FV_JOB Job = Walk->mJobs[--Walk->mCount];
+
+        pthread_mutex_unlock(&Walk->mLock);
+        int Admitted = FvDecode(Walk, &Job, Scratch, &Arena);
+
+        FvBufferRelease(Job.Owner);
+
+        // Only once what the job held is given back, or a waiter could give up too early
+        if (Admitted) {
+            BudgetDecodeDone(Walk->Budget);
+        }
+
+        pthread_mutex_lock(&Walk->mLock);
+
+        if (--Walk->mPending == 0) {
+            pthread_cond_broadcast(&Walk->mWake);
+        }
+    }
+
+    pthread_mutex_unlock(&Walk->mLock);
+    ArenaDestroy(&Arena);
+    free(Scratch);
+
+    return NULL;
+}
+
+static int FvExtractInput(FV_WALK *Walk, const char *InFile, int Workers) {
+    uint8_t *Rom;
+    uint32_t RomSize;
+    uint32_t Volumes = atomic_load(&Walk->Volumes);
+    uint64_t Charge = 0;
+    struct stat St;
+
+    // Only a file of known size can be charged before it is read
+    if (Walk->Budget != NULL) {
+        if (strcmp(InFile, "-") == 0 || stat(InFile, &St) != 0 || !S_ISREG(St.st_mode)) {
+            Print("%s is not a regular file, its size cannot be charged to the memory budget!\n", InFile);
+            return -12;
+        }
+
+        if (BudgetAcquireDecode(Walk->Budget, (uint64_t) St.st_size)) {
+            Print("%s does not fit in the memory budget!\n", InFile);
+            return -12;
+        }
+
+        // Nothing else runs between inputs, so there is nothing to wait for
+        BudgetDecodeDone(Walk->Budget);
+        Charge = (uint64_t) St.st_size;
+    }
+
+    if (LoadInputFile(InFile, &Rom, &RomSize) || (Walk->Budget != NULL && RomSize != Charge)) {
+        if (Walk->Budget != NULL) {
+            free(Rom);
+            BudgetRelease(Walk->Budget, Charge);
+        }
+
+        return -1;
+    }
+
+    FV_BUFFER *Input = malloc(sizeof (FV_BUFFER));
+
+    if (Input == NULL) {
+        free(Rom);
+
+        if (Walk->Budget != NULL) {
+            BudgetRelease(Walk->Budget, Charge);
+        }
+
+        return -7;
+    }
+
+    Input->Data = Rom;
+    Input->Arena = NULL;
+    Input->Capacity = Charge;
+    Input->Budget = Walk->Budget;
+    atomic_init(&Input->Refs, 1);
+
+    // Volumes are 8 byte aligned with the signature 40 bytes in
+    for (uint64_t Offset = 0; Offset + sizeof (EFI_FIRMWARE_VOLUME_HEADER) <= RomSize;) {
+        const uint8_t *Signature = memmem(Rom + Offset + 40, RomSize - Offset - 40, "_FVH", 4);
+
+        if (Signature == NULL) {
+            break;
+        }
+
+        Offset = (uint64_t) (Signature - Rom) - 40;
+
+        // A stray match, say an immediate in code, resumes at the next aligned
+        // header so the volume right after it is still found
+        if ((Offset & 7) != 0) {
+            Offset = (Offset + 7) & ~7ULL;
+            continue;
+        }
+
+        uint64_t Length = FvParseVolume(Walk, Input, Rom + Offset, RomSize - Offset, 0);
+
+        Offset += Length != 0 ? Length : 8;
+    }
+
+    if (atomic_load(&Walk->Volumes) == Volumes) {
+        Print("No firmware volume found in %s!\n", InFile);
+        FvBufferRelease(Input);
+        return -1;
+    }
+
+    // The calling thread decodes too, so one worker needs no thread at all
+    pthread_t *Threads = calloc((size_t) Workers, sizeof (pthread_t));
+    int Started = 0;
+
+    while (Threads != NULL && Started < Workers - 1 && pthread_create(&Threads[Started], NULL, FvWorker, Walk) == 0) {
+        Started++;
+    }
+
+    FvWorker(Walk);
+
+    for (int Index = 0; Index < Started; Index++) {
+        pthread_join(Threads[Index], NULL);
+    }
+
+    free(Threads);
+    FvBufferRelease(Input);
+
+    return 0;
+}
+
+int ExtractFirmwareVolumes(const char *OutDir, int Workers, uint32_t DecompressFlags, uint64_t MemoryLimit,
+                           const char *const *InFiles, int InCount) {
+    FV_WALK Walk;
+    MEMORY_BUDGET Budget;
+    int Status = 0;
+
+    if (mkdir(OutDir, 0755) != 0 && errno != EEXIST) {
+        Print("Failed to create output directory %s!\n", OutDir);
+        return -9;
+    }
+
+    if (Workers <= 0) {
+        long Cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Workers = Cpus > 0 ? (int) Cpus : 1;
+    }
+
+    if (MemoryLimit != 0 && BudgetInit(&Budget, MemoryLimit, Workers)) {
+        Print("Memory budget of %llu bytes is too small for %d workers!\n", (unsigned long long) MemoryLimit, Workers);
+        return -1;
+    }
+
+    memset(&Walk, 0, sizeof (Walk));
+    pthread_mutex_init(&Walk.mLock, NULL);
+    pthread_cond_init(&Walk.mWake, NULL);
+    DigestIndexInit(&Walk.mNames);
+    Walk.OutDir = OutDir;
+    Walk.DecompressFlags = DecompressFlags;
+    Walk.Budget = MemoryLimit != 0 ? &Budget : NULL;
+
+    for (int Index = 0; Index < InCount; Index++) {
+        int Result = FvExtractInput(&Walk, InFiles[Index], Workers);
+
+        if (Result != 0) {
+            Status = Result;
+        }
+    }
+
+    Print("%u volumes, %u files, %u compressed sections, %u decoded, %u guided sections skipped, %u images\n",
+          atomic_load(&Walk.Volumes), atomic_load(&Walk.Files), atomic_load(&Walk.Compressed),
+          atomic_load(&Walk.Decoded), atomic_load(&Walk.Guided), atomic_load(&Walk.Images));
+
+    if (atomic_load(&Walk.Status) != 0) {
+        Status = atomic_load(&Walk.Status);
+    }
+
+    if (Walk.Budget != NULL) {
+        Print("Memory budget: peak %llu of %llu bytes, %llu decodes waited, %llu rejected\n",
+              (unsigned long long) Budget.Peak, (unsigned long long) Budget.Limit,
+              (unsigned long long) Budget.Waits, (unsigned long long) Budget.Rejected);
+        BudgetFree(Walk.Budget);
+    }
+
+    free(Walk.mJobs);
+    DigestIndexFree(&Walk.mNames);
+    pthread_cond_destroy(&Walk.mWake);
+    pthread_mutex_destroy(&Walk.mLock);
+
+    return Status;
+}
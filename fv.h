@@ -0,0 +1,117 @@
+//
+//  fv.h
+//  UEFIRomExtract
+//
+//  UEFI firmware volume walker: finds the EFI_SECTION_COMPRESSION sections
+//  of FFS files, decodes them on a pool of threads and writes out the PE32
+//  and TE images they and the volumes contain.
+//
+
+#ifndef UEFIRomExtract_fv_h
+#define UEFIRomExtract_fv_h
+
+#include <stdint.h>
+#include "main.h"
+
+typedef struct {
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t Data4[8];
+} EFI_GUID;
+
+#define EFI_FVH_SIGNATURE 0x4856465F  // "_FVH"
+
+#define EFI_FVB2_ERASE_POLARITY 0x00000800
+
+typedef struct {
+    uint8_t ZeroVector[16];
+    EFI_GUID FileSystemGuid;
+    uint64_t FvLength;
+    uint32_t Signature;
+    uint32_t Attributes;
+    uint16_t HeaderLength;
+    uint16_t Checksum;
+    uint16_t ExtHeaderOffset;
+    uint8_t Reserved[1];
+    uint8_t Revision;
+} EFI_FIRMWARE_VOLUME_HEADER;
+
+typedef struct {
+    EFI_GUID FvName;
+    uint32_t ExtHeaderSize;
+} EFI_FIRMWARE_VOLUME_EXT_HEADER;
+
+typedef struct {
+    EFI_GUID Name;
+    uint16_t IntegrityCheck;
+    uint8_t Type;
+    uint8_t Attributes;
+    uint8_t Size[3];
+    uint8_t State;
+} EFI_FFS_FILE_HEADER;
+
+#define FFS_ATTRIB_LARGE_FILE 0x01
+
+// Follows EFI_FFS_FILE_HEADER when FFS_ATTRIB_LARGE_FILE is set
+typedef uint64_t EFI_FFS_FILE_EXTENDED_SIZE;
+
+#define EFI_FV_FILETYPE_RAW  0x01
+#define EFI_FV_FILETYPE_FFS_PAD 0xF0
+
+typedef struct {
+    uint8_t Size[3];
+    uint8_t Type;
+} EFI_COMMON_SECTION_HEADER;
+
+// Follows EFI_COMMON_SECTION_HEADER when its Size is 0xFFFFFF
+typedef uint32_t EFI_SECTION_EXTENDED_SIZE;
+
+#define EFI_SECTION_COMPRESSION           0x01
+#define EFI_SECTION_GUID_DEFINED          0x02
+#define EFI_SECTION_PE32                  0x10
+#define EFI_SECTION_TE                    0x12
+#define EFI_SECTION_USER_INTERFACE        0x15
+#define EFI_SECTION_FIRMWARE_VOLUME_IMAGE 0x17
+
+typedef struct {
+    uint32_t UncompressedLength;
+    uint8_t CompressionType;
+} EFI_COMPRESSION_SECTION_DATA;
+
+#define EFI_NOT_COMPRESSED       0x00
+#define EFI_STANDARD_COMPRESSION 0x01
+
+typedef struct {
+    EFI_GUID SectionDefinitionGuid;
+    uint16_t DataOffset;
+    uint16_t Attributes;
+} EFI_GUID_DEFINED_SECTION_DATA;
+
+#define EFI_GUIDED_SECTION_PROCESSING_REQUIRED 0x01
+
+//
+// Volumes nest through compressed and FV image sections; deeper nesting
+// than this is not seen in real firmware.
+//
+#define FV_MAX_DEPTH 16
+
+/**
+ Find every firmware volume in each input, decode its standard-compressed
+ sections on Workers threads and write each PE32 and TE image into OutDir,
+ named after its file GUID and user interface name.
+
+ @param  OutDir          The directory to write to, created if missing.
+ @param  Workers         Decoding threads, 0 for one per CPU.
+ @param  DecompressFlags Flags for UefiDecompressEx(); decoding is always hardened.
+ @param  MemoryLimit     Bytes of inputs and decoded sections held at once, 0 for no limit.
+ @param  InFiles         The input files.
+ @param  InCount         The number of input files.
+
+ @retval  0 Every volume was walked and every section decoded.
+ @retval  <0 The code of the last failure.
+ **/
+int ExtractFirmwareVolumes(const char *OutDir, int Workers, uint32_t DecompressFlags, uint64_t MemoryLimit,
+                           const char *const *InFiles, int InCount);
+
+#endif
@@ -0,0 +1,113 @@
+//
+//  interleave.c
+//  UEFIRomExtract
+//
+//  Decodes several independent compressed streams in lockstep on one thread,
+//  so the table lookups of one stream overlap the bit buffer shifts of the
+//  others instead of each stream waiting on its own dependency chain.
+//
+#include "interleave.h"
+
+//
+// One iteration of DecodeHardened(). Returns nonzero once the stream is
+// complete or corrupt, exactly where DecodeHardened() would return.
+//
+static inline int DecodeStep(SCRATCH_DATA *Sd) {
+    // Get one code from mBitBuf
+    uint16_t CharC = DecodeC(Sd);
+
+    if (Sd->mBadTableFlag != 0) {
+        return 1;
+    }
+
+    if (CharC < 256) {
+        // Process an Original character
+        if (Sd->mOutBuf >= Sd->mOrigSize) {
+            return 1;
+        }
+
+        Sd->mDstBase[Sd->mOutBuf++] = (uint8_t) CharC;
+
+        return 0;
+    }
+
+    // Process a Pointer
+    uint32_t Length = (uint32_t) (CharC - (BIT8 - THRESHOLD));
+    uint32_t Distance = DecodeP(Sd) + 1;
+
+    // A reference may not reach before the start of the output
+    if (Distance > Sd->mOutBuf) {
+        Sd->mBadTableFlag = (uint16_t) BAD_TABLE;
+        return 1;
+    }
+
+    if (Length > Sd->mOrigSize - Sd->mOutBuf) {
+        Length = Sd->mOrigSize - Sd->mOutBuf;
+    }
+
+    // Overlapping copies are intended, they repeat the last Distance bytes
+    uint8_t *Dst = Sd->mDstBase + Sd->mOutBuf;
+    const uint8_t *Src = Dst - Distance;
+
+    for (uint32_t Index = 0; Index < Length; Index++) {
+        Dst[Index] = Src[Index];
+    }
+
+    Sd->mOutBuf += Length;
+
+    return Sd->mOutBuf >= Sd->mOrigSize;
+}
+
+void DecodeInterleaved(SCRATCH_DATA *const *Sd, uint32_t Count) {
+    SCRATCH_DATA *Active[INTERLEAVE_MAX_STREAMS];
+    uint32_t Live = 0;
+
+    ASSERT(Count <= INTERLEAVE_MAX_STREAMS);
+
+    for (uint32_t Index = 0; Index < Count; Index++) {
+        if (Sd[Index]->mOrigSize != 0) {
+            Active[Live++] = Sd[Index];
+        }
+    }
+
+    //
+    // The streams share nothing, so the out-of-order core runs the symbol
+    // of one while the lookups of the previous one are still in flight.
+    // Finished streams are swapped out so the rest keep the loop dense.
+    //
+    while (Live != 0) {
+        for (uint32_t Index = 0; Index < Live;) {
+            if (DecodeStep(Active[Index])) {
+                Active[Index] = Active[--Live];
+            } else {
+                Index++;
+            }
+        }
+    }
+}
+
+void UefiDecompressInterleaved(INTERLEAVE_STREAM *Streams, uint32_t Count) {
+    SCRATCH_DATA *Sd[INTERLEAVE_MAX_STREAMS] = { NULL };
+    uint32_t Ready = 0;
+
+    ASSERT(Count <= INTERLEAVE_MAX_STREAMS);
+
+    for (uint32_t Index = 0; Index < Count; Index++) {
+        INTERLEAVE_STREAM *Stream = &Streams[Index];
+
+        Stream->Status = UefiDecompressBegin(Stream->Source, Stream->SourceSize, Stream->Destination,
+                                             Stream->DestinationSize, Stream->Scratch, DECOMPRESS_HARDENED);
+
+        if (Stream->Status == RETURN_SUCCESS) {
+            Sd[Ready++] = Stream->Scratch;
+        }
+    }
+
+    DecodeInterleaved(Sd, Ready);
+
+    for (uint32_t Index = 0; Index < Count; Index++) {
+        if (Streams[Index].Status == RETURN_SUCCESS && Streams[Index].Scratch->mBadTableFlag != 0) {
+            Streams[Index].Status = RETURN_INVALID_PARAMETER;
+        }
+    }
+}
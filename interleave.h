@@ -0,0 +1,56 @@
+//
+//  interleave.h
+//  UEFIRomExtract
+//
+//  Decodes several independent compressed streams in lockstep on one thread,
+//  so the table lookups of one stream overlap the bit buffer shifts of the
+//  others instead of each stream waiting on its own dependency chain.
+//
+
+#ifndef UEFIRomExtract_interleave_h
+#define UEFIRomExtract_interleave_h
+
+#include <stdint.h>
+#include "main.h"
+
+//
+// Beyond four streams the bit readers and tables of all of them no longer
+// fit in L1 together and the lookups start missing.
+//
+#define INTERLEAVE_MIN_STREAMS 2
+#define INTERLEAVE_MAX_STREAMS 4
+
+//
+// One stream of an interleaved decode, with its own scratch data.
+//
+typedef struct {
+    const void *Source;
+    uint32_t SourceSize;
+    void *Destination;
+    uint32_t DestinationSize;
+    SCRATCH_DATA *Scratch;
+    RETURN_STATUS Status;      // Set by UefiDecompressInterleaved()
+} INTERLEAVE_STREAM;
+
+/**
+ Decode the streams set up in Sd like DecodeHardened(), one symbol of each
+ in turn, until every one has finished or failed. A failed stream stops
+ without affecting the others.
+
+ @param  Sd    The scratch data of each stream, set up by UefiDecompressBegin().
+ @param  Count The number of streams, at most INTERLEAVE_MAX_STREAMS.
+ **/
+void DecodeInterleaved(SCRATCH_DATA *const *Sd, uint32_t Count);
+
+/**
+ UefiDecompressEx() with DECOMPRESS_HARDENED for up to INTERLEAVE_MAX_STREAMS
+ streams at once on the calling thread. Each stream gets its own Status.
+ There is no unhardened variant: the lockstep loop relies on every stream
+ stopping at its own bounds rather than trusting its input.
+
+ @param  Streams The streams to decode.
+ @param  Count   The number of streams, at most INTERLEAVE_MAX_STREAMS.
+ **/
+void UefiDecompressInterleaved(INTERLEAVE_STREAM *Streams, uint32_t Count);
+
+#endif
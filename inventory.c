@@ -0,0 +1,176 @@
+//
+//  inventory.c
+//  UEFIRomExtract
+//
+//  Metadata-only listing of the images in option ROMs.
+//
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "inventory.h"
+
+#define PCI_EXPANSION_ROM_SIGNATURE  0xaa55
+#define PCI_DATA_STRUCTURE_SIGNATURE 0x52494350  // "PCIR"
+#define EFI_PCI_EXPANSION_ROM_SIGNATURE 0x0EF1
+
+//
+// Where headers are read from: a file read with pread(), so only the
+// headers are ever fetched, or stdin collected in memory.
+//
+typedef struct {
+    int Fd;
+    const uint8_t *Data;
+    uint64_t Size;
+} ROM_SOURCE;
+
+static int SourceRead(const ROM_SOURCE *Source, uint64_t Offset, void *Dst, uint32_t Size) {
+    if (Offset > Source->Size || Source->Size - Offset < Size) {
+        return -1;
+    }
+
+    if (Source->Data != NULL) {
+        memcpy(Dst, Source->Data + Offset, Size);
+        return 0;
+    }
+
+    return pread(Source->Fd, Dst, Size, (off_t) Offset) == (ssize_t) Size ? 0 : -1;
+}
+
+static const char *CodeTypeName(uint8_t CodeType, char *Buffer, size_t BufferSize) {
+    switch (CodeType) {
+        case 0x00:
+            return "x86";
+        case 0x01:
+            return "openfw";
+        case 0x02:
+            return "hppa";
+        case PCI_CODE_TYPE_EFI_IMAGE:
+            return "efi";
+        default:
+            snprintf(Buffer, BufferSize, "0x%02x", CodeType);
+            return Buffer;
+    }
+}
+
+// Finish a line with the CompSize/OrigSize prefix at Offset, dashes if there is none
+static void ListStreamSizes(const ROM_SOURCE *Source, uint64_t Offset, const char *InFile) {
+    uint8_t Prefix[8];
+
+    if (Offset == UINT64_MAX || SourceRead(Source, Offset, Prefix, sizeof (Prefix))) {
+        printf(" %10s %10s %s\n", "-", "-", InFile);
+        return;
+    }
+
+    // Little-endian CompSize and OrigSize, read as the decoder reads them
+    printf(" %10u %10u %s\n", ReadUnaligned32((const uint32_t *) Prefix), ReadUnaligned32((const uint32_t *) (Prefix + 4)),
+           InFile);
+}
+
+static void ListSource(const char *InFile, const ROM_SOURCE *Source) {
+    PCI_EXPANSION_ROM_HEADER PciRomHdr;
+    EFI_PCI_EXPANSION_ROM_HEADER EfiRomHdr;
+    PCI_DATA_STRUCTURE PciDs;
+    char CodeType[8];
+    uint64_t ImageStart = 0;
+
+    for (;;) {
+        if (SourceRead(Source, ImageStart, &PciRomHdr, sizeof (PciRomHdr)) ||
+            PciRomHdr.Signature != PCI_EXPANSION_ROM_SIGNATURE) {
+            break;
+        }
+
+        // PCI 2.3 and 3.0 data structures agree on every field listed here
+        if (SourceRead(Source, ImageStart + PciRomHdr.PcirOffset, &PciDs, sizeof (PciDs)) ||
+            PciDs.Signature != PCI_DATA_STRUCTURE_SIGNATURE) {
+            printf("0x%08llx %-6s bad PCI data structure %s\n", (unsigned long long) ImageStart, "?", InFile);
+            return;
+        }
+
+        printf("0x%08llx %-6s %04x:%04x %02x%02x%02x %8u 0x%04x", (unsigned long long) ImageStart,
+               CodeTypeName(PciDs.CodeType, CodeType, sizeof (CodeType)), PciDs.VendorId, PciDs.DeviceId,
+               PciDs.ClassCode[2], PciDs.ClassCode[1], PciDs.ClassCode[0], PciDs.ImageLength * 512U,
+               PciDs.CodeRevision);
+
+        if (PciDs.CodeType == PCI_CODE_TYPE_EFI_IMAGE &&
+            SourceRead(Source, ImageStart, &EfiRomHdr, sizeof (EfiRomHdr)) == 0 &&
+            EfiRomHdr.EfiSignature == EFI_PCI_EXPANSION_ROM_SIGNATURE) {
+            printf(" %4u 0x%04x %4u", EfiRomHdr.EfiSubsystem, EfiRomHdr.EfiMachineType, EfiRomHdr.CompressionType);
+            ListStreamSizes(Source, EfiRomHdr.CompressionType == EFI_PCI_EXPANSION_ROM_HEADER_COMPRESSED ?
+                                    ImageStart + EfiRomHdr.EfiImageHeaderOffset : UINT64_MAX, InFile);
+        } else {
+            printf(" %4s %6s %4s", "-", "-", "-");
+            ListStreamSizes(Source, UINT64_MAX, InFile);
+        }
+
+        if ((PciDs.Indicator & INDICATOR_LAST) != 0 || PciDs.ImageLength == 0) {
+            return;
+        }
+
+        ImageStart += PciDs.ImageLength * 512U;
+    }
+
+    // Without an option ROM header the extractor decodes the input as a raw stream
+    if (ImageStart == 0) {
+        printf("0x%08llx %-6s %9s %6s %8s %6s %4s %6s %4s", 0ULL, "raw", "-", "-", "-", "-", "-", "-", "-");
+        ListStreamSizes(Source, 0, InFile);
+    }
+}
+
+int ListRomImages(const char *const *InFiles, int InCount) {
+    int Status = 0;
+
+    printf("%-10s %-6s %9s %6s %8s %6s %4s %6s %4s %10s %10s %s\n", "offset", "type", "ven:dev", "class",
+           "length", "rev", "subs", "mach", "comp", "comp_size", "orig_size", "input");
+
+    for (int Index = 0; Index < InCount; Index++) {
+        ROM_SOURCE Source;
+        struct stat St;
+        uint8_t *Buffer = NULL;
+
+        memset(&Source, 0, sizeof (Source));
+
+        if (strcmp(InFiles[Index], "-") == 0) {
+            uint32_t Capacity = 0;
+            uint32_t Size = 0;
+
+            Source.Fd = STDIN_FILENO;
+
+            if (LoadInputFd(STDIN_FILENO, &Buffer, &Capacity, &Size) == 0) {
+                Source.Data = Buffer != NULL ? Buffer : (const uint8_t *) "";
+                Source.Size = Size;
+            } else {
+                Source.Fd = -1;
+            }
+        } else {
+            Source.Fd = open(InFiles[Index], O_RDONLY | O_CLOEXEC);
+
+            if (Source.Fd >= 0 && fstat(Source.Fd, &St) == 0) {
+                Source.Size = (uint64_t) St.st_size;
+            } else if (Source.Fd >= 0) {
+                close(Source.Fd);
+                Source.Fd = -1;
+            }
+        }
+
+        if (Source.Fd < 0) {
+            Print("Error opening file %s!\n", InFiles[Index]);
+            free(Buffer);
+            Status = -1;
+            continue;
+        }
+
+        ListSource(InFiles[Index], &Source);
+
+        if (Source.Data == NULL) {
+            close(Source.Fd);
+        }
+
+        free(Buffer);
+    }
+
+    return Status;
+}
@@ -0,0 +1,25 @@
+//
+//  inventory.h
+//  UEFIRomExtract
+//
+//  Metadata-only listing of the images in option ROMs.
+//
+
+#ifndef UEFIRomExtract_inventory_h
+#define UEFIRomExtract_inventory_h
+
+/**
+ Walk every image in the ROM chain of each input and print one line per
+ image with its offset, code type, PCI identity, length and revision and,
+ for EFI images, the EFI header fields and the CompSize/OrigSize prefix of
+ the compressed stream. Only the headers are read; nothing is decompressed.
+
+ @param  InFiles The input files, - for stdin.
+ @param  InCount The number of input files.
+
+ @retval  0 Every input was listed.
+ @retval  -1 An input could not be read.
+ **/
+int ListRomImages(const char *const *InFiles, int InCount);
+
+#endif
@@ -10,7 +10,40 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "main.h"
+#include "archive.h"
+#include "report.h"
+#include "server.h"
+#include "bench.h"
+#include "dedupe.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "inventory.h"
+#include "fv.h"
+#include "interleave.h"
+#include "watch.h"
+#include "budget.h"
+#include "shard.h"
+
+FILE *gStatusOut;
+
+void Print(const char *Format, ...) {
+    va_list Args;
+
+    va_start(Args, Format);
+
+    if (gStatusOut != NULL) {
+        vfprintf(gStatusOut, Format, Args);
+    }
+    va_end(Args);
+}
 
 void *InternalMemSetMem16(void *Buffer, uint32_t Length, uint16_t Value) {
     do {
@@ -63,12 +96,16 @@ uint32_t ReadUnaligned32(const uint32_t *Buffer) {
  @param  NumOfBits The number of bits to shift and read.
  **/
 void FillBuf(SCRATCH_DATA *Sd, uint16_t NumOfBits) {
-    // Left shift NumOfBits of bits advance
-    Sd->mBitBuf = (uint32_t) (Sd->mBitBuf << NumOfBits);
+    // Hardened readers, the fail-fast check included, never skip more than a buffer
+    ASSERT(!Sd->mHardened || NumOfBits <= BITBUFSIZ);
+
+    // Left shift NumOfBits of bits advance, in 64 bits as the initial fill
+    // shifts by the whole BITBUFSIZ
+    Sd->mBitBuf = (uint32_t) ((uint64_t) Sd->mBitBuf << NumOfBits);
 
     // Copy data needed bytes into mSbuBitBuf
     while (NumOfBits > Sd->mBitCount) {
-        Sd->mBitBuf |= (uint32_t) (Sd->mSubBitBuf << (NumOfBits = (uint16_t) (NumOfBits - Sd->mBitCount)));
+        Sd->mBitBuf |= (uint32_t) ((uint64_t) Sd->mSubBitBuf << (NumOfBits = (uint16_t) (NumOfBits - Sd->mBitCount)));
 
         if (Sd->mCompSize > 0) {
             // Get 1 byte into SubBitBuf
@@ -109,6 +146,23 @@ uint32_t GetBits(SCRATCH_DATA *Sd, uint16_t NumOfBits) {
     return OutBits;
 }
 
+// Code lengths must describe a complete prefix code: sum of 2^-Len == 1
+static int CodeLengthsComplete(const uint8_t *BitLen, uint16_t NumOfChar) {
+    uint32_t Sum = 0;
+
+    for (uint16_t Index = 0; Index < NumOfChar; Index++) {
+        if (BitLen[Index] > 16) {
+            return 0;
+        }
+
+        if (BitLen[Index] != 0) {
+            Sum += 1U << (16 - BitLen[Index]);
+        }
+    }
+
+    return Sum == (1U << 16);
+}
+
 /**
  Creates Huffman Code mapping table for Extra Set, Char&Len Set
  and Position Set according to code length array.
@@ -141,6 +195,11 @@ uint16_t MakeTable(SCRATCH_DATA *Sd, uint16_t NumOfChar, uint8_t *BitLen, uint16
     }
 
     for (Index = 0; Index < NumOfChar; Index++) {
+        // Lengths above 16 would count outside Count[]
+        if (Sd->mHardened && BitLen[Index] > 16) {
+            return (uint16_t) BAD_TABLE;
+        }
+
         Count[BitLen[Index]]++;
     }
 
@@ -158,6 +217,11 @@ uint16_t MakeTable(SCRATCH_DATA *Sd, uint16_t NumOfChar, uint8_t *BitLen, uint16
         return (uint16_t) BAD_TABLE;
     }
 
+    // Start[17] wraps at 16 bits, so sets over-subscribed by a multiple of 0x10000 pass the check above
+    if (Sd->mHardened && !CodeLengthsComplete(BitLen, NumOfChar)) {
+        return (uint16_t) BAD_TABLE;
+    }
+
     uint16_t JuBits = (uint16_t) (16 - TableBits);
 
     Weight[0] = 0;
@@ -282,9 +346,18 @@ uint16_t ReadPTLen(SCRATCH_DATA *Sd, uint16_t nn, uint16_t nbit, uint16_t Specia
     // Read Extra Set Code Length Array size
     uint16_t Number = (uint16_t) GetBits(Sd, nbit);
 
+    if (Sd->mHardened && Number > nn) {
+        return (uint16_t) BAD_TABLE;
+    }
+
     if (Number == 0) {
         // This represents only Huffman code used
         CharC = (uint16_t) GetBits(Sd, nbit);
+
+        if (Sd->mHardened && CharC >= nn) {
+            return (uint16_t) BAD_TABLE;
+        }
+
         SetMem16(&Sd->mPTTable[0], sizeof (Sd->mPTTable), CharC);
         memset(Sd->mPTLen, 0, nn);
 
@@ -304,6 +377,11 @@ uint16_t ReadPTLen(SCRATCH_DATA *Sd, uint16_t nn, uint16_t nbit, uint16_t Specia
             while (Mask & Sd->mBitBuf) {
                 Mask >>= 1;
                 CharC += 1;
+
+                // Rejected before FillBuf() is asked to skip the whole run
+                if (Sd->mHardened && CharC > 16) {
+                    return (uint16_t) BAD_TABLE;
+                }
             }
         }
 
@@ -335,20 +413,31 @@ uint16_t ReadPTLen(SCRATCH_DATA *Sd, uint16_t nn, uint16_t nbit, uint16_t Specia
  generate the Huffman Code mapping table for the Char&Len Set.
 
  @param  Sd The global scratch data.
+
+ @retval  0 OK.
+ @retval  BAD_TABLE Table is corrupted, only reported when decoding hardened.
  **/
-void ReadCLen(SCRATCH_DATA *Sd) {
+uint16_t ReadCLen(SCRATCH_DATA *Sd) {
     uint16_t CharC;
 
     uint16_t Number = (uint16_t) GetBits(Sd, CBIT);
 
+    if (Sd->mHardened && Number > NC) {
+        return (uint16_t) BAD_TABLE;
+    }
+
     if (Number == 0) {
         // This represents only Huffman code used
         CharC = (uint16_t) GetBits(Sd, CBIT);
 
+        if (Sd->mHardened && CharC >= NC) {
+            return (uint16_t) BAD_TABLE;
+        }
+
         memset(Sd->mCLen, 0, NC);
         SetMem16(&Sd->mCTable[0], sizeof (Sd->mCTable), CharC);
 
-        return;
+        return 0;
     }
 
     uint16_t Index = 0;
@@ -390,7 +479,10 @@ void ReadCLen(SCRATCH_DATA *Sd) {
 
     memset(Sd->mCLen + Index, 0, NC - Index);
 
-    MakeTable(Sd, NC, Sd->mCLen, 12, Sd->mCTable);
+    // Unchecked decoding has always carried on with a bad Char&Len table
+    uint16_t Status = MakeTable(Sd, NC, Sd->mCLen, 12, Sd->mCTable);
+
+    return Sd->mHardened ? Status : 0;
 }
 
 /**
@@ -422,7 +514,11 @@ DecodeC(
 
         // Read and decode the Char&Len Set Code Length Arrary,
         // Generate the Huffman code mapping table for Char&Len Set.
-        ReadCLen(Sd);
+        Sd->mBadTableFlag = ReadCLen(Sd);
+
+        if (Sd->mBadTableFlag != 0) {
+            return 0;
+        }
 
         // Read the Position Set Code Length Arrary,
         // Generate the Huffman code mapping table for the Position Set.
@@ -512,6 +608,63 @@ Done:
     return;
 }
 
+/**
+ Decode the source data like Decode(), validating every back reference.
+
+ The checks run once per match rather than once per byte: a distance must
+ stay inside the output produced so far and the copy is clipped to the
+ output size before the byte loop starts.
+
+ @param  Sd The global scratch data.
+ **/
+void DecodeHardened(SCRATCH_DATA *Sd) {
+    for (;;) {
+        // Get one code from mBitBuf
+        uint16_t CharC = DecodeC(Sd);
+        if (Sd->mBadTableFlag != 0) {
+            return;
+        }
+
+        if (CharC < 256) {
+            // Process an Original character
+            if (Sd->mOutBuf >= Sd->mOrigSize) {
+                return;
+            }
+
+            Sd->mDstBase[Sd->mOutBuf++] = (uint8_t) CharC;
+
+        } else {
+            // Process a Pointer
+            uint32_t Length = (uint32_t) (CharC - (BIT8 - THRESHOLD));
+            uint32_t Distance = DecodeP(Sd) + 1;
+
+            // A reference may not reach before the start of the output
+            if (Distance > Sd->mOutBuf) {
+                Sd->mBadTableFlag = (uint16_t) BAD_TABLE;
+                return;
+            }
+
+            if (Length > Sd->mOrigSize - Sd->mOutBuf) {
+                Length = Sd->mOrigSize - Sd->mOutBuf;
+            }
+
+            // Overlapping copies are intended, they repeat the last Distance bytes
+            uint8_t *Dst = Sd->mDstBase + Sd->mOutBuf;
+            const uint8_t *Src = Dst - Distance;
+
+            for (uint32_t Index = 0; Index < Length; Index++) {
+                Dst[Index] = Src[Index];
+            }
+
+            Sd->mOutBuf += Length;
+
+            if (Sd->mOutBuf >= Sd->mOrigSize) {
+                return;
+            }
+        }
+    }
+}
+
 /**
  Given a compressed source buffer, this function retrieves the size of
  the uncompressed buffer and the size of the scratch buffer required
@@ -578,35 +731,95 @@ RETURN_STATUS UefiDecompressGetInfo(const void *Source, uint32_t SourceSize, uin
 }
 
 /**
- Decompresses a compressed source buffer.
+ Cheaply decide whether Source can be a compressed stream at all, before
+ anything the size of its decompressed data is allocated.
 
- Extracts decompressed data to its original form.
- This function is designed so that the decompression algorithm can be implemented
- withusing any memory services.  As a result, this function is not allowed to
- call any memory allocation services its implementation.  It is the caller's
- responsibility to allocate and free the Destination and Scratch buffers.
- If the compressed source data specified by Source is successfully decompressed
- into Destination, then RETURN_SUCCESS is returned.  If the compressed source data
- specified by Source is not a valid compressed data format,
- then RETURN_INVALID_PARAMETER is returned.
+ The sizes in the header must be consistent with the input and with the
+ most the block headers that fit in it can expand to, and the first block
+ header must carry a non-empty block whose Extra, Char&Len and Position
+ code length sets each form a complete prefix code. Only the block header is read, so this
+ costs microseconds however large the stream claims to be.
 
- If Source is NULL, then ASSERT().
- If Destination is NULL, then ASSERT().
- If the required scratch buffer size > 0 and Scratch is NULL, then ASSERT().
+ @param  Source     The source buffer containing the compressed data.
+ @param  SourceSize The size, bytes, of the source buffer.
+ @param  Scratch    A scratch buffer of the size UefiDecompressGetInfo() returns.
 
- @param  Source      The source buffer containing the compressed data.
- @param  Destination The destination buffer to store the decompressed data.
- @param  Scratch     A temporary scratch buffer that is used to perform the decompression.
- This is an optional parameter that may be NULL if the
- required scratch buffer size is 0.
+ @retval  RETURN_SUCCESS The stream is plausible.
+ @retval  RETURN_INVALID_PARAMETER The stream is not compressed data or is corrupt.
+ **/
+RETURN_STATUS UefiDecompressCheck(const void *Source, uint32_t SourceSize, void *Scratch) {
+    ASSERT(Source != NULL);
+    ASSERT(Scratch != NULL);
 
- @retval  RETURN_SUCCESS Decompression completed successfully, and
- the uncompressed buffer is returned Destination.
- @retval  RETURN_INVALID_PARAMETER
- The source buffer specified by Source is corrupted
- (not a valid compressed format).
+    const uint8_t *Src = Source;
+    SCRATCH_DATA *Sd = (SCRATCH_DATA *) Scratch;
+
+    if (SourceSize < 8) {
+        return RETURN_INVALID_PARAMETER;
+    }
+
+    uint32_t CompSize = Src[0] + (Src[1] << 8) + (Src[2] << 16) + (Src[3] << 24);
+    uint32_t OrigSize = Src[4] + (Src[5] << 8) + (Src[6] << 16) + (Src[7] << 24);
+
+    if (OrigSize == 0 || CompSize == 0 || CompSize > SourceSize - 8) {
+        return RETURN_INVALID_PARAMETER;
+    }
+
+    if ((uint64_t) OrigSize > (uint64_t) CompSize * 8 / PLAUSIBLE_BLOCK_BITS * PLAUSIBLE_BLOCK_OUTPUT) {
+        return RETURN_INVALID_PARAMETER;
+    }
+
+    memset(Sd, 0, sizeof(SCRATCH_DATA));
+
+    Sd->mHardened = 1;
+    Sd->mPBit = 4;
+    Sd->mSrcBase = (uint8_t *) Src + 8;
+    Sd->mCompSize = CompSize;
+
+    FillBuf(Sd, BITBUFSIZ);
+
+    if (GetBits(Sd, 16) == 0) {
+        return RETURN_INVALID_PARAMETER;
+    }
+
+    // Number == 0 selects a single code, anything else must be a complete code
+    uint16_t Number = (uint16_t) (Sd->mBitBuf >> (BITBUFSIZ - TBIT));
+
+    if (ReadPTLen(Sd, NT, TBIT, 3) != 0 || (Number != 0 && !CodeLengthsComplete(Sd->mPTLen, NT))) {
+        return RETURN_INVALID_PARAMETER;
+    }
+
+    Number = (uint16_t) (Sd->mBitBuf >> (BITBUFSIZ - CBIT));
+
+    if (ReadCLen(Sd) != 0 || (Number != 0 && !CodeLengthsComplete(Sd->mCLen, NC))) {
+        return RETURN_INVALID_PARAMETER;
+    }
+
+    Number = (uint16_t) (Sd->mBitBuf >> (BITBUFSIZ - Sd->mPBit));
+
+    if (ReadPTLen(Sd, MAXNP, Sd->mPBit, (uint16_t) (-1)) != 0 || (Number != 0 && !CodeLengthsComplete(Sd->mPTLen, MAXNP))) {
+        return RETURN_INVALID_PARAMETER;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+/**
+ Set Scratch up to decode Source into Destination: check the header sizes
+ as UefiDecompressEx() does and fill the bit buffer. Nothing is decoded;
+ a stream with an OrigSize of 0 is left with mOrigSize 0.
+
+ @param  Source          The source buffer containing the compressed data.
+ @param  SourceSize      The size, bytes, of the source buffer.
+ @param  Destination     The destination buffer to store the decompressed data.
+ @param  DestinationSize The size, bytes, of the destination buffer.
+ @param  Scratch         The scratch buffer to set up.
+ @param  Flags           DECOMPRESS_HARDENED to check the sizes against the buffers.
+
+ @retval  RETURN_SUCCESS Scratch is ready for decoding.
+ @retval  RETURN_INVALID_PARAMETER The stream does not fit the buffers.
  **/
-RETURN_STATUS UefiDecompress(const void *Source, void *Destination, void *Scratch) {
+RETURN_STATUS UefiDecompressBegin(const void *Source, uint32_t SourceSize, void *Destination, uint32_t DestinationSize, void *Scratch, uint32_t Flags) {
     ASSERT(Source != NULL);
     ASSERT(Destination != NULL);
     ASSERT(Scratch != NULL);
@@ -616,16 +829,34 @@ RETURN_STATUS UefiDecompress(const void *Source, void *Destination, void *Scratc
 
     SCRATCH_DATA *Sd = (SCRATCH_DATA *) Scratch;
 
+    memset(Sd, 0, sizeof(SCRATCH_DATA));
+
+    if ((Flags & DECOMPRESS_HARDENED) != 0 && SourceSize < 8) {
+        return RETURN_INVALID_PARAMETER;
+    }
+
     uint32_t CompSize = Src[0] + (Src[1] << 8) + (Src[2] << 16) + (Src[3] << 24);
     uint32_t OrigSize = Src[4] + (Src[5] << 8) + (Src[6] << 16) + (Src[7] << 24);
 
-    // If compressed file size is 0, return
+    // If compressed file size is 0, there is nothing to decode
     if (OrigSize == 0) {
         return RETURN_SUCCESS;
     }
 
+    if ((Flags & DECOMPRESS_HARDENED) != 0) {
+        // Trust the buffers over the header
+        if (OrigSize > DestinationSize) {
+            return RETURN_INVALID_PARAMETER;
+        }
+
+        if (CompSize > SourceSize - 8) {
+            CompSize = SourceSize - 8;
+        }
+    }
+
     Src = Src + 8;
-    memset(Sd, 0, sizeof(SCRATCH_DATA));
+
+    Sd->mHardened = (Flags & DECOMPRESS_HARDENED) != 0;
 
     // The length of the field 'Position Set Code Length Array Size' Block Header.
     // For UEFI 2.0 de/compression algorithm(Version 1), mPBit = 4
@@ -640,8 +871,65 @@ RETURN_STATUS UefiDecompress(const void *Source, void *Destination, void *Scratc
     // Fill the first BITBUFSIZ bits
     FillBuf(Sd, BITBUFSIZ);
 
+    return RETURN_SUCCESS;
+}
+
+/**
+ Decompresses a compressed source buffer.
+
+ Extracts decompressed data to its original form.
+ This function is designed so that the decompression algorithm can be implemented
+ withusing any memory services.  As a result, this function is not allowed to
+ call any memory allocation services its implementation.  It is the caller's
+ responsibility to allocate and free the Destination and Scratch buffers.
+ If the compressed source data specified by Source is successfully decompressed
+ into Destination, then RETURN_SUCCESS is returned.  If the compressed source data
+ specified by Source is not a valid compressed data format,
+ then RETURN_INVALID_PARAMETER is returned.
+
+ If Source is NULL, then ASSERT().
+ If Destination is NULL, then ASSERT().
+ If the required scratch buffer size > 0 and Scratch is NULL, then ASSERT().
+
+ @param  Source          The source buffer containing the compressed data.
+ @param  SourceSize      The size, bytes, of the source buffer.
+ @param  Destination     The destination buffer to store the decompressed data.
+ @param  DestinationSize The size, bytes, of the destination buffer.
+ @param  Scratch         A temporary scratch buffer that is used to perform the decompression.
+ This is an optional parameter that may be NULL if the
+ required scratch buffer size is 0.
+ @param  Flags           DECOMPRESS_HARDENED to validate the stream against the
+ buffer sizes, its code tables and back references. The sizes
+ are only used in that mode. DECOMPRESS_PIPELINED to copy
+ matches on a second thread for large images.
+
+ @retval  RETURN_SUCCESS Decompression completed successfully, and
+ the uncompressed buffer is returned Destination.
+ @retval  RETURN_INVALID_PARAMETER
+ The source buffer specified by Source is corrupted
+ (not a valid compressed format).
+ **/
+RETURN_STATUS UefiDecompressEx(const void *Source, uint32_t SourceSize, void *Destination, uint32_t DestinationSize, void *Scratch, uint32_t Flags) {
+    SCRATCH_DATA *Sd = (SCRATCH_DATA *) Scratch;
+
+    if (UefiDecompressBegin(Source, SourceSize, Destination, DestinationSize, Scratch, Flags) != RETURN_SUCCESS) {
+        return RETURN_INVALID_PARAMETER;
+    }
+
+    if (Sd->mOrigSize == 0) {
+        return RETURN_SUCCESS;
+    }
+
     // Decompress it
-    Decode(Sd);
+    if ((Flags & DECOMPRESS_PROFILED) != 0) {
+        DecodeProfiled(Sd);
+    } else if ((Flags & DECOMPRESS_PIPELINED) != 0 && Sd->mOrigSize >= PIPELINE_MIN_SIZE) {
+        DecodePipelined(Sd);
+    } else if (Sd->mHardened) {
+        DecodeHardened(Sd);
+    } else {
+        Decode(Sd);
+    }
 
     if (Sd->mBadTableFlag != 0) {
         // Something wrong with the source
@@ -651,43 +939,143 @@ RETURN_STATUS UefiDecompress(const void *Source, void *Destination, void *Scratc
     return RETURN_SUCCESS;
 }
 
+/**
+ Decompresses a compressed source buffer without hardening, trusting the
+ sizes in its header. See UefiDecompressEx().
+
+ @param  Source      The source buffer containing the compressed data.
+ @param  Destination The destination buffer to store the decompressed data.
+ @param  Scratch     A temporary scratch buffer that is used to perform the decompression.
+
+ @retval  RETURN_SUCCESS Decompression completed successfully.
+ @retval  RETURN_INVALID_PARAMETER The source buffer is corrupted.
+ **/
+RETURN_STATUS UefiDecompress(const void *Source, void *Destination, void *Scratch) {
+    return UefiDecompressEx(Source, UINT32_MAX, Destination, UINT32_MAX, Scratch, 0);
+}
+
+uint64_t ElapsedNs(const struct timespec *Start, const struct timespec *End) {
+    return (uint64_t) (End->tv_sec - Start->tv_sec) * 1000000000ULL + (uint64_t) End->tv_nsec - (uint64_t) Start->tv_nsec;
+}
+
+// Hardware counters follow the timed phases; DecodeProfiled() refines decoding
+static const PROFILE_PHASE mProfilePhases[EXTRACT_PHASE_COUNT + 1] = {
+    PROFILE_PHASE_PARSE,
+    PROFILE_PHASE_NONE,
+    PROFILE_PHASE_SYMBOLS,
+    PROFILE_PHASE_WRITE,
+    PROFILE_PHASE_NONE
+};
+
+void PhaseBegin(EXTRACT_STATS *Stats, EXTRACT_PHASE Phase) {
+    struct timespec Wall;
+    struct timespec Cpu;
+
+    clock_gettime(CLOCK_MONOTONIC, &Wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &Cpu);
+
+    if (Stats->mPhase < EXTRACT_PHASE_COUNT) {
+        Stats->WallNs[Stats->mPhase] += ElapsedNs(&Stats->mWallStart, &Wall);
+        Stats->CpuNs[Stats->mPhase] += ElapsedNs(&Stats->mCpuStart, &Cpu);
+    }
+
+    Stats->mPhase = Phase;
+    Stats->mWallStart = Wall;
+    Stats->mCpuStart = Cpu;
+
+    ProfileSwitch(mProfilePhases[Phase]);
+}
+
+void PhaseEnd(EXTRACT_STATS *Stats) {
+    PhaseBegin(Stats, EXTRACT_PHASE_NONE);
+}
+
 void Usage(const char *appname) {
     printf("UEFI option ROM extractor and decompressor V1.0\n");
     printf("This program extracts and decompresses UEFI .rom files in their .efi files\n");
-    printf("Usage: %s <In_File> <Out_File>\n\n", appname);
+    printf("Usage: %s [-r <Report>] [--profile] <In_File> <Out_File>\n", appname);
+    printf("       %s [-r <Report>] [--profile | -I <Streams>] [--shard <i>/<N>] -a <Archive> <In_File>...\n", appname);
+    printf("       %s [-r <Report>] [--profile] [-i] [--shard <i>/<N>] -D <Out_Dir> <In_File>...\n", appname);
+    printf("       %s --merge <Out_Dir> <Shard_Dir>...\n", appname);
+    printf("       %s [-w <Workers>] [-M <Bytes>] [--shard <i>/<N>] -F <Out_Dir> <In_File>...\n", appname);
+    printf("       %s [-r <Report>] [-w <Workers>] [-M <Bytes>] -S <Socket>\n", appname);
+    printf("       %s [-r <Report>] [-w <Workers>] [-M <Bytes>] -W <Spool_Dir> <Out_Dir>\n", appname);
+    printf("       %s [-L <Count>] -C <Socket> <In_File> <Out_File>\n", appname);
+    printf("       %s -B <Count> <In_File>\n", appname);
+    printf("       %s -l <In_File>...\n\n", appname);
+    printf("  <In_File> and <Out_File> may be - for stdin and stdout\n\n");
+    printf("  -a <Archive>  Append every extracted image with its metadata to one tar\n");
+    printf("                archive instead of writing one file per image, - for stdout\n");
+    printf("  -I <Streams>  Decode 2 to 4 inputs of -a in lockstep on one thread to overlap\n");
+    printf("                their table lookups; always hardened, as if -H were given\n");
+    printf("  -D <Out_Dir>  Deduplicate: decode every distinct payload once, write each\n");
+    printf("                distinct image once as <sha256>.efi plus manifest.ndjson\n");
+    printf("  -i            Incremental -D run: skip inputs unchanged since the manifest\n");
+    printf("  --shard <i>/<N>\n");
+    printf("                Only extract the i-th of N parts of the inputs, split by path\n");
+    printf("                hash and balanced by size; -D writes manifest.<i>-of-<N>.ndjson\n");
+    printf("  --merge <Out_Dir>\n");
+    printf("                Merge the -D directories of all shards into one manifest and\n");
+    printf("                image set in Out_Dir\n");
+    printf("  -F <Out_Dir>  Walk UEFI firmware volumes, decode their compressed sections\n");
+    printf("                in parallel and write every PE32 and TE image to Out_Dir\n");
+    printf("  -r <Report>   Write one JSON object per processed image with its sizes,\n");
+    printf("                result and per-phase timings, - for stdout when neither the\n");
+    printf("                image nor the archive is written there\n");
+    printf("  -S <Socket>   Run as a server extracting requests received on a Unix socket\n");
+    printf("  -W <Spool_Dir> Watch Spool_Dir and extract every file written or moved into\n");
+    printf("                it to <Out_Dir>/<name>.efi as soon as it lands\n");
+    printf("  -w <Workers>  Number of server, -W or -F worker threads, default one per CPU\n");
+    printf("  -M <Bytes>    Memory budget for the input and output buffers of the -S, -W\n");
+    printf("                or -F workers, K, M or G suffix allowed: images and sections\n");
+    printf("                wait until they fit, those that never can fail with -12\n");
+    printf("  -C <Socket>   Have the server on the socket do the extraction\n");
+    printf("  -L <Count>    Load test: extract Count times through the server given with\n");
+    printf("                -C, or one process per extraction without it\n");
+    printf("  -H            Hardened decoding for untrusted input: validate code tables,\n");
+    printf("                input bounds and back references; with -C, for that request\n");
+    printf("  -P            Pipelined decoding: copy matches on a second thread while the\n");
+    printf("                stream is entropy decoded, for large images\n");
+    printf("  -p, --profile Count cycles, instructions, branch and cache misses per phase\n");
+    printf("                (parse, tables, symbols, copy, write) with perf_event_open\n");
+    printf("  --huge-pages[=transparent|explicit]\n");
+    printf("                Back output buffers of 2 MiB and more with transparent huge\n");
+    printf("                pages, or with reserved hugetlbfs pages where available,\n");
+    printf("                recycled between the images of -a, -D, -F and -S runs\n");
+    printf("  -B <Count>    Benchmark: decode <In_File> Count times in every decoder mode\n");
+    printf("  -l            List every image in the ROM chain with its headers and stream\n");
+    printf("                sizes without decompressing anything\n\n");
     printf("Copyright (C) 2014 - AnV Software, all rights reserved\n");
 }
 
-uint8_t GetEfiCompressedROM(const char *InFile, uint8_t Pci23, uint32_t *EFIIMGStart) {
+// Copy Size bytes at Offset out of the ROM, the in-memory counterpart of fseek + fread
+static int RomRead(const uint8_t *Rom, uint32_t RomSize, uint64_t Offset, void *Dst, uint32_t Size) {
+    if (Offset > RomSize || RomSize - Offset < Size) {
+        return -1;
+    }
+
+    memcpy(Dst, Rom + Offset, Size);
+
+    return 0;
+}
+
+uint8_t GetEfiCompressedROM(const uint8_t *Rom, uint32_t RomSize, uint8_t Pci23, EFI_ROM_INFO *RomInfo) {
     PCI_EXPANSION_ROM_HEADER PciRomHdr;
-    FILE *InFptr;
     uint32_t ImageStart;
     EFI_PCI_EXPANSION_ROM_HEADER EfiRomHdr;
     PCI_DATA_STRUCTURE PciDs23;
     PCI_3_0_DATA_STRUCTURE PciDs30;
+    uint16_t ImageLength;
 
-    // Open the input file
-    if ((InFptr = fopen(InFile, "rb")) == NULL) {
-        printf("Error opening file %s!\n", InFile);
-
-        return 0;
-    }
     // Go through the image and dump the header stuff for each
     uint32_t ImageCount = 0;
-    for (;;) {
-        // Save position in the file, since offsets in the headers are relative to the particular image.
-        ImageStart = (uint32_t) ftell(InFptr);
+    for (ImageStart = 0;;) {
+        // Offsets in the headers are relative to the particular image.
         ImageCount++;
 
         // Read the option ROM header. Have to assume a raw binary image for now.
-        if (fread(&PciRomHdr, sizeof (PciRomHdr), 1, InFptr) != 1) {
-            printf("Failed to read PCI ROM header from file!\n");
-            goto BailOut;
-        }
-
-        // Find PCI data structure
-        if (fseek(InFptr, ImageStart + PciRomHdr.PcirOffset, SEEK_SET)) {
-            printf("Failed to seek to PCI data structure!\n");
+        if (RomRead(Rom, RomSize, ImageStart, &PciRomHdr, sizeof (PciRomHdr))) {
+            Print("Failed to read PCI ROM header from file!\n");
             goto BailOut;
         }
 
@@ -696,176 +1084,1101 @@ uint8_t GetEfiCompressedROM(const char *InFile, uint8_t Pci23, uint32_t *EFIIMGS
         memset(&PciDs30, 0, sizeof (PciDs30));
 
         if (Pci23 == 1) {
-            if (fread(&PciDs23, sizeof (PciDs23), 1, InFptr) != 1) {
-                printf("Failed to read PCI data structure from file %s!\n", InFile);
+            if (RomRead(Rom, RomSize, (uint64_t) ImageStart + PciRomHdr.PcirOffset, &PciDs23, sizeof (PciDs23))) {
+                Print("Failed to read PCI data structure from file!\n");
                 goto BailOut;
             }
         } else {
-            if (fread(&PciDs30, sizeof (PciDs30), 1, InFptr) != 1) {
-                printf("Failed to read PCI data structure from file %s!\n", InFile);
+            if (RomRead(Rom, RomSize, (uint64_t) ImageStart + PciRomHdr.PcirOffset, &PciDs30, sizeof (PciDs30))) {
+                Print("Failed to read PCI data structure from file!\n");
                 goto BailOut;
             }
         }
         if ((PciDs23.CodeType == PCI_CODE_TYPE_EFI_IMAGE) || (PciDs30.CodeType == PCI_CODE_TYPE_EFI_IMAGE)) {
             // Re-read the header as an EFI ROM header, then dump more info
-            if (fseek(InFptr, ImageStart, SEEK_SET)) {
-                printf("Failed to re-seek to ROM header structure!\n");
+            if (RomRead(Rom, RomSize, ImageStart, &EfiRomHdr, sizeof (EfiRomHdr))) {
+                Print("Failed to read EFI PCI ROM header from file!\n");
                 goto BailOut;
             }
 
-            if (fread(&EfiRomHdr, sizeof (EfiRomHdr), 1, InFptr) != 1) {
-                printf("Failed to read EFI PCI ROM header from file!\n");
-                goto BailOut;
-            }
-        
-            if (EfiRomHdr.CompressionType == EFI_PCI_EXPANSION_ROM_HEADER_COMPRESSED) {
-                EFIIMGStart[0] = EfiRomHdr.EfiImageHeaderOffset + (unsigned) ImageStart;
+            RomInfo->RomOffset = EfiRomHdr.EfiImageHeaderOffset + (unsigned) ImageStart;
+            RomInfo->ImageStart = ImageStart;
+            RomInfo->VendorId = Pci23 == 1 ? PciDs23.VendorId : PciDs30.VendorId;
+            RomInfo->DeviceId = Pci23 == 1 ? PciDs23.DeviceId : PciDs30.DeviceId;
+            RomInfo->EfiSubsystem = EfiRomHdr.EfiSubsystem;
+            RomInfo->EfiMachineType = EfiRomHdr.EfiMachineType;
+            RomInfo->CompressionType = EfiRomHdr.CompressionType;
 
-                printf("Found compressed EFI ROM start at 0x%x\n", EFIIMGStart[0]);
-                fclose(InFptr);
+            if (EfiRomHdr.CompressionType == EFI_PCI_EXPANSION_ROM_HEADER_COMPRESSED) {
+                Print("Found compressed EFI ROM start at 0x%x\n", RomInfo->RomOffset);
                 return 1;
 
             }
-            
-            fclose(InFptr);
-            printf("Found non-compressed EFI ROM start at 0x%x, exiting...\n", EfiRomHdr.EfiImageHeaderOffset + (unsigned) ImageStart);
 
-            exit(-1);
+            Print("Found non-compressed EFI ROM start at 0x%x, exiting...\n", RomInfo->RomOffset);
+
+            return 2;
         }
 
         if ((PciDs23.Indicator == INDICATOR_LAST) || (PciDs30.Indicator == INDICATOR_LAST)) {
             goto BailOut;
         }
 
-        // Seek to the start of the next image
-        if (Pci23 == 1) {
-            if (fseek(InFptr, ImageStart + (PciDs23.ImageLength * 512), SEEK_SET)) {
-                printf("Failed to seek to next image!\n");
-                goto BailOut;
-            }
-        } else {
-            if (fseek(InFptr, ImageStart + (PciDs30.ImageLength * 512), SEEK_SET)) {
-                printf("Failed to seek to next image!\n");
-                goto BailOut;
-            }
+        // Move on to the start of the next image
+        ImageLength = Pci23 == 1 ? PciDs23.ImageLength : PciDs30.ImageLength;
+
+        if (ImageLength == 0 || (uint64_t) ImageStart + ImageLength * 512 >= RomSize) {
+            Print("Failed to seek to next image!\n");
+            goto BailOut;
         }
+
+        ImageStart += ImageLength * 512;
     }
 
 BailOut:
-    printf("No compressed EFI ROM found!\n");
-    fclose(InFptr);
-    EFIIMGStart[0] = 0;
+    Print("No compressed EFI ROM found!\n");
+    memset(RomInfo, 0, sizeof (*RomInfo));
     return 0;
 }
 
-int main(int argc, const char *argv[]) {
-    long fInSize = 0;
-    long fROMStart = 0;
-    long fOutSize = 0;
-    long ScratchSize = 0;
+int ExtractContextInit(EXTRACT_CONTEXT *Ctx) {
+    memset(Ctx, 0, sizeof (*Ctx));
 
-    if (argc != 3) {
-        Usage(argv[0]);
-        return 1;
-    }
+    Ctx->Scratch = malloc(sizeof (SCRATCH_DATA));
 
-    FILE *fIn = fopen(argv[1], "rb");
-    fseek(fIn, 0, SEEK_END);
-    fInSize = ftell(fIn);
-    fseek(fIn, 0, SEEK_SET);
+    return Ctx->Scratch != NULL ? 0 : -1;
+}
 
-    void *Buffer = malloc(fInSize);
+void ExtractContextDropOutput(EXTRACT_CONTEXT *Ctx) {
+    if (Ctx->mOutArenaSize != 0) {
+        ArenaRecycle(Ctx->Arena, Ctx->OutBuffer, Ctx->mOutArenaSize);
+    } else {
+        free(Ctx->OutBuffer);
+    }
 
-    if (Buffer == NULL) {
-        printf("Input buffer allocation failed!\n");
+    Ctx->OutBuffer = NULL;
+    Ctx->OutCapacity = 0;
+    Ctx->mOutArenaSize = 0;
+}
 
-        return -1;
+int ExtractContextReserve(EXTRACT_CONTEXT *Ctx, uint32_t Size) {
+    // Warm contexts keep their output buffer, it only ever grows
+    if (Ctx->OutCapacity >= Size) {
+        return 0;
     }
 
-    fread(Buffer, fInSize, 1, fIn);
-    fclose(fIn);
+    ExtractContextDropOutput(Ctx);
 
-    if (!GetEfiCompressedROM(argv[1], 0, (uint32_t *) &fROMStart)) {
-        if (!GetEfiCompressedROM(argv[1], 1, (uint32_t *) &fROMStart)) {
-            printf("Not an EFI ROM file, attempting decompression of data directly...\n");
-        }
+    if (Ctx->Arena != NULL) {
+        Ctx->OutBuffer = ArenaAlloc(Ctx->Arena, Size, &Ctx->mOutArenaSize);
+    } else {
+        Ctx->OutBuffer = malloc(Size);
     }
 
-    if (fROMStart > 0) {
-        void *ROMBuffer = malloc(fInSize - fROMStart);
+    if (Ctx->OutBuffer == NULL) {
+        Print("Output buffer buffer allocation failed!\n");
+        Ctx->mOutArenaSize = 0;
 
-        if (ROMBuffer == NULL) {
-            printf("Could not allocation new ROM buffer!\n");
-            free(Buffer);
+        return -7;
+    }
+
+    // Arena buffers come rounded up to their class, use all of it
+    Ctx->OutCapacity = Ctx->mOutArenaSize > Size && Ctx->mOutArenaSize <= UINT32_MAX ? (uint32_t) Ctx->mOutArenaSize : Size;
+
+    return 0;
+}
+
+void ExtractContextFree(EXTRACT_CONTEXT *Ctx) {
+    free(Ctx->Scratch);
+    ExtractContextDropOutput(Ctx);
+    memset(Ctx, 0, sizeof (*Ctx));
+}
+
+int LoadInputFile(const char *InFile, uint8_t **Buffer, uint32_t *Size) {
+    *Buffer = NULL;
+    *Size = 0;
+
+    // Pipes cannot be sized up front, collect them in a growing buffer
+    if (strcmp(InFile, "-") == 0) {
+        uint32_t Capacity = 0;
 
-            return -2;
+        if (LoadInputFd(STDIN_FILENO, Buffer, &Capacity, Size)) {
+            Print("Failed to read input from stdin!\n");
+            free(*Buffer);
+            *Buffer = NULL;
+
+            return -1;
         }
 
-        memcpy(ROMBuffer, (uint8_t *) Buffer + fROMStart, fInSize - fROMStart);
-        free(Buffer);
+        return 0;
+    }
+
+    FILE *fIn = fopen(InFile, "rb");
+
+    if (fIn == NULL) {
+        Print("Error opening file %s!\n", InFile);
 
-        Buffer = ROMBuffer;
-        fInSize -= fROMStart;
+        return -1;
     }
 
-    if (UefiDecompressGetInfo(Buffer, (uint32_t) fInSize, (uint32_t *) &fOutSize, (uint32_t *) &ScratchSize)) {
-        printf("get UEFI decompression info failed!\n");
-        free(Buffer);
+    fseek(fIn, 0, SEEK_END);
+    long fInSize = ftell(fIn);
+    fseek(fIn, 0, SEEK_SET);
+
+    if (fInSize < 0 || fInSize > UINT32_MAX) {
+        Print("Unsupported input file size %ld!\n", fInSize);
+        fclose(fIn);
+
+        return -1;
+    }
+
+    uint8_t *Data = malloc(fInSize > 0 ? fInSize : 1);
+
+    if (Data == NULL) {
+        Print("Input buffer allocation failed!\n");
+        fclose(fIn);
+
+        return -1;
+    }
+
+    if (fInSize > 0 && fread(Data, fInSize, 1, fIn) != 1) {
+        Print("Failed to read input file %s!\n", InFile);
+        fclose(fIn);
+        free(Data);
+
+        return -1;
+    }
+
+    fclose(fIn);
+
+    *Buffer = Data;
+    *Size = (uint32_t) fInSize;
+
+    return 0;
+}
+
+int LoadInputFd(int Fd, uint8_t **Buffer, uint32_t *Capacity, uint32_t *Size) {
+    struct stat St;
+    uint64_t Offset = 0;
+    int Seekable = 1;
+
+    *Size = 0;
+
+    // Size the buffer up front when the descriptor knows its length
+    if (fstat(Fd, &St) == 0 && S_ISREG(St.st_mode) && (uint64_t) St.st_size + 1 > *Capacity) {
+        if ((uint64_t) St.st_size >= UINT32_MAX) {
+            return -1;
+        }
+
+        uint8_t *Grown = realloc(*Buffer, (size_t) St.st_size + 1);
+
+        if (Grown == NULL) {
+            return -1;
+        }
+
+        *Buffer = Grown;
+        *Capacity = (uint32_t) St.st_size + 1;
+    }
+
+    for (;;) {
+        if (Offset == *Capacity) {
+            uint64_t NewCapacity = *Capacity != 0 ? (uint64_t) *Capacity * 2 : 65536;
+
+            if (NewCapacity > UINT32_MAX) {
+                NewCapacity = UINT32_MAX;
+            }
+
+            if (NewCapacity == Offset) {
+                return -1;
+            }
+
+            uint8_t *Grown = realloc(*Buffer, (size_t) NewCapacity);
+
+            if (Grown == NULL) {
+                return -1;
+            }
+
+            *Buffer = Grown;
+            *Capacity = (uint32_t) NewCapacity;
+        }
+
+        ssize_t Got = Seekable ? pread(Fd, *Buffer + Offset, *Capacity - Offset, (off_t) Offset)
+                               : read(Fd, *Buffer + Offset, *Capacity - Offset);
+
+        if (Got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (Seekable && errno == ESPIPE) {
+                Seekable = 0;
+                continue;
+            }
+
+            return -1;
+        }
+
+        if (Got == 0) {
+            break;
+        }
+
+        Offset += (uint64_t) Got;
+    }
+
+    *Size = (uint32_t) Offset;
+
+    return 0;
+}
+
+void ExtractStatsInit(EXTRACT_STATS *Stats) {
+    memset(Stats, 0, sizeof (*Stats));
+    Stats->mPhase = EXTRACT_PHASE_NONE;
+}
+
+int LocateEfiStream(EXTRACT_CONTEXT *Ctx, const uint8_t *Rom, uint32_t RomSize, EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats) {
+    uint32_t fROMStart = 0;
+    uint32_t fOutSize = 0;
+    uint32_t ScratchSize = 0;
+
+    PhaseBegin(Stats, EXTRACT_PHASE_PARSE);
+
+    memset(RomInfo, 0, sizeof (*RomInfo));
+
+    Stats->InputSize = RomSize;
+
+    uint8_t Found = GetEfiCompressedROM(Rom, RomSize, 0, RomInfo);
+
+    if (Found == 0) {
+        Found = GetEfiCompressedROM(Rom, RomSize, 1, RomInfo);
+    }
+
+    if (Found == 2) {
+        return -1;
+    }
+
+    if (Found == 0) {
+        Print("Not an EFI ROM file, attempting decompression of data directly...\n");
+    }
+
+    fROMStart = RomInfo->RomOffset;
+
+    if (fROMStart >= RomSize && fROMStart > 0) {
+        Print("Compressed EFI ROM start lies beyond the end of the file!\n");
+
+        return -2;
+    }
+
+    // Decode straight out of the input, the stream starts at the ROM offset
+    const uint8_t *Buffer = Rom + fROMStart;
+    uint32_t fInSize = RomSize - fROMStart;
+
+    if (UefiDecompressGetInfo(Buffer, fInSize, &fOutSize, &ScratchSize)) {
+        Print("get UEFI decompression info failed!\n");
 
         return -3;
     }
 
-    printf("Input size: %lu, Output size: %lu, Scratch size: %lu\n", fInSize, fOutSize, ScratchSize);
+    RomInfo->CompSize = ReadUnaligned32((const uint32_t *) Buffer);
+    RomInfo->OrigSize = fOutSize;
+
+    Print("Input size: %u, Output size: %u, Scratch size: %u\n", fInSize, fOutSize, ScratchSize);
 
-    if (fOutSize <= 0) {
-        printf("Incorrect output size!\n");
-        free(Buffer);
+    if (fOutSize == 0) {
+        Print("Incorrect output size!\n");
 
         return -4;
     }
 
-    if (ScratchSize <= 0) {
-        printf("Incorrect scratch buffer size!\n");
-        free(Buffer);
+    if (ScratchSize == 0 || ScratchSize > sizeof (SCRATCH_DATA)) {
+        Print("Incorrect scratch buffer size!\n");
 
         return -5;
     }
 
-    void *ScratchBuffer = malloc(ScratchSize);
-
-    if (ScratchBuffer == NULL) {
-        printf("Scratch buffer allocation failed!\n");
-        free(Buffer);
+    if (Ctx->Scratch == NULL) {
+        Print("Scratch buffer allocation failed!\n");
 
         return -6;
     }
 
-    void *OutBuffer = malloc(fOutSize);
+    // Turn junk away before it costs an output-sized allocation and a full decode
+    if (UefiDecompressCheck(Buffer, fInSize, Ctx->Scratch)) {
+        Print("Not a valid compressed EFI stream!\n");
+
+        return -11;
+    }
+
+    return 0;
+}
+
+int DecodeEfiStream(EXTRACT_CONTEXT *Ctx, const uint8_t *Rom, uint32_t RomSize, const EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats) {
+    const uint8_t *Buffer = Rom + RomInfo->RomOffset;
+    uint32_t fInSize = RomSize - RomInfo->RomOffset;
+    uint32_t fOutSize = RomInfo->OrigSize;
 
-    if (OutBuffer == NULL) {
-        printf("Output buffer buffer allocation failed!\n");
-        free(Buffer);
-        free(ScratchBuffer);
+    PhaseBegin(Stats, EXTRACT_PHASE_SCRATCH);
 
+    if (ExtractContextReserve(Ctx, fOutSize)) {
         return -7;
     }
 
-    if (UefiDecompress(Buffer, OutBuffer, ScratchBuffer)) {
-        printf("UEFI decompression failed!\n");
-        free(Buffer);
-        free(OutBuffer);
-        free(ScratchBuffer);
+    PhaseBegin(Stats, EXTRACT_PHASE_DECODE);
+
+    if (UefiDecompressEx(Buffer, fInSize, Ctx->OutBuffer, Ctx->OutCapacity, Ctx->Scratch, Ctx->DecompressFlags)) {
+        Print("UEFI decompression failed!\n");
 
         return -8;
     }
 
-    FILE *fOut = fopen(argv[2], "wb");
-    fwrite(OutBuffer, fOutSize, 1, fOut);
-    fclose(fOut);
+    return 0;
+}
 
-    free(Buffer);
-    free(OutBuffer);
-    free(ScratchBuffer);
+int ExtractEfiImageFromBuffer(EXTRACT_CONTEXT *Ctx, const uint8_t *Rom, uint32_t RomSize, EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats) {
+    ExtractStatsInit(Stats);
+
+    int Status = LocateEfiStream(Ctx, Rom, RomSize, RomInfo, Stats);
+
+    if (Status == 0) {
+        Status = DecodeEfiStream(Ctx, Rom, RomSize, RomInfo, Stats);
+    }
+
+    // Failures leave their phase open, account it all the same
+    PhaseEnd(Stats);
+
+    return Status;
+}
+
+int ExtractEfiImage(const char *InFile, uint32_t DecompressFlags, EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats, uint8_t **OutBuffer, uint32_t *OutSize) {
+    EXTRACT_CONTEXT Ctx;
+    uint8_t *Buffer;
+    uint32_t BufferSize;
+    struct timespec LoadStart;
+    struct timespec LoadStartCpu;
+    struct timespec LoadEnd;
+    struct timespec LoadEndCpu;
+
+    memset(RomInfo, 0, sizeof (*RomInfo));
+    memset(Stats, 0, sizeof (*Stats));
+    Stats->mPhase = EXTRACT_PHASE_NONE;
+    *OutBuffer = NULL;
+    *OutSize = 0;
+
+    // Reading the input counts towards the parse phase
+    ProfileSwitch(PROFILE_PHASE_PARSE);
+    clock_gettime(CLOCK_MONOTONIC, &LoadStart);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &LoadStartCpu);
+
+    int Status = LoadInputFile(InFile, &Buffer, &BufferSize);
+
+    clock_gettime(CLOCK_MONOTONIC, &LoadEnd);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &LoadEndCpu);
+
+    if (Status == 0) {
+        if (ExtractContextInit(&Ctx) != 0) {
+            Print("Scratch buffer allocation failed!\n");
+            free(Buffer);
+            Status = -6;
+        } else {
+            Ctx.DecompressFlags = DecompressFlags;
+            Status = ExtractEfiImageFromBuffer(&Ctx, Buffer, BufferSize, RomInfo, Stats);
+
+            if (Status == 0) {
+                // Hand the output buffer over to the caller
+                *OutBuffer = Ctx.OutBuffer;
+                *OutSize = RomInfo->OrigSize;
+                Ctx.OutBuffer = NULL;
+            }
+
+            ExtractContextFree(&Ctx);
+            free(Buffer);
+        }
+    }
+
+    Stats->WallNs[EXTRACT_PHASE_PARSE] += ElapsedNs(&LoadStart, &LoadEnd);
+    Stats->CpuNs[EXTRACT_PHASE_PARSE] += ElapsedNs(&LoadStartCpu, &LoadEndCpu);
+
+    return Status;
+}
+
+/**
+ Extract every input and append the images to one archive stream.
+
+ @param  ArchivePath Path of the archive to create, - for stdout.
+ @param  DecompressFlags Flags for UefiDecompressEx().
+ @param  Streams     Inputs decoded together with UefiDecompressInterleaved(),
+                     1 to decode them one at a time.
+ @param  Report      The report to add a record per input to, or NULL.
+ @param  InFiles     The input files.
+ @param  InCount     The number of input files.
+
+ @retval  0 Every input was extracted and archived.
+ @retval  <0 The archive could not be written, or the code of the last failed input.
+ **/
+int ExtractToArchive(const char *ArchivePath, uint32_t DecompressFlags, int Streams, EXTRACT_REPORT *Report,
+                     const char *const *InFiles, int InCount) {
+    ROM_ARCHIVE Archive;
+    EXTRACT_CONTEXT Ctx[INTERLEAVE_MAX_STREAMS];
+    BUFFER_ARENA Arena;
+    int Contexts = 0;
+    int Status = 0;
+
+    if (ArchiveOpen(&Archive, ArchivePath)) {
+        Print("Error opening archive %s!\n", ArchivePath);
+
+        return -9;
+    }
+
+    // One warm context per stream for the whole batch, output buffers recycled through the arena as they grow
+    ArenaInit(&Arena, gArenaFlags);
+
+    while (Contexts < Streams && ExtractContextInit(&Ctx[Contexts]) == 0) {
+        Ctx[Contexts].Arena = &Arena;
+        Ctx[Contexts].DecompressFlags = DecompressFlags;
+        Contexts++;
+    }
+
+    if (Contexts < Streams) {
+        Print("Scratch buffer allocation failed!\n");
+        Status = -6;
+    }
+
+    for (int First = 0; Status != -6 && Status != -9 && First < InCount; First += Streams) {
+        INTERLEAVE_STREAM Interleave[INTERLEAVE_MAX_STREAMS];
+        EFI_ROM_INFO RomInfo[INTERLEAVE_MAX_STREAMS];
+        EXTRACT_STATS Stats[INTERLEAVE_MAX_STREAMS];
+        uint8_t *Rom[INTERLEAVE_MAX_STREAMS];
+        uint32_t RomSize[INTERLEAVE_MAX_STREAMS];
+        int Result[INTERLEAVE_MAX_STREAMS];
+        int Batch = InCount - First < Streams ? InCount - First : Streams;
+        uint32_t Ready = 0;
+
+        for (int Slot = 0; Slot < Batch; Slot++) {
+            memset(&RomInfo[Slot], 0, sizeof (RomInfo[Slot]));
+            ExtractStatsInit(&Stats[Slot]);
+            PhaseBegin(&Stats[Slot], EXTRACT_PHASE_PARSE);
+            Rom[Slot] = NULL;
+
+            Result[Slot] = LoadInputFile(InFiles[First + Slot], &Rom[Slot], &RomSize[Slot]);
+
+            if (Result[Slot] == 0) {
+                Result[Slot] = LocateEfiStream(&Ctx[Slot], Rom[Slot], RomSize[Slot], &RomInfo[Slot], &Stats[Slot]);
+            }
+
+            if (Result[Slot] == 0 && Streams == 1) {
+                Result[Slot] = DecodeEfiStream(&Ctx[Slot], Rom[Slot], RomSize[Slot], &RomInfo[Slot], &Stats[Slot]);
+            } else if (Result[Slot] == 0) {
+                PhaseBegin(&Stats[Slot], EXTRACT_PHASE_SCRATCH);
+                Result[Slot] = ExtractContextReserve(&Ctx[Slot], RomInfo[Slot].OrigSize);
+            }
+
+            if (Result[Slot] == 0 && Streams > 1) {
+                Interleave[Ready].Source = Rom[Slot] + RomInfo[Slot].RomOffset;
+                Interleave[Ready].SourceSize = RomSize[Slot] - RomInfo[Slot].RomOffset;
+                Interleave[Ready].Destination = Ctx[Slot].OutBuffer;
+                Interleave[Ready].DestinationSize = Ctx[Slot].OutCapacity;
+                Interleave[Ready].Scratch = Ctx[Slot].Scratch;
+                Ready++;
+            }
+        }
+
+        // Every stream of the batch is charged the time of decoding the whole batch
+        if (Ready != 0) {
+            for (int Slot = 0; Slot < Batch; Slot++) {
+                if (Result[Slot] == 0) {
+                    PhaseBegin(&Stats[Slot], EXTRACT_PHASE_DECODE);
+                }
+            }
+
+            UefiDecompressInterleaved(Interleave, Ready);
+
+            for (int Slot = 0, Stream = 0; Slot < Batch; Slot++) {
+                if (Result[Slot] == 0 && Interleave[Stream++].Status != RETURN_SUCCESS) {
+                    Print("UEFI decompression of %s failed!\n", InFiles[First + Slot]);
+                    Result[Slot] = -8;
+                }
+            }
+        }
+
+        for (int Slot = 0; Slot < Batch; Slot++) {
+            const char *InFile = InFiles[First + Slot];
+
+            free(Rom[Slot]);
+
+            if (Result[Slot] != 0) {
+                PhaseEnd(&Stats[Slot]);
+                Print("Skipping %s (error %d)\n", InFile, Result[Slot]);
+                ReportImage(Report, InFile, &RomInfo[Slot], &Stats[Slot], Result[Slot]);
+                ProfileImage(InFile);
+
+                if (Status != -9) {
+                    Status = Result[Slot];
+                }
+                continue;
+            }
+
+            // After a failed write the archive is unusable, only report what is left
+            if (Status != -9) {
+                PhaseBegin(&Stats[Slot], EXTRACT_PHASE_WRITE);
+                Result[Slot] = ArchiveAddImage(&Archive, InFile, &RomInfo[Slot], Ctx[Slot].OutBuffer, RomInfo[Slot].OrigSize) ? -9 : 0;
+            } else {
+                Result[Slot] = -9;
+            }
+
+            PhaseEnd(&Stats[Slot]);
+
+            ReportImage(Report, InFile, &RomInfo[Slot], &Stats[Slot], Result[Slot]);
+            ProfileImage(InFile);
+
+            if (Result[Slot] != 0 && Status != -9) {
+                Print("Failed to write %s to archive %s!\n", InFile, ArchivePath);
+                Status = Result[Slot];
+            }
+        }
+    }
+
+    for (int Index = 0; Index < Contexts; Index++) {
+        ExtractContextFree(&Ctx[Index]);
+    }
+
+    ArenaDestroy(&Arena);
+
+    if (ArchiveClose(&Archive) && Status != -9) {
+        Print("Failed to finish archive %s!\n", ArchivePath);
+
+        return -9;
+    }
+
+    return Status;
+}
+
+int WriteOutputFile(const char *OutFile, const uint8_t *Data, uint32_t Size) {
+    if (strcmp(OutFile, "-") == 0) {
+        if (fwrite(Data, Size, 1, stdout) != 1 || fflush(stdout) != 0) {
+            Print("Failed to write image to stdout!\n");
+            return -9;
+        }
+
+        return 0;
+    }
+
+    FILE *fOut = fopen(OutFile, "wb");
+
+    if (fOut == NULL) {
+        Print("Error opening output file %s!\n", OutFile);
+        return -9;
+    }
+
+    if (fwrite(Data, Size, 1, fOut) != 1) {
+        Print("Failed to write output file %s!\n", OutFile);
+        fclose(fOut);
+        return -9;
+    }
+
+    if (fclose(fOut) != 0) {
+        Print("Failed to write output file %s!\n", OutFile);
+        return -9;
+    }
 
     return 0;
 }
+
+// Write all of Data to Fd from offset 0, for when the output cannot be mapped
+static int WriteAllAt(int Fd, const uint8_t *Data, uint32_t Size) {
+    for (uint32_t Done = 0; Done < Size;) {
+        ssize_t Put = pwrite(Fd, Data + Done, Size - Done, Done);
+
+        if (Put < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (Put <= 0) {
+            return -1;
+        }
+
+        Done += (uint32_t) Put;
+    }
+
+    return 0;
+}
+
+/**
+ Extract one input straight into a shared mapping of a temporary file next
+ to OutFile, pre-sized to OrigSize, and rename it over OutFile once the
+ image is complete. A failed extraction leaves OutFile untouched. Where the
+ file cannot be mapped the image is decoded into a buffer and written.
+
+ @retval  0 OK.
+ @retval  <0 The exit code main() reports for the failure.
+ **/
+static int ExtractToMappedFile(const char *InFile, const char *OutFile, uint32_t DecompressFlags, EXTRACT_REPORT *Report) {
+    EXTRACT_CONTEXT Ctx;
+    EFI_ROM_INFO RomInfo;
+    EXTRACT_STATS Stats;
+    uint8_t *Rom = NULL;
+    uint32_t RomSize;
+    char TempPath[4096];
+    int Fd = -1;
+    uint8_t *Map = MAP_FAILED;
+    int HaveContext = 0;
+
+    memset(&RomInfo, 0, sizeof (RomInfo));
+    ExtractStatsInit(&Stats);
+    PhaseBegin(&Stats, EXTRACT_PHASE_PARSE);
+
+    int Status = LoadInputFile(InFile, &Rom, &RomSize);
+
+    if (Status == 0) {
+        HaveContext = ExtractContextInit(&Ctx) == 0;
+
+        if (!HaveContext) {
+            Print("Scratch buffer allocation failed!\n");
+            Status = -6;
+        }
+    }
+
+    if (Status == 0) {
+        Ctx.DecompressFlags = DecompressFlags;
+        Status = LocateEfiStream(&Ctx, Rom, RomSize, &RomInfo, &Stats);
+    }
+
+    if (Status == 0) {
+        PhaseBegin(&Stats, EXTRACT_PHASE_SCRATCH);
+
+        mode_t Mask = umask(0);
+        umask(Mask);
+
+        snprintf(TempPath, sizeof (TempPath), "%s.XXXXXX", OutFile);
+        Fd = mkstemp(TempPath);
+
+        if (Fd < 0) {
+            Print("Error creating output file %s: %s\n", OutFile, strerror(errno));
+            Status = -9;
+        } else {
+            // Reserve the blocks now: running out of space under a mapping is SIGBUS, not an error
+            int Reserved = posix_fallocate(Fd, 0, RomInfo.OrigSize);
+
+            if (Reserved == EOPNOTSUPP || Reserved == EINVAL) {
+                Reserved = ftruncate(Fd, RomInfo.OrigSize) == 0 ? 0 : errno;
+            }
+
+            if (Reserved == 0 && fchmod(Fd, 0666 & ~Mask) != 0) {
+                Reserved = errno;
+            }
+
+            if (Reserved != 0) {
+                Print("Error creating output file %s: %s\n", OutFile, strerror(Reserved));
+                Status = -9;
+            } else {
+                Map = mmap(NULL, RomInfo.OrigSize, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+            }
+        }
+    }
+
+    if (Status == 0) {
+        // Lend the mapping to the context so the decoder writes straight into the file
+        if (Map != MAP_FAILED) {
+            Ctx.OutBuffer = Map;
+            Ctx.OutCapacity = RomInfo.OrigSize;
+        }
+
+        Status = DecodeEfiStream(&Ctx, Rom, RomSize, &RomInfo, &Stats);
+
+        PhaseBegin(&Stats, EXTRACT_PHASE_WRITE);
+
+        if (Map != MAP_FAILED) {
+            Ctx.OutBuffer = NULL;
+            Ctx.OutCapacity = 0;
+
+            if (munmap(Map, RomInfo.OrigSize) != 0 && Status == 0) {
+                Print("Failed to write output file %s!\n", OutFile);
+                Status = -9;
+            }
+        } else if (Status == 0 && WriteAllAt(Fd, Ctx.OutBuffer, RomInfo.OrigSize) != 0) {
+            Print("Failed to write output file %s!\n", OutFile);
+            Status = -9;
+        }
+    }
+
+    if (Fd >= 0) {
+        if (close(Fd) != 0 && Status == 0) {
+            Print("Failed to write output file %s!\n", OutFile);
+            Status = -9;
+        }
+
+        if (Status == 0 && rename(TempPath, OutFile) != 0) {
+            Print("Failed to rename %s to %s: %s\n", TempPath, OutFile, strerror(errno));
+            Status = -9;
+        }
+
+        if (Status != 0) {
+            unlink(TempPath);
+        }
+    }
+
+    PhaseEnd(&Stats);
+
+    if (HaveContext) {
+        ExtractContextFree(&Ctx);
+    }
+
+    free(Rom);
+
+    ReportImage(Report, InFile, &RomInfo, &Stats, Status);
+    ProfileImage(InFile);
+
+    return Status;
+}
+
+/**
+ Extract one input to one output file.
+
+ @param  InFile  The input file.
+ @param  OutFile The file to write the image to.
+ @param  DecompressFlags Flags for UefiDecompressEx().
+ @param  Report  The report to add a record to, or NULL.
+
+ @retval  0 OK.
+ @retval  <0 The exit code main() reports for the failure.
+ **/
+int ExtractToFile(const char *InFile, const char *OutFile, uint32_t DecompressFlags, EXTRACT_REPORT *Report) {
+    EFI_ROM_INFO RomInfo;
+    EXTRACT_STATS Stats;
+    uint8_t *OutBuffer;
+    uint32_t fOutSize;
+    struct stat St;
+
+    // Files are decoded in place; stdout, devices, pipes and symlinks are written through
+    if (strcmp(OutFile, "-") != 0 && (lstat(OutFile, &St) != 0 || S_ISREG(St.st_mode))) {
+        return ExtractToMappedFile(InFile, OutFile, DecompressFlags, Report);
+    }
+
+    int Status = ExtractEfiImage(InFile, DecompressFlags, &RomInfo, &Stats, &OutBuffer, &fOutSize);
+
+    if (Status != 0) {
+        ReportImage(Report, InFile, &RomInfo, &Stats, Status);
+        ProfileImage(InFile);
+        return Status;
+    }
+
+    PhaseBegin(&Stats, EXTRACT_PHASE_WRITE);
+    Status = WriteOutputFile(OutFile, OutBuffer, fOutSize);
+    PhaseEnd(&Stats);
+
+    ReportImage(Report, InFile, &RomInfo, &Stats, Status);
+    ProfileImage(InFile);
+    free(OutBuffer);
+
+    return Status;
+}
+
+/**
+ Have a running server extract one input to one output file.
+
+ @param  SocketPath The server socket.
+ @param  InFile     The input file.
+ @param  OutFile    The file to write the image to.
+ @param  Flags      SERVER_REQUEST_* flags for the request.
+
+ @retval  0 OK.
+ @retval  <0 The exit code the server reported, or -10 if it could not be reached.
+ **/
+int ExtractViaServer(const char *SocketPath, const char *InFile, const char *OutFile, uint32_t Flags) {
+    SERVER_RESPONSE Response;
+
+    int Sock = ClientConnect(SocketPath);
+
+    if (Sock < 0) {
+        Print("Failed to connect to %s!\n", SocketPath);
+        return -10;
+    }
+
+    // Pipes are passed on as they are, the server streams from and to them
+    int InFd = strcmp(InFile, "-") == 0 ? dup(STDIN_FILENO) : open(InFile, O_RDONLY | O_CLOEXEC);
+
+    if (InFd < 0) {
+        Print("Error opening file %s!\n", InFile);
+        close(Sock);
+        return -1;
+    }
+
+    int OutFd = strcmp(OutFile, "-") == 0 ? dup(STDOUT_FILENO) : open(OutFile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (OutFd < 0) {
+        Print("Error opening output file %s!\n", OutFile);
+        close(InFd);
+        close(Sock);
+        return -9;
+    }
+
+    int Status = ClientRequest(Sock, InFd, OutFd, Flags, &Response) ? -10 : Response.Result;
+
+    if (Status == 0) {
+        Print("Found compressed EFI ROM start at 0x%x\n", Response.RomOffset);
+        Print("Output size: %u, decoded in %llu ns\n", Response.OrigSize, (unsigned long long) Response.DecodeNs);
+    } else {
+        Print("Server extraction failed (error %d)!\n", Status);
+    }
+
+    close(OutFd);
+    close(InFd);
+    close(Sock);
+
+    return Status;
+}
+
+// A byte count with an optional K, M or G suffix, 0 if malformed
+static uint64_t ParseSize(const char *Text) {
+    char *End;
+    unsigned long long Size = strtoull(Text, &End, 10);
+
+    switch (*End) {
+        case 'G':
+        case 'g':
+            Size <<= 10;
+            /* fall through */
+        case 'M':
+        case 'm':
+            Size <<= 10;
+            /* fall through */
+        case 'K':
+        case 'k':
+            Size <<= 10;
+            End++;
+            break;
+        default:
+            break;
+    }
+
+    return End != Text && *End == 0 ? (uint64_t) Size : 0;
+}
+
+// Long options without a short form
+#define OPTION_HUGE_PAGES 0x100
+#define OPTION_SHARD      0x101
+#define OPTION_MERGE      0x102
+
+static const struct option mLongOptions[] = {
+    { "profile", no_argument, NULL, 'p' },
+    { "huge-pages", optional_argument, NULL, OPTION_HUGE_PAGES },
+    { "shard", required_argument, NULL, OPTION_SHARD },
+    { "merge", required_argument, NULL, OPTION_MERGE },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[]) {
+    const char *ArchivePath = NULL;
+    const char *ReportPath = NULL;
+    const char *ServerPath = NULL;
+    const char *ClientPath = NULL;
+    const char *DedupeDir = NULL;
+    const char *VolumeDir = NULL;
+    const char *SpoolDir = NULL;
+    const char *MergeDir = NULL;
+    const char **InFiles;
+    int InCount;
+    SHARD Shard = { 0, 0 };
+    char ManifestName[64];
+    int Workers = 0;
+    int LoadCount = 0;
+    int BenchCount = 0;
+    int ListOnly = 0;
+    int Incremental = 0;
+    int Streams = 1;
+    uint64_t MemoryLimit = 0;
+    uint32_t DecompressFlags = 0;
+    EXTRACT_REPORT Report;
+    PROFILE Profile;
+    int Option;
+    int Status;
+
+    gStatusOut = stdout;
+
+    while ((Option = getopt_long(argc, argv, "a:r:S:C:w:L:HB:D:PpliF:I:W:M:", mLongOptions, NULL)) != -1) {
+        switch (Option) {
+            case 'a':
+                ArchivePath = optarg;
+                break;
+            case 'r':
+                ReportPath = optarg;
+                break;
+            case 'S':
+                ServerPath = optarg;
+                break;
+            case 'C':
+                ClientPath = optarg;
+                break;
+            case 'w':
+                Workers = atoi(optarg);
+                break;
+            case 'L':
+                LoadCount = atoi(optarg);
+                break;
+            case 'H':
+                DecompressFlags |= DECOMPRESS_HARDENED;
+                break;
+            case 'P':
+                DecompressFlags |= DECOMPRESS_PIPELINED;
+                break;
+            case 'p':
+                DecompressFlags |= DECOMPRESS_PROFILED;
+                break;
+            case 'l':
+                ListOnly = 1;
+                break;
+            case 'i':
+                Incremental = 1;
+                break;
+            case 'F':
+                VolumeDir = optarg;
+                break;
+            case 'B':
+                BenchCount = atoi(optarg);
+                break;
+            case 'D':
+                DedupeDir = optarg;
+                break;
+            case 'I':
+                Streams = atoi(optarg);
+                break;
+            case 'W':
+                SpoolDir = optarg;
+                break;
+            case 'M':
+                if ((MemoryLimit = ParseSize(optarg)) == 0) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPTION_SHARD:
+                if (ShardParse(optarg, &Shard)) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPTION_MERGE:
+                MergeDir = optarg;
+                break;
+            case OPTION_HUGE_PAGES:
+                if (optarg == NULL || strcmp(optarg, "transparent") == 0) {
+                    gArenaFlags = ARENA_HUGE_TRANSPARENT;
+                } else if (strcmp(optarg, "explicit") == 0) {
+                    gArenaFlags = ARENA_HUGE_EXPLICIT;
+                } else {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (ServerPath != NULL ? optind != argc :
+        (BenchCount > 0 || SpoolDir != NULL) ? argc - optind != 1 :
+        (ArchivePath != NULL || DedupeDir != NULL || VolumeDir != NULL || MergeDir != NULL || ListOnly) ? optind >= argc : argc - optind != 2) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    if (LoadCount < 0 || (ClientPath != NULL && (ArchivePath != NULL || ServerPath != NULL)) ||
+        (DedupeDir != NULL && ArchivePath != NULL) || (Incremental && DedupeDir == NULL) ||
+        (Streams != 1 && (Streams < INTERLEAVE_MIN_STREAMS || Streams > INTERLEAVE_MAX_STREAMS || ArchivePath == NULL ||
+                          (DecompressFlags & (DECOMPRESS_PIPELINED | DECOMPRESS_PROFILED)) != 0)) ||
+        (MemoryLimit != 0 && ServerPath == NULL && SpoolDir == NULL && VolumeDir == NULL) ||
+        (Shard.Count != 0 && ArchivePath == NULL && DedupeDir == NULL && VolumeDir == NULL) ||
+        (MergeDir != NULL && (ArchivePath != NULL || DedupeDir != NULL || VolumeDir != NULL || ServerPath != NULL ||
+                              ClientPath != NULL || SpoolDir != NULL || ReportPath != NULL || BenchCount > 0 || ListOnly)) ||
+        (SpoolDir != NULL && (ServerPath != NULL || ClientPath != NULL || ArchivePath != NULL || DedupeDir != NULL || VolumeDir != NULL)) ||
+        ((DecompressFlags & DECOMPRESS_PROFILED) != 0 &&
+         (ServerPath != NULL || ClientPath != NULL || LoadCount > 0 || BenchCount > 0 || SpoolDir != NULL ||
+          VolumeDir != NULL))) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    // The report and the extracted data cannot share stdout
+    if (ReportPath != NULL && strcmp(ReportPath, "-") == 0 &&
+        ((ArchivePath != NULL && strcmp(ArchivePath, "-") == 0) ||
+         (ArchivePath == NULL && DedupeDir == NULL && VolumeDir == NULL && ServerPath == NULL && SpoolDir == NULL &&
+          MergeDir == NULL && BenchCount == 0 && !ListOnly && strcmp(argv[argc - 1], "-") == 0))) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    // Keep stdout clean for whichever stream was sent there
+    if (ListOnly || (ArchivePath != NULL && strcmp(ArchivePath, "-") == 0) ||
+        (ReportPath != NULL && strcmp(ReportPath, "-") == 0) ||
+        (ArchivePath == NULL && DedupeDir == NULL && VolumeDir == NULL && ServerPath == NULL && SpoolDir == NULL &&
+         strcmp(argv[argc - 1], "-") == 0)) {
+        gStatusOut = stderr;
+    }
+
+    if (ReportPath != NULL && ReportOpen(&Report, ReportPath)) {
+        Print("Error opening report %s!\n", ReportPath);
+        return -9;
+    }
+
+    // Counters are opened for this thread, which does every extraction of the remaining modes
+    if ((DecompressFlags & DECOMPRESS_PROFILED) != 0 && ProfileOpen(&Profile)) {
+        Print("Profile buffer allocation failed!\n");
+        return -6;
+    }
+
+    InFiles = (const char **) argv + optind;
+    InCount = argc - optind;
+
+    // Every shard sees the whole list and keeps its part of it
+    if (Shard.Count != 0 && (Status = ShardSelect(&Shard, (const char *const *) argv + optind, argc - optind,
+                                                  &InFiles, &InCount)) != 0) {
+        return Status;
+    }
+
+    if (Shard.Count != 0) {
+        ShardManifestName(&Shard, ManifestName, sizeof (ManifestName));
+    } else {
+        snprintf(ManifestName, sizeof (ManifestName), "%s", DEDUPE_MANIFEST);
+    }
+
+    // -H with -C asks the server to harden these requests
+    uint32_t RequestFlags = (DecompressFlags & DECOMPRESS_HARDENED) != 0 ? SERVER_REQUEST_HARDENED : 0;
+
+    if (ListOnly) {
+        Status = ListRomImages((const char *const *) argv + optind, argc - optind);
+    } else if (BenchCount > 0) {
+        Status = BenchDecode(argv[optind], BenchCount);
+    } else if (SpoolDir != NULL) {
+        Status = WatchSpool(SpoolDir, argv[optind], Workers, DecompressFlags, MemoryLimit, ReportPath != NULL ? &Report : NULL);
+    } else if (ServerPath != NULL) {
+        Status = ServerRun(ServerPath, Workers, DecompressFlags, MemoryLimit, ReportPath != NULL ? &Report : NULL);
+    } else if (LoadCount > 0) {
+        Status = LoadTest(ClientPath, "/proc/self/exe", argv[optind], argv[optind + 1], LoadCount, RequestFlags);
+    } else if (ClientPath != NULL) {
+        Status = ExtractViaServer(ClientPath, argv[optind], argv[optind + 1], RequestFlags);
+    } else if (MergeDir != NULL) {
+        Status = MergeShards(MergeDir, (const char *const *) argv + optind, argc - optind);
+    } else if (VolumeDir != NULL) {
+        Status = ExtractFirmwareVolumes(VolumeDir, Workers, DecompressFlags, MemoryLimit, InFiles, InCount);
+    } else if (DedupeDir != NULL) {
+        Status = ExtractDeduplicated(DedupeDir, ManifestName, DecompressFlags, Incremental, ReportPath != NULL ? &Report : NULL,
+                                     InFiles, InCount);
+    } else if (ArchivePath != NULL) {
+        Status = ExtractToArchive(ArchivePath, DecompressFlags, Streams, ReportPath != NULL ? &Report : NULL, InFiles, InCount);
+    } else {
+        Status = ExtractToFile(argv[optind], argv[optind + 1], DecompressFlags, ReportPath != NULL ? &Report : NULL);
+    }
+
+    if ((DecompressFlags & DECOMPRESS_PROFILED) != 0) {
+        ProfileClose(&Profile);
+    }
+
+    if (Shard.Count != 0) {
+        free(InFiles);
+    }
+
+    if (ReportPath != NULL) {
+        ReportClose(&Report);
+    }
+
+    return Status;
+}
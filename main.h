@@ -12,7 +12,10 @@
 #define UEFIRomExtract_ma_h
 
 #include <stdint.h>
+#include <stdio.h>
+#include <time.h>
 #include <assert.h>
+#include "arena.h"
 
 #define MAX_ADDRESS   0xFFFFFFFFFFFFFFFFULL
 
@@ -25,6 +28,24 @@ typedef uint32_t RETURN_STATUS;
 
 #define  BIT8     0x00000100
 
+//
+// UefiDecompressEx() flags
+//
+#define DECOMPRESS_HARDENED  0x00000001  // Validate tables, input bounds and back references
+#define DECOMPRESS_PIPELINED 0x00000002  // Copy matches on a second thread, see DecodePipelined()
+#define DECOMPRESS_PROFILED  0x00000004  // Count each decoding pass separately, see DecodeProfiled()
+
+//
+// Most a stream can expand to. A set with a single code costs no bits per
+// symbol, so a block of 256 byte matches at distance 1, as the compressor
+// emits for long runs of padding, is all header: a 16-bit symbol count and
+// three single-code sets of 2 * TBIT, 2 * CBIT and at least 2 * 4 bits.
+// Every PLAUSIBLE_BLOCK_BITS of stream can thus yield at most
+// PLAUSIBLE_BLOCK_OUTPUT bytes; headers claiming more cannot be genuine.
+//
+#define PLAUSIBLE_BLOCK_BITS   (16 + 2 * TBIT + 2 * CBIT + 2 * 4)
+#define PLAUSIBLE_BLOCK_OUTPUT (0xFFFFULL * MAXMATCH)
+
 //
 // Decompression algorithm begs here
 //
@@ -75,6 +96,10 @@ typedef struct {
     // The length of the field 'Position Set Code Length Array Size' in Block Header.
     // For UEFI 2.0 de/compression algorithm, mPBit = 4.
     uint8_t mPBit;
+
+    // Set for DECOMPRESS_HARDENED: table building rejects inconsistent code
+    // lengths and DecodeHardened() replaces Decode().
+    uint8_t mHardened;
 } SCRATCH_DATA;
 
 typedef struct {
@@ -131,9 +156,198 @@ typedef struct {
 #define EFI_PCI_EXPANSION_ROM_HEADER_COMPRESSED 0x0001
 #define INDICATOR_LAST  0x80
 
+//
+// Where a compressed EFI image was found in the input and who it belongs to.
+//
+typedef struct {
+    uint32_t RomOffset;      // Offset of the compressed EFI image in the input, 0 if raw
+    uint32_t ImageStart;     // Offset of the option ROM image containing it
+    uint16_t VendorId;
+    uint16_t DeviceId;
+    uint16_t EfiSubsystem;
+    uint16_t EfiMachineType;
+    uint16_t CompressionType;
+    uint32_t CompSize;       // From the compressed stream header
+    uint32_t OrigSize;
+} EFI_ROM_INFO;
+
+//
+// Phases of one extraction, timed separately for the report.
+//
+typedef enum {
+    EXTRACT_PHASE_PARSE,     // Reading the input, walking the ROM, reading the stream header
+    EXTRACT_PHASE_SCRATCH,   // Allocating scratch and output buffers
+    EXTRACT_PHASE_DECODE,    // UefiDecompress
+    EXTRACT_PHASE_WRITE,     // Writing the image out
+    EXTRACT_PHASE_COUNT,
+    EXTRACT_PHASE_NONE = EXTRACT_PHASE_COUNT
+} EXTRACT_PHASE;
+
+typedef struct {
+    uint64_t WallNs[EXTRACT_PHASE_COUNT];
+    uint64_t CpuNs[EXTRACT_PHASE_COUNT];
+    uint64_t InputSize;
+
+    EXTRACT_PHASE mPhase;    // The phase being timed, EXTRACT_PHASE_NONE if none
+    struct timespec mWallStart;
+    struct timespec mCpuStart;
+} EXTRACT_STATS;
+
+/**
+ Close the phase being timed, if any, and start timing Phase.
+
+ @param  Stats The statistics of the current extraction.
+ @param  Phase The phase to time, EXTRACT_PHASE_NONE to only stop timing.
+ **/
+void PhaseBegin(EXTRACT_STATS *Stats, EXTRACT_PHASE Phase);
+
+void PhaseEnd(EXTRACT_STATS *Stats);
+
+void ExtractStatsInit(EXTRACT_STATS *Stats);
+
+//
+// Stream status messages go to; stderr whenever stdout carries image data,
+// NULL to silence them.
+//
+extern FILE *gStatusOut;
+
+void Print(const char *Format, ...);
+
 void Usage(const char *appname);
 
-uint8_t GetEfiCompressedROM(const char *InFile, uint8_t Pci23, uint32_t *EFIIMGStart);
+/**
+ Walk the option ROM images in memory looking for the EFI image.
+
+ @param  Rom      The ROM contents.
+ @param  RomSize  The size of the ROM.
+ @param  Pci23    1 to read PCI 2.3 data structures, 0 for PCI 3.0.
+ @param  RomInfo  Receives where the EFI image is and its PCI identity.
+
+ @retval  0 No EFI image was found.
+ @retval  1 A compressed EFI image was found.
+ @retval  2 An uncompressed EFI image was found, there is nothing to extract.
+ **/
+uint8_t GetEfiCompressedROM(const uint8_t *Rom, uint32_t RomSize, uint8_t Pci23, EFI_ROM_INFO *RomInfo);
+
+uint64_t ElapsedNs(const struct timespec *Start, const struct timespec *End);
+
+//
+// Buffers one extraction needs. A long-lived context keeps them warm
+// between images; the output buffer only ever grows.
+//
+typedef struct {
+    SCRATCH_DATA *Scratch;
+    uint8_t *OutBuffer;
+    uint32_t OutCapacity;
+    uint32_t DecompressFlags;  // Passed to UefiDecompressEx()
+    BUFFER_ARENA *Arena;       // Where the output buffer comes from, NULL for malloc
+    uint64_t mOutArenaSize;    // Capacity of an arena output buffer, 0 if malloc'd
+    uint64_t mBudgetHeld;      // Bytes of output buffer charged to a MEMORY_BUDGET
+    uint64_t mBudgetInput;     // Bytes of input buffer charged to a MEMORY_BUDGET
+} EXTRACT_CONTEXT;
+
+int ExtractContextInit(EXTRACT_CONTEXT *Ctx);
+
+void ExtractContextFree(EXTRACT_CONTEXT *Ctx);
+
+/**
+ Give the output buffer back to the arena or free it, leaving the context
+ without one.
+ **/
+void ExtractContextDropOutput(EXTRACT_CONTEXT *Ctx);
+
+/**
+ Make sure the output buffer holds at least Size bytes.
+
+ @retval  0 OK.
+ @retval  -7 The buffer could not be allocated.
+ **/
+int ExtractContextReserve(EXTRACT_CONTEXT *Ctx, uint32_t Size);
+
+/**
+ Read a whole input file into a malloc'd buffer.
+
+ @param  InFile The file to read.
+ @param  Buffer Receives the contents; the caller frees it.
+ @param  Size   Receives the size of the contents.
+
+ @retval  0 OK.
+ @retval  -1 The file could not be read.
+ **/
+int LoadInputFile(const char *InFile, uint8_t **Buffer, uint32_t *Size);
+
+/**
+ Read everything from a descriptor into a reusable buffer that grows as needed.
+ Seekable descriptors are read from offset 0 without moving their offset.
+
+ @param  Fd       The descriptor to read.
+ @param  Buffer   The buffer, may point to NULL; reallocated when too small.
+ @param  Capacity The allocated size of Buffer, updated when it grows.
+ @param  Size     Receives the number of bytes read.
+
+ @retval  0 OK.
+ @retval  -1 Read error or allocation failure.
+ **/
+int LoadInputFd(int Fd, uint8_t **Buffer, uint32_t *Capacity, uint32_t *Size);
+
+/**
+ Locate the compressed EFI image of an in-memory ROM and decompress it
+ into the context's output buffer.
+
+ @param  Ctx     The context whose buffers are used.
+ @param  Rom     The option ROM or raw compressed stream.
+ @param  RomSize The size of Rom.
+ @param  RomInfo Receives where the image was found, its PCI identity and
+                 OrigSize, the number of bytes decoded into Ctx->OutBuffer.
+ @param  Stats   Receives the input size and the time spent in each phase.
+
+ @retval  0 The image was extracted.
+ @retval  <0 The exit code main() reports for the failure.
+ **/
+int ExtractEfiImageFromBuffer(EXTRACT_CONTEXT *Ctx, const uint8_t *Rom, uint32_t RomSize, EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats);
+
+/**
+ First half of ExtractEfiImageFromBuffer(): walk the ROM, read the stream
+ header and check the stream is plausible. Nothing output-sized is allocated.
+ The compressed stream is the CompSize + 8 bytes at RomInfo->RomOffset.
+
+ @retval  0 RomInfo describes a plausible compressed stream.
+ @retval  <0 The exit code main() reports for the failure.
+ **/
+int LocateEfiStream(EXTRACT_CONTEXT *Ctx, const uint8_t *Rom, uint32_t RomSize, EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats);
+
+/**
+ Second half of ExtractEfiImageFromBuffer(): decode the stream
+ LocateEfiStream() found into Ctx->OutBuffer.
+
+ @retval  0 RomInfo->OrigSize bytes were decoded.
+ @retval  <0 The exit code main() reports for the failure.
+ **/
+int DecodeEfiStream(EXTRACT_CONTEXT *Ctx, const uint8_t *Rom, uint32_t RomSize, const EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats);
+
+/**
+ Load an input file, locate its compressed EFI image and decompress it.
+
+ @param  InFile    Path of the option ROM or raw compressed file.
+ @param  DecompressFlags Flags for UefiDecompressEx().
+ @param  RomInfo   Receives where the image was found and its PCI identity.
+ @param  Stats     Receives the input size and the time spent in each phase
+                   up to and including decode.
+ @param  OutBuffer Receives the malloc'd decompressed image; the caller frees it.
+ @param  OutSize   Receives the size of the decompressed image.
+
+ @retval  0 The image was extracted.
+ @retval  <0 The exit code main() reports for the failure.
+ **/
+int ExtractEfiImage(const char *InFile, uint32_t DecompressFlags, EFI_ROM_INFO *RomInfo, EXTRACT_STATS *Stats, uint8_t **OutBuffer, uint32_t *OutSize);
+
+/**
+ Write an image to a file, or to stdout for -.
+
+ @retval  0 OK.
+ @retval  -9 The file could not be written.
+ **/
+int WriteOutputFile(const char *OutFile, const uint8_t *Data, uint32_t Size);
 
 void *InternalMemSetMem16(void *Buffer, uint32_t Length, uint16_t Value);
 
@@ -214,8 +428,11 @@ uint16_t ReadPTLen(SCRATCH_DATA *Sd, uint16_t nn, uint16_t nbit, uint16_t Specia
  generate the Huffman Code mappg table for the Char&Len Set.
 
  @param  Sd The global scratch data.
+
+ @retval  0 OK.
+ @retval  BAD_TABLE Table is corrupted, only reported when decoding hardened.
 **/
-void ReadCLen(SCRATCH_DATA *Sd);
+uint16_t ReadCLen(SCRATCH_DATA *Sd);
 
 
 /**
@@ -241,4 +458,48 @@ DecodeC(SCRATCH_DATA *Sd);
  **/
 void Decode(SCRATCH_DATA *Sd);
 
+
+/**
+ Decode like Decode(), rejecting back references that reach before the
+ start of the output. Checks are made per match, not per byte.
+
+ @param  Sd The global scratch data.
+ **/
+void DecodeHardened(SCRATCH_DATA *Sd);
+
+
+RETURN_STATUS UefiDecompressGetInfo(const void *Source, uint32_t SourceSize, uint32_t *DestinationSize, uint32_t *ScratchSize);
+
+RETURN_STATUS UefiDecompress(const void *Source, void *Destination, void *Scratch);
+
+/**
+ Reject a stream that cannot be compressed data by its header sizes and the
+ code tables of its first block, without touching any output.
+
+ @retval  RETURN_SUCCESS The stream is plausible.
+ @retval  RETURN_INVALID_PARAMETER The stream is not compressed data or is corrupt.
+ **/
+RETURN_STATUS UefiDecompressCheck(const void *Source, uint32_t SourceSize, void *Scratch);
+
+/**
+ Check the header of Source and set Scratch up to decode it into Destination,
+ without decoding anything. Used by UefiDecompressEx() and by decoders that
+ drive the SCRATCH_DATA themselves.
+
+ @retval  RETURN_SUCCESS Scratch is set up; mOrigSize 0 means nothing to decode.
+ @retval  RETURN_INVALID_PARAMETER The stream does not fit the buffers.
+ **/
+RETURN_STATUS UefiDecompressBegin(const void *Source, uint32_t SourceSize, void *Destination, uint32_t DestinationSize, void *Scratch, uint32_t Flags);
+
+/**
+ Decompress Source into Destination. With DECOMPRESS_HARDENED the stream is
+ not trusted: it is read no further than SourceSize, must decode to at most
+ DestinationSize bytes and may not carry inconsistent tables or references
+ before the start of the output.
+
+ @retval  RETURN_SUCCESS Decompression completed successfully.
+ @retval  RETURN_INVALID_PARAMETER The source buffer is corrupted.
+ **/
+RETURN_STATUS UefiDecompressEx(const void *Source, uint32_t SourceSize, void *Destination, uint32_t DestinationSize, void *Scratch, uint32_t Flags);
+
 #endif
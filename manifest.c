@@ -0,0 +1,266 @@
+//
+//  manifest.c
+//  UEFIRomExtract
+//
+//  The NDJSON manifest of a deduplicated output directory, one record per
+//  input, read back by incremental runs to skip inputs that did not change.
+//
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "manifest.h"
+#include "report.h"
+
+void ManifestInit(MANIFEST *Manifest) {
+    memset(Manifest, 0, sizeof (*Manifest));
+    DigestIndexInit(&Manifest->mByPath);
+}
+
+void ManifestFree(MANIFEST *Manifest) {
+    for (uint32_t Index = 0; Index < Manifest->mCount; Index++) {
+        free(Manifest->mRecords[Index].Input);
+    }
+
+    free(Manifest->mRecords);
+    DigestIndexFree(&Manifest->mByPath);
+    memset(Manifest, 0, sizeof (*Manifest));
+}
+
+void ManifestWriteRecord(FILE *File, const MANIFEST_RECORD *Record) {
+    char Hex[SHA256_HEX_SIZE];
+
+    fputs("{\"input\":", File);
+    ReportJsonString(File, Record->Input);
+    fprintf(File, ",\"size\":%llu,\"mtime_ns\":%lld", (unsigned long long) Record->Size, (long long) Record->MTimeNs);
+
+    if (Record->HasInputHash) {
+        Sha256Hex(Record->InputHash, Hex);
+        fprintf(File, ",\"input_sha256\":\"%s\"", Hex);
+    }
+
+    fprintf(File, ",\"rom_offset\":%u,\"vendor_id\":%u,\"device_id\":%u,\"orig_size\":%u",
+            Record->RomInfo.RomOffset, Record->RomInfo.VendorId, Record->RomInfo.DeviceId, Record->RomInfo.OrigSize);
+
+    if (Record->HasPayload) {
+        Sha256Hex(Record->Payload, Hex);
+        fprintf(File, ",\"payload_sha256\":\"%s\"", Hex);
+    }
+
+    if (Record->HasContent) {
+        Sha256Hex(Record->Content, Hex);
+        fprintf(File, ",\"sha256\":\"%s\",\"decoded\":%s,\"output\":\"%s.efi\"", Hex, Record->Decoded ? "true" : "false", Hex);
+    }
+
+    fprintf(File, ",\"hardened\":%s,\"result\":%d}\n", Record->Hardened ? "true" : "false", Record->Result);
+}
+
+//
+// Just enough JSON to read back what ManifestWriteRecord() writes. Keys are
+// found by their quoted name followed by a colon, which cannot occur inside
+// the escaped input path.
+//
+static const char *JsonValue(const char *Line, const char *Key) {
+    char Pattern[32];
+
+    snprintf(Pattern, sizeof (Pattern), "\"%s\":", Key);
+
+    const char *Found = strstr(Line, Pattern);
+
+    return Found != NULL ? Found + strlen(Pattern) : NULL;
+}
+
+static int JsonNumber(const char *Line, const char *Key, long long *Value) {
+    const char *Text = JsonValue(Line, Key);
+    char *End;
+
+    if (Text == NULL) {
+        return -1;
+    }
+
+    *Value = strtoll(Text, &End, 10);
+
+    return End != Text ? 0 : -1;
+}
+
+static int JsonDigest(const char *Line, const char *Key, uint8_t *Digest) {
+    const char *Text = JsonValue(Line, Key);
+
+    if (Text == NULL || *Text++ != '"') {
+        return -1;
+    }
+
+    for (int Index = 0; Index < SHA256_DIGEST_SIZE; Index++) {
+        unsigned int Byte;
+
+        if (sscanf(Text + 2 * Index, "%2x", &Byte) != 1) {
+            return -1;
+        }
+
+        Digest[Index] = (uint8_t) Byte;
+    }
+
+    return Text[2 * SHA256_DIGEST_SIZE] == '"' ? 0 : -1;
+}
+
+static int JsonBool(const char *Line, const char *Key) {
+    const char *Text = JsonValue(Line, Key);
+
+    return Text != NULL && strncmp(Text, "true", 4) == 0;
+}
+
+// Undo ReportJsonString() into a malloc'd string
+static char *JsonString(const char *Line, const char *Key) {
+    const char *Text = JsonValue(Line, Key);
+
+    if (Text == NULL || *Text++ != '"') {
+        return NULL;
+    }
+
+    char *Value = malloc(strlen(Text) + 1);
+    char *Out = Value;
+
+    if (Value == NULL) {
+        return NULL;
+    }
+
+    for (; *Text != '"'; Text++) {
+        unsigned int Char;
+
+        if (*Text == 0) {
+            free(Value);
+            return NULL;
+        }
+
+        if (*Text != '\\') {
+            *Out++ = *Text;
+        } else if (Text[1] == 'u' && sscanf(Text + 2, "%4x", &Char) == 1) {
+            *Out++ = (char) Char;
+            Text += 5;
+        } else if (Text[1] != 0) {
+            *Out++ = *++Text;
+        }
+    }
+
+    *Out = 0;
+
+    return Value;
+}
+
+static int ManifestParseRecord(const char *Line, MANIFEST_RECORD *Record) {
+    long long Number;
+
+    memset(Record, 0, sizeof (*Record));
+
+    if (JsonNumber(Line, "result", &Number)) {
+        return -1;
+    }
+
+    Record->Result = (int) Number;
+    Record->Size = JsonNumber(Line, "size", &Number) == 0 ? (uint64_t) Number : 0;
+    Record->MTimeNs = JsonNumber(Line, "mtime_ns", &Number) == 0 ? Number : 0;
+    Record->RomInfo.RomOffset = JsonNumber(Line, "rom_offset", &Number) == 0 ? (uint32_t) Number : 0;
+    Record->RomInfo.VendorId = JsonNumber(Line, "vendor_id", &Number) == 0 ? (uint16_t) Number : 0;
+    Record->RomInfo.DeviceId = JsonNumber(Line, "device_id", &Number) == 0 ? (uint16_t) Number : 0;
+    Record->RomInfo.OrigSize = JsonNumber(Line, "orig_size", &Number) == 0 ? (uint32_t) Number : 0;
+    Record->HasInputHash = JsonDigest(Line, "input_sha256", Record->InputHash) == 0;
+    Record->HasPayload = JsonDigest(Line, "payload_sha256", Record->Payload) == 0;
+    Record->HasContent = JsonDigest(Line, "sha256", Record->Content) == 0;
+    Record->Decoded = JsonBool(Line, "decoded");
+    Record->Hardened = JsonBool(Line, "hardened");
+
+    // Parsed last, so nothing is left to free on failure
+    Record->Input = JsonString(Line, "input");
+
+    return Record->Input != NULL ? 0 : -1;
+}
+
+static int ManifestAdd(MANIFEST *Manifest, MANIFEST_RECORD *Record) {
+    uint8_t Key[SHA256_DIGEST_SIZE];
+    uint8_t Value[SHA256_DIGEST_SIZE];
+
+    Sha256(Record->Input, strlen(Record->Input), Key);
+
+    DIGEST_ENTRY *Known = DigestIndexFind(&Manifest->mByPath, Key);
+
+    if (Known != NULL) {
+        uint32_t Number;
+
+        memcpy(&Number, Known->Value, sizeof (Number));
+        free(Manifest->mRecords[Number].Input);
+        Manifest->mRecords[Number] = *Record;
+
+        return 0;
+    }
+
+    if (Manifest->mCount == Manifest->mCapacity) {
+        uint32_t Capacity = Manifest->mCapacity != 0 ? Manifest->mCapacity * 2 : 256;
+        MANIFEST_RECORD *Records = realloc(Manifest->mRecords, Capacity * sizeof (MANIFEST_RECORD));
+
+        if (Records == NULL) {
+            return -1;
+        }
+
+        Manifest->mRecords = Records;
+        Manifest->mCapacity = Capacity;
+    }
+
+    // The index maps to digests, so the record number rides in the value
+    memset(Value, 0, sizeof (Value));
+    memcpy(Value, &Manifest->mCount, sizeof (Manifest->mCount));
+
+    if (DigestIndexInsert(&Manifest->mByPath, Key, Value)) {
+        return -1;
+    }
+
+    Manifest->mRecords[Manifest->mCount++] = *Record;
+
+    return 0;
+}
+
+int ManifestLoad(MANIFEST *Manifest, const char *Path) {
+    MANIFEST_RECORD Record;
+    char *Line = NULL;
+    size_t LineSize = 0;
+    ssize_t Length;
+    int Status = 0;
+
+    FILE *File = fopen(Path, "r");
+
+    if (File == NULL) {
+        return 0;
+    }
+
+    while (Status == 0 && (Length = getline(&Line, &LineSize, File)) > 0) {
+        // A run killed mid-write leaves a line without its closing brace and newline
+        if (Length < 2 || strcmp(Line + Length - 2, "}\n") != 0 || ManifestParseRecord(Line, &Record)) {
+            continue;
+        }
+
+        if (ManifestAdd(Manifest, &Record)) {
+            free(Record.Input);
+            Status = -1;
+        }
+    }
+
+    free(Line);
+    fclose(File);
+
+    return Status;
+}
+
+const MANIFEST_RECORD *ManifestFind(const MANIFEST *Manifest, const char *Input) {
+    uint8_t Key[SHA256_DIGEST_SIZE];
+    uint32_t Number;
+
+    Sha256(Input, strlen(Input), Key);
+
+    DIGEST_ENTRY *Known = DigestIndexFind(&Manifest->mByPath, Key);
+
+    if (Known == NULL) {
+        return NULL;
+    }
+
+    memcpy(&Number, Known->Value, sizeof (Number));
+
+    return &Manifest->mRecords[Number];
+}
@@ -0,0 +1,76 @@
+//
+//  manifest.h
+//  UEFIRomExtract
+//
+//  The NDJSON manifest of a deduplicated output directory, one record per
+//  input, read back by incremental runs to skip inputs that did not change.
+//
+
+#ifndef UEFIRomExtract_manifest_h
+#define UEFIRomExtract_manifest_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include "main.h"
+#include "sha256.h"
+#include "dedupe.h"
+
+//
+// A run writes its manifest here and renames it over DEDUPE_MANIFEST when
+// done; a run that was interrupted leaves its finished records behind in it.
+//
+#define MANIFEST_TEMP_SUFFIX ".tmp"
+
+typedef struct {
+    char *Input;
+    uint64_t Size;                             // Size and modification time of the input, 0 for stdin
+    int64_t MTimeNs;
+    uint8_t InputHash[SHA256_DIGEST_SIZE];     // Of the whole input file
+    EFI_ROM_INFO RomInfo;                      // RomOffset, VendorId, DeviceId and OrigSize
+    uint8_t Payload[SHA256_DIGEST_SIZE];       // Of the compressed stream
+    uint8_t Content[SHA256_DIGEST_SIZE];       // Of the image, named <Content>.efi in the directory
+    uint8_t HasInputHash;
+    uint8_t HasPayload;
+    uint8_t HasContent;
+    uint8_t Decoded;                           // The image was decoded rather than found by payload
+    uint8_t Hardened;                          // Extracted with DECOMPRESS_HARDENED
+    int Result;
+} MANIFEST_RECORD;
+
+//
+// Records of an earlier run, looked up by input path.
+//
+typedef struct {
+    MANIFEST_RECORD *mRecords;
+    uint32_t mCount;
+    uint32_t mCapacity;
+    DIGEST_INDEX mByPath;                      // SHA-256 of the path to the record number
+} MANIFEST;
+
+void ManifestInit(MANIFEST *Manifest);
+
+void ManifestFree(MANIFEST *Manifest);
+
+/**
+ Read the records of a manifest file into Manifest. Later records replace
+ earlier ones for the same input; a torn last line is ignored. A missing
+ file is not an error.
+
+ @retval  0 OK.
+ @retval  -1 Out of memory.
+ **/
+int ManifestLoad(MANIFEST *Manifest, const char *Path);
+
+/**
+ Look the record of an input up.
+
+ @return The record, or NULL if the input is not in the manifest.
+ **/
+const MANIFEST_RECORD *ManifestFind(const MANIFEST *Manifest, const char *Input);
+
+/**
+ Write one record as a JSON line.
+ **/
+void ManifestWriteRecord(FILE *File, const MANIFEST_RECORD *Record);
+
+#endif
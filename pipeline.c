@@ -0,0 +1,165 @@
+//
+//  pipeline.c
+//  UEFIRomExtract
+//
+//  Two-stage decoder: the calling thread entropy-decodes the stream into
+//  literal/match tokens, a second thread turns the tokens into output bytes.
+//
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include "pipeline.h"
+
+//
+// Positions are free running and wrap at 2^32; they are published in
+// batches so the two cores do not bounce the cache lines on every token.
+//
+#define PIPELINE_PUBLISH_EVERY  256
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t Head;   // Tokens consumed, written by the consumer
+    _Alignas(64) _Atomic uint32_t Tail;   // Tokens published, written by the producer
+    _Atomic uint32_t Done;                // Set by the producer after the last Tail update
+    _Alignas(64) uint8_t *DstBase;
+    uint32_t Tokens[PIPELINE_RING_SIZE];
+} TOKEN_RING;
+
+static void *PipelineConsumer(void *Arg) {
+    TOKEN_RING *Ring = Arg;
+    uint8_t *Dst = Ring->DstBase;
+    uint32_t Head = atomic_load_explicit(&Ring->Head, memory_order_relaxed);
+    uint32_t OutBuf = 0;
+
+    for (;;) {
+        uint32_t Tail = atomic_load_explicit(&Ring->Tail, memory_order_acquire);
+
+        if (Head == Tail) {
+            // Done is set after the final Tail, so one more look at Tail settles it
+            if (atomic_load_explicit(&Ring->Done, memory_order_acquire)) {
+                if (Head == atomic_load_explicit(&Ring->Tail, memory_order_acquire)) {
+                    break;
+                }
+
+                continue;
+            }
+
+            sched_yield();
+            continue;
+        }
+
+        while (Head != Tail) {
+            uint32_t Token = Ring->Tokens[Head & (PIPELINE_RING_SIZE - 1)];
+
+            if ((Token & DECODE_TOKEN_MATCH) == 0) {
+                Dst[OutBuf++] = (uint8_t) Token;
+            } else {
+                uint32_t Length = DECODE_TOKEN_LENGTH(Token);
+                const uint8_t *Src = Dst + OutBuf - DECODE_TOKEN_DISTANCE(Token);
+
+                // Overlapping copies are intended, they repeat the last Distance bytes
+                for (uint32_t Index = 0; Index < Length; Index++) {
+                    Dst[OutBuf + Index] = Src[Index];
+                }
+
+                OutBuf += Length;
+            }
+
+            Head++;
+
+            if ((Head & (PIPELINE_PUBLISH_EVERY - 1)) == 0) {
+                atomic_store_explicit(&Ring->Head, Head, memory_order_release);
+            }
+        }
+
+        atomic_store_explicit(&Ring->Head, Head, memory_order_release);
+    }
+
+    return NULL;
+}
+
+// Wait for a free slot; the cached head is only refreshed when the ring looks full
+static void PipelineReserve(TOKEN_RING *Ring, uint32_t Tail, uint32_t *CachedHead) {
+    while (Tail - *CachedHead == PIPELINE_RING_SIZE) {
+        atomic_store_explicit(&Ring->Tail, Tail, memory_order_release);
+        *CachedHead = atomic_load_explicit(&Ring->Head, memory_order_acquire);
+
+        if (Tail - *CachedHead == PIPELINE_RING_SIZE) {
+            sched_yield();
+        }
+    }
+}
+
+void DecodePipelined(SCRATCH_DATA *Sd) {
+    TOKEN_RING Ring;
+    pthread_t Consumer;
+    uint32_t Tail = 0;
+    uint32_t CachedHead = 0;
+    uint32_t OutBuf = Sd->mOutBuf;
+
+    atomic_init(&Ring.Head, 0);
+    atomic_init(&Ring.Tail, 0);
+    atomic_init(&Ring.Done, 0);
+    Ring.DstBase = Sd->mDstBase;
+
+    if (pthread_create(&Consumer, NULL, PipelineConsumer, &Ring) != 0) {
+        DecodeHardened(Sd);
+        return;
+    }
+
+    for (;;) {
+        uint32_t Token;
+
+        // Get one code from mBitBuf
+        uint16_t CharC = DecodeC(Sd);
+        if (Sd->mBadTableFlag != 0) {
+            break;
+        }
+
+        if (CharC < 256) {
+            // Process an Original character
+            if (OutBuf >= Sd->mOrigSize) {
+                break;
+            }
+
+            Token = DECODE_TOKEN_LITERAL(CharC);
+            OutBuf++;
+        } else {
+            // Process a Pointer
+            uint32_t Length = (uint32_t) (CharC - (BIT8 - THRESHOLD));
+            uint32_t Distance = DecodeP(Sd) + 1;
+
+            // The consumer trusts its tokens, so references are checked here
+            if (Distance > OutBuf || Distance > DECODE_TOKEN_MAX_DISTANCE) {
+                Sd->mBadTableFlag = (uint16_t) BAD_TABLE;
+                break;
+            }
+
+            if (Length > Sd->mOrigSize - OutBuf) {
+                Length = Sd->mOrigSize - OutBuf;
+            }
+
+            Token = DECODE_TOKEN_COPY(Length, Distance);
+            OutBuf += Length;
+        }
+
+        PipelineReserve(&Ring, Tail, &CachedHead);
+        Ring.Tokens[Tail & (PIPELINE_RING_SIZE - 1)] = Token;
+        Tail++;
+
+        if ((Tail & (PIPELINE_PUBLISH_EVERY - 1)) == 0) {
+            atomic_store_explicit(&Ring.Tail, Tail, memory_order_release);
+        }
+
+        if (OutBuf >= Sd->mOrigSize) {
+            break;
+        }
+    }
+
+    atomic_store_explicit(&Ring.Tail, Tail, memory_order_release);
+    atomic_store_explicit(&Ring.Done, 1, memory_order_release);
+
+    pthread_join(Consumer, NULL);
+
+    Sd->mOutBuf = OutBuf;
+}
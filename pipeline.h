@@ -0,0 +1,49 @@
+//
+//  pipeline.h
+//  UEFIRomExtract
+//
+//  Two-stage decoder: the calling thread entropy-decodes the stream into
+//  literal/match tokens, a second thread turns the tokens into output bytes.
+//
+
+#ifndef UEFIRomExtract_pipeline_h
+#define UEFIRomExtract_pipeline_h
+
+#include <stdint.h>
+#include "main.h"
+
+//
+// A token is one literal byte or one back reference. Matches carry their
+// length in bits 22-30 and their distance in bits 0-21; the 8 KiB window of
+// the EFI compressor leaves plenty of room.
+//
+#define DECODE_TOKEN_MATCH                  0x80000000U
+#define DECODE_TOKEN_MAX_DISTANCE           0x003FFFFFU
+#define DECODE_TOKEN_LITERAL(Byte)          ((uint32_t) (Byte))
+#define DECODE_TOKEN_COPY(Length, Distance) (DECODE_TOKEN_MATCH | ((uint32_t) (Length) << 22) | (uint32_t) (Distance))
+#define DECODE_TOKEN_LENGTH(Token)          (((Token) >> 22) & 0x1FF)
+#define DECODE_TOKEN_DISTANCE(Token)        ((Token) & DECODE_TOKEN_MAX_DISTANCE)
+
+//
+// Images smaller than this decode faster than a thread starts.
+//
+#define PIPELINE_MIN_SIZE  (256U * 1024)
+
+//
+// Ring capacity in tokens, a power of two. The ring lives on the stack of
+// DecodePipelined() so decoding still allocates nothing.
+//
+#define PIPELINE_RING_SIZE  16384
+
+/**
+ Decode the source data like DecodeHardened(), with the back reference copy
+ running concurrently on a second thread fed through a lock-free
+ single-producer/single-consumer token ring. Back references are always
+ validated, as the producer knows how much output precedes each one.
+ Falls back to decoding on the calling thread if no thread can be started.
+
+ @param  Sd The global scratch data.
+ **/
+void DecodePipelined(SCRATCH_DATA *Sd);
+
+#endif
@@ -0,0 +1,312 @@
+//
+//  profile.c
+//  UEFIRomExtract
+//
+//  Hardware performance counters per extraction phase through perf_event_open.
+//
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "profile.h"
+#include "pipeline.h"
+
+//
+// A block header holds a 16 bit symbol count and DecodeC() decrements it
+// before testing, so a count of 0 stands for 65536 symbols.
+//
+#define PROFILE_MAX_BLOCK_SYMBOLS  65536
+
+static _Thread_local PROFILE *mCurrent;
+
+static const char *const mPhaseNames[PROFILE_PHASE_COUNT] = {
+    "parse",
+    "tables",
+    "symbols",
+    "copy",
+    "write"
+};
+
+static const struct {
+    const char *Name;
+    uint32_t Type;
+    uint64_t Config;
+} mCounters[PROFILE_COUNTER_COUNT] = {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "l1d_misses",    PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                           (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "llc_misses",    PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                                           (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) }
+};
+
+static int PerfEventOpen(PROFILE_COUNTER Counter, int GroupFd) {
+    struct perf_event_attr Attr;
+
+    memset(&Attr, 0, sizeof (Attr));
+    Attr.size = sizeof (Attr);
+    Attr.type = mCounters[Counter].Type;
+    Attr.config = mCounters[Counter].Config;
+    Attr.read_format = PERF_FORMAT_GROUP;
+    Attr.disabled = GroupFd < 0;
+
+    // User space only, which perf_event_paranoid 2 still allows
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+
+    return (int) syscall(SYS_perf_event_open, &Attr, 0, -1, GroupFd, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Read the group into Values, indexed by counter
+static int ProfileRead(const PROFILE *Profile, uint64_t *Values) {
+    uint64_t Buffer[1 + PROFILE_COUNTER_COUNT];
+
+    ssize_t Size = read(Profile->mGroupFd, Buffer, sizeof (Buffer));
+
+    if (Size < (ssize_t) sizeof (uint64_t) || Buffer[0] != Profile->mMembers) {
+        return -1;
+    }
+
+    for (uint32_t Member = 0; Member < Profile->mMembers; Member++) {
+        Values[Profile->mOrder[Member]] = Buffer[1 + Member];
+    }
+
+    return 0;
+}
+
+int ProfileOpen(PROFILE *Profile) {
+    memset(Profile, 0, sizeof (*Profile));
+    Profile->mGroupFd = -1;
+    Profile->mPhase = PROFILE_PHASE_NONE;
+
+    Profile->mTokens = malloc(PROFILE_MAX_BLOCK_SYMBOLS * sizeof (uint32_t));
+
+    if (Profile->mTokens == NULL) {
+        return -1;
+    }
+
+    for (int Counter = 0; Counter < PROFILE_COUNTER_COUNT; Counter++) {
+        Profile->mFds[Counter] = PerfEventOpen((PROFILE_COUNTER) Counter, Profile->mGroupFd);
+
+        if (Profile->mFds[Counter] < 0) {
+            Print("Counter %s unavailable: %s\n", mCounters[Counter].Name, strerror(errno));
+            continue;
+        }
+
+        if (Profile->mGroupFd < 0) {
+            Profile->mGroupFd = Profile->mFds[Counter];
+        }
+
+        Profile->Available[Counter] = 1;
+        Profile->mOrder[Profile->mMembers++] = (uint8_t) Counter;
+    }
+
+    if (Profile->mGroupFd < 0) {
+        Print("No hardware counters available, profiling wall time only\n");
+    } else {
+        ioctl(Profile->mGroupFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    mCurrent = Profile;
+
+    return 0;
+}
+
+void ProfileClose(PROFILE *Profile) {
+    for (int Counter = 0; Counter < PROFILE_COUNTER_COUNT; Counter++) {
+        if (Profile->Available[Counter]) {
+            close(Profile->mFds[Counter]);
+        }
+    }
+
+    free(Profile->mTokens);
+
+    if (mCurrent == Profile) {
+        mCurrent = NULL;
+    }
+
+    memset(Profile, 0, sizeof (*Profile));
+    Profile->mGroupFd = -1;
+}
+
+PROFILE *ProfileCurrent(void) {
+    return mCurrent;
+}
+
+void ProfileSwitch(PROFILE_PHASE Phase) {
+    PROFILE *Profile = mCurrent;
+    uint64_t Values[PROFILE_COUNTER_COUNT];
+    struct timespec Wall;
+
+    if (Profile == NULL || Profile->mPhase == Phase) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &Wall);
+
+    int Counted = Profile->mGroupFd >= 0 && ProfileRead(Profile, Values) == 0;
+
+    if (Profile->mPhase < PROFILE_PHASE_COUNT) {
+        Profile->WallNs[Profile->mPhase] += ElapsedNs(&Profile->mWallStart, &Wall);
+
+        for (uint32_t Member = 0; Counted && Member < Profile->mMembers; Member++) {
+            uint8_t Counter = Profile->mOrder[Member];
+
+            Profile->Counts[Profile->mPhase][Counter] += Values[Counter] - Profile->mLast[Counter];
+        }
+    }
+
+    if (Counted) {
+        memcpy(Profile->mLast, Values, sizeof (Values));
+    }
+
+    Profile->mPhase = Phase;
+    Profile->mWallStart = Wall;
+}
+
+void ProfileImage(const char *InFile) {
+    PROFILE *Profile = mCurrent;
+
+    if (Profile == NULL) {
+        return;
+    }
+
+    ProfileSwitch(PROFILE_PHASE_NONE);
+
+    Print("Profile of %s:\n", InFile);
+    Print("  %-8s %14s", "phase", "wall_ns");
+
+    for (int Counter = 0; Counter < PROFILE_COUNTER_COUNT; Counter++) {
+        Print(" %14s", mCounters[Counter].Name);
+    }
+
+    Print(" %6s\n", "ipc");
+
+    for (int Phase = 0; Phase < PROFILE_PHASE_COUNT; Phase++) {
+        const uint64_t *Counts = Profile->Counts[Phase];
+
+        Print("  %-8s %14llu", mPhaseNames[Phase], (unsigned long long) Profile->WallNs[Phase]);
+
+        for (int Counter = 0; Counter < PROFILE_COUNTER_COUNT; Counter++) {
+            if (Profile->Available[Counter]) {
+                Print(" %14llu", (unsigned long long) Counts[Counter]);
+            } else {
+                Print(" %14s", "n/a");
+            }
+        }
+
+        if (Profile->Available[PROFILE_COUNTER_CYCLES] && Profile->Available[PROFILE_COUNTER_INSTRUCTIONS] &&
+            Counts[PROFILE_COUNTER_CYCLES] != 0) {
+            Print(" %6.2f\n", (double) Counts[PROFILE_COUNTER_INSTRUCTIONS] / (double) Counts[PROFILE_COUNTER_CYCLES]);
+        } else {
+            Print(" %6s\n", "n/a");
+        }
+    }
+
+    memset(Profile->Counts, 0, sizeof (Profile->Counts));
+    memset(Profile->WallNs, 0, sizeof (Profile->WallNs));
+}
+
+void ProfileJson(const PROFILE *Profile, FILE *File) {
+    for (int Phase = 0; Phase < PROFILE_PHASE_COUNT; Phase++) {
+        fprintf(File, "%s\"%s\":{\"wall_ns\":%llu", Phase != 0 ? "," : "", mPhaseNames[Phase],
+                (unsigned long long) Profile->WallNs[Phase]);
+
+        // Unavailable counters are left out rather than reported as zero
+        for (int Counter = 0; Counter < PROFILE_COUNTER_COUNT; Counter++) {
+            if (Profile->Available[Counter]) {
+                fprintf(File, ",\"%s\":%llu", mCounters[Counter].Name, (unsigned long long) Profile->Counts[Phase][Counter]);
+            }
+        }
+
+        fputc('}', File);
+    }
+}
+
+void DecodeProfiled(SCRATCH_DATA *Sd) {
+    PROFILE *Profile = mCurrent;
+
+    if (Profile == NULL) {
+        DecodeHardened(Sd);
+        return;
+    }
+
+    uint32_t *Tokens = Profile->mTokens;
+    uint32_t OutBuf = Sd->mOutBuf;
+
+    while (OutBuf < Sd->mOrigSize) {
+        uint32_t Count = 0;
+
+        // DecodeC() reads the tables of the block along with its first symbol
+        ProfileSwitch(PROFILE_PHASE_TABLES);
+
+        do {
+            // Get one code from mBitBuf
+            uint16_t CharC = DecodeC(Sd);
+
+            ProfileSwitch(PROFILE_PHASE_SYMBOLS);
+
+            if (Sd->mBadTableFlag != 0) {
+                break;
+            }
+
+            if (CharC < 256) {
+                // Process an Original character
+                Tokens[Count++] = DECODE_TOKEN_LITERAL(CharC);
+                OutBuf++;
+            } else {
+                // Process a Pointer
+                uint32_t Length = (uint32_t) (CharC - (BIT8 - THRESHOLD));
+                uint32_t Distance = DecodeP(Sd) + 1;
+
+                // The copy pass trusts its tokens, so references are checked here
+                if (Distance > OutBuf || Distance > DECODE_TOKEN_MAX_DISTANCE) {
+                    Sd->mBadTableFlag = (uint16_t) BAD_TABLE;
+                    break;
+                }
+
+                if (Length > Sd->mOrigSize - OutBuf) {
+                    Length = Sd->mOrigSize - OutBuf;
+                }
+
+                Tokens[Count++] = DECODE_TOKEN_COPY(Length, Distance);
+                OutBuf += Length;
+            }
+        } while (Sd->mBlockSize != 0 && OutBuf < Sd->mOrigSize);
+
+        ProfileSwitch(PROFILE_PHASE_COPY);
+
+        uint8_t *Dst = Sd->mDstBase;
+        uint32_t Out = Sd->mOutBuf;
+
+        for (uint32_t Index = 0; Index < Count; Index++) {
+            uint32_t Token = Tokens[Index];
+
+            if ((Token & DECODE_TOKEN_MATCH) == 0) {
+                Dst[Out++] = (uint8_t) Token;
+            } else {
+                uint32_t Length = DECODE_TOKEN_LENGTH(Token);
+                const uint8_t *Src = Dst + Out - DECODE_TOKEN_DISTANCE(Token);
+
+                // Overlapping copies are intended, they repeat the last Distance bytes
+                for (uint32_t Byte = 0; Byte < Length; Byte++) {
+                    Dst[Out + Byte] = Src[Byte];
+                }
+
+                Out += Length;
+            }
+        }
+
+        Sd->mOutBuf = Out;
+
+        if (Sd->mBadTableFlag != 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,105 @@
+//
+//  profile.h
+//  UEFIRomExtract
+//
+//  Hardware performance counters per extraction phase through perf_event_open.
+//
+
+#ifndef UEFIRomExtract_profile_h
+#define UEFIRomExtract_profile_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "main.h"
+
+//
+// Finer than EXTRACT_PHASE: decoding is split into reading the code tables
+// of each block, decoding its symbols and copying its literals and matches.
+//
+typedef enum {
+    PROFILE_PHASE_PARSE,     // Reading the input, walking the ROM, reading the stream header
+    PROFILE_PHASE_TABLES,    // ReadPTLen/ReadCLen/MakeTable at the start of each block
+    PROFILE_PHASE_SYMBOLS,   // DecodeC/DecodeP over the symbols of a block
+    PROFILE_PHASE_COPY,      // Writing the literals and back references of a block
+    PROFILE_PHASE_WRITE,     // Writing the image out
+    PROFILE_PHASE_COUNT,
+    PROFILE_PHASE_NONE = PROFILE_PHASE_COUNT
+} PROFILE_PHASE;
+
+typedef enum {
+    PROFILE_COUNTER_CYCLES,
+    PROFILE_COUNTER_INSTRUCTIONS,
+    PROFILE_COUNTER_BRANCH_MISSES,
+    PROFILE_COUNTER_L1D_MISSES,
+    PROFILE_COUNTER_LLC_MISSES,
+    PROFILE_COUNTER_COUNT
+} PROFILE_COUNTER;
+
+//
+// Counters of one thread. They are opened as one group so all of them
+// count over the same intervals; counters the CPU, the hypervisor or
+// perf_event_paranoid do not allow are left out and only wall time is
+// kept for them.
+//
+typedef struct {
+    uint64_t Counts[PROFILE_PHASE_COUNT][PROFILE_COUNTER_COUNT];
+    uint64_t WallNs[PROFILE_PHASE_COUNT];
+    uint8_t Available[PROFILE_COUNTER_COUNT];
+
+    int mGroupFd;                               // The group leader, -1 without counters
+    int mFds[PROFILE_COUNTER_COUNT];
+    uint32_t mMembers;                          // Counters in the group, in read order
+    uint8_t mOrder[PROFILE_COUNTER_COUNT];      // Counter of each group member
+    uint64_t mLast[PROFILE_COUNTER_COUNT];      // Values at the start of the current phase
+    PROFILE_PHASE mPhase;
+    struct timespec mWallStart;
+    uint32_t *mTokens;                          // One block of tokens for DecodeProfiled()
+} PROFILE;
+
+/**
+ Open the counters for the calling thread and make Profile the one its
+ extractions are counted in. Missing counters are reported, not fatal.
+
+ @retval  0 OK, possibly without any hardware counter.
+ @retval  -1 Out of memory.
+ **/
+int ProfileOpen(PROFILE *Profile);
+
+void ProfileClose(PROFILE *Profile);
+
+/**
+ The profile the calling thread counts in, NULL when not profiling.
+ **/
+PROFILE *ProfileCurrent(void);
+
+/**
+ Account everything since the last switch to the phase being counted and
+ start counting Phase. Does nothing when the thread is not profiling.
+
+ @param  Phase The phase to count, PROFILE_PHASE_NONE to only stop counting.
+ **/
+void ProfileSwitch(PROFILE_PHASE Phase);
+
+/**
+ Print the counts of the calling thread for InFile and start over for the
+ next image. Does nothing when the thread is not profiling.
+ **/
+void ProfileImage(const char *InFile);
+
+/**
+ Write the counts as the members of a JSON object, keyed by phase.
+ **/
+void ProfileJson(const PROFILE *Profile, FILE *File);
+
+/**
+ Decode the source data like DecodeHardened(), one block at a time in three
+ passes so each gets its own counts: the code tables, the symbols into a
+ token buffer, then the literals and matches of the tokens into the output.
+ Falls back to DecodeHardened() when the thread is not profiling.
+
+ @param  Sd The global scratch data.
+ **/
+void DecodeProfiled(SCRATCH_DATA *Sd);
+
+#endif
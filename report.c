@@ -0,0 +1,102 @@
+//
+//  report.c
+//  UEFIRomExtract
+//
+//  Machine-readable NDJSON report, one object per processed image.
+//
+#include <string.h>
+#include <stdio.h>
+#include "report.h"
+#include "profile.h"
+
+static const char *const mPhaseNames[EXTRACT_PHASE_COUNT] = {
+    "parse",
+    "scratch",
+    "decode",
+    "write"
+};
+
+int ReportOpen(EXTRACT_REPORT *Rp, const char *Path) {
+    memset(Rp, 0, sizeof (*Rp));
+
+    if (strcmp(Path, "-") == 0) {
+        Rp->mFile = stdout;
+    } else {
+        Rp->mFile = fopen(Path, "w");
+        Rp->mOwnsFile = 1;
+    }
+
+    return Rp->mFile != NULL ? 0 : -1;
+}
+
+void ReportJsonString(FILE *File, const char *Value) {
+    fputc('"', File);
+
+    for (const unsigned char *Char = (const unsigned char *) Value; *Char != 0; Char++) {
+        if (*Char == '"' || *Char == '\\') {
+            fputc('\\', File);
+            fputc(*Char, File);
+        } else if (*Char < 0x20) {
+            fprintf(File, "\\u%04x", *Char);
+        } else {
+            fputc(*Char, File);
+        }
+    }
+
+    fputc('"', File);
+}
+
+void ReportImage(EXTRACT_REPORT *Rp, const char *InFile, const EFI_ROM_INFO *RomInfo, const EXTRACT_STATS *Stats, int Result) {
+    if (Rp == NULL) {
+        return;
+    }
+
+    FILE *File = Rp->mFile;
+
+    // Server workers report concurrently, keep each record on its own line
+    flockfile(File);
+
+    fputs("{\"input\":", File);
+    ReportJsonString(File, InFile);
+
+    // Images without an option ROM header were decoded from offset 0 as raw streams
+    fprintf(File, ",\"container\":\"%s\",\"rom_offset\":%u,\"vendor_id\":%u,\"device_id\":%u",
+            RomInfo->RomOffset != 0 ? "pci-rom" : "raw", RomInfo->RomOffset, RomInfo->VendorId, RomInfo->DeviceId);
+    fprintf(File, ",\"compression\":\"efi\",\"compression_type\":%u", RomInfo->CompressionType);
+    fprintf(File, ",\"input_size\":%llu,\"comp_size\":%u,\"orig_size\":%u,\"result\":%d",
+            (unsigned long long) Stats->InputSize, RomInfo->CompSize, RomInfo->OrigSize, Result);
+
+    fputs(",\"wall_ns\":{", File);
+    for (int Phase = 0; Phase < EXTRACT_PHASE_COUNT; Phase++) {
+        fprintf(File, "%s\"%s\":%llu", Phase != 0 ? "," : "", mPhaseNames[Phase], (unsigned long long) Stats->WallNs[Phase]);
+    }
+
+    fputs("},\"cpu_ns\":{", File);
+    for (int Phase = 0; Phase < EXTRACT_PHASE_COUNT; Phase++) {
+        fprintf(File, "%s\"%s\":%llu", Phase != 0 ? "," : "", mPhaseNames[Phase], (unsigned long long) Stats->CpuNs[Phase]);
+    }
+
+    // Hardware counters of the thread that did the extraction, with --profile
+    PROFILE *Profile = ProfileCurrent();
+
+    if (Profile != NULL) {
+        ProfileSwitch(PROFILE_PHASE_NONE);
+        fputs("},\"counters\":{", File);
+        ProfileJson(Profile, File);
+    }
+
+    fputs("}}\n", File);
+    fflush(File);
+
+    funlockfile(File);
+}
+
+void ReportClose(EXTRACT_REPORT *Rp) {
+    if (Rp->mOwnsFile) {
+        fclose(Rp->mFile);
+    } else {
+        fflush(Rp->mFile);
+    }
+
+    memset(Rp, 0, sizeof (*Rp));
+}
@@ -0,0 +1,52 @@
+//
+//  report.h
+//  UEFIRomExtract
+//
+//  Machine-readable NDJSON report, one object per processed image.
+//
+
+#ifndef UEFIRomExtract_report_h
+#define UEFIRomExtract_report_h
+
+#include <stdio.h>
+#include "main.h"
+
+typedef struct {
+    FILE *mFile;
+    uint8_t mOwnsFile;
+} EXTRACT_REPORT;
+
+/**
+ Open a report stream.
+
+ @param  Rp   The report to initialise.
+ @param  Path The file to create, or - for stdout.
+
+ @retval  0 OK.
+ @retval  -1 The report could not be opened.
+ **/
+int ReportOpen(EXTRACT_REPORT *Rp, const char *Path);
+
+/**
+ Write one JSON line describing a processed image and flush it, so a
+ consumer tailing the report sees each image as soon as it is done.
+
+ @param  Rp      The report, or NULL to do nothing.
+ @param  InFile  The input the image came from.
+ @param  RomInfo Where the image was found and its PCI identity.
+ @param  Stats   Sizes and per-phase timings.
+ @param  Result  0 on success, otherwise the error code of the extraction.
+ **/
+void ReportImage(EXTRACT_REPORT *Rp, const char *InFile, const EFI_ROM_INFO *RomInfo, const EXTRACT_STATS *Stats, int Result);
+
+void ReportClose(EXTRACT_REPORT *Rp);
+
+/**
+ Write Value as a JSON string literal, quotes included.
+
+ @param  File  The stream to write to.
+ @param  Value The string to escape.
+ **/
+void ReportJsonString(FILE *File, const char *Value);
+
+#endif
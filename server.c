@@ -0,0 +1,589 @@
+//
+//  server.c
+//  UEFIRomExtract
+//
+//  Long-running extraction daemon on a Unix domain socket, its client and
+//  a load generator to compare it with one process per file.
+//
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "server.h"
+#include "budget.h"
+
+typedef struct {
+    int Listen;
+    uint32_t DecompressFlags;
+    EXTRACT_REPORT *Report;
+    MEMORY_BUDGET *Budget;     // NULL when unlimited
+} SERVER;
+
+static const char *mSocketPath;
+
+static void ServerTerminate(int Signal) {
+    (void) Signal;
+
+    unlink(mSocketPath);
+    _exit(0);
+}
+
+static int ReadExact(int Fd, void *Data, size_t Size) {
+    while (Size != 0) {
+        ssize_t Got = read(Fd, Data, Size);
+
+        if (Got < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (Got <= 0) {
+            return -1;
+        }
+
+        Data = (uint8_t *) Data + Got;
+        Size -= (size_t) Got;
+    }
+
+    return 0;
+}
+
+static int WriteExact(int Fd, const void *Data, size_t Size) {
+    while (Size != 0) {
+        ssize_t Put = write(Fd, Data, Size);
+
+        if (Put < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (Put <= 0) {
+            return -1;
+        }
+
+        Data = (const uint8_t *) Data + Put;
+        Size -= (size_t) Put;
+    }
+
+    return 0;
+}
+
+// Regular files and memfds get exactly the image, anything else a plain stream of it
+static int WriteImage(int Fd, const uint8_t *Data, uint32_t Size) {
+    struct stat St;
+
+    if (fstat(Fd, &St) != 0) {
+        return -1;
+    }
+
+    if (!S_ISREG(St.st_mode)) {
+        return WriteExact(Fd, Data, Size);
+    }
+
+    if (ftruncate(Fd, Size) != 0) {
+        return -1;
+    }
+
+    for (off_t Offset = 0; Offset < Size;) {
+        ssize_t Put = pwrite(Fd, Data + Offset, Size - Offset, Offset);
+
+        if (Put < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (Put <= 0) {
+            return -1;
+        }
+
+        Offset += Put;
+    }
+
+    return 0;
+}
+
+// Receive a request header and up to two descriptors, -1 on hang-up or error
+static int ReceiveRequest(int Conn, SERVER_REQUEST *Request, int *Fds, int *FdCount) {
+    union {
+        char Buffer[CMSG_SPACE(2 * sizeof (int))];
+        struct cmsghdr Align;
+    } Control;
+    struct iovec Iov = { Request, sizeof (*Request) };
+    struct msghdr Msg;
+    ssize_t Got;
+
+    memset(&Msg, 0, sizeof (Msg));
+    Msg.msg_iov = &Iov;
+    Msg.msg_iovlen = 1;
+    Msg.msg_control = Control.Buffer;
+    Msg.msg_controllen = sizeof (Control.Buffer);
+
+    *FdCount = 0;
+
+    do {
+        Got = recvmsg(Conn, &Msg, MSG_CMSG_CLOEXEC);
+    } while (Got < 0 && errno == EINTR);
+
+    for (struct cmsghdr *Cmsg = CMSG_FIRSTHDR(&Msg); Cmsg != NULL; Cmsg = CMSG_NXTHDR(&Msg, Cmsg)) {
+        if (Cmsg->cmsg_level == SOL_SOCKET && Cmsg->cmsg_type == SCM_RIGHTS) {
+            int Count = (int) ((Cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int));
+            int *Passed = (int *) CMSG_DATA(Cmsg);
+
+            // More descriptors than a request uses are closed right away
+            for (int Index = 0; Index < Count; Index++) {
+                if (*FdCount < 2) {
+                    Fds[(*FdCount)++] = Passed[Index];
+                } else {
+                    close(Passed[Index]);
+                }
+            }
+        }
+    }
+
+    if (Got <= 0) {
+        return -1;
+    }
+
+    // The rest of a header split across reads carries no descriptors
+    if ((size_t) Got < sizeof (*Request) && ReadExact(Conn, (uint8_t *) Request + Got, sizeof (*Request) - Got)) {
+        return -1;
+    }
+
+    return Request->Magic == SERVER_MAGIC ? 0 : -1;
+}
+
+static void ServeConnection(SERVER *Server, EXTRACT_CONTEXT *Ctx, uint8_t **InBuffer, uint32_t *InCapacity, int Conn) {
+    for (;;) {
+        SERVER_REQUEST Request;
+        SERVER_RESPONSE Response;
+        EFI_ROM_INFO RomInfo;
+        EXTRACT_STATS Stats;
+        char Path[SERVER_MAX_PATH];
+        int Fds[2];
+        int FdCount;
+        int InFd = -1;
+        int OutFd = -1;
+        uint32_t InSize = 0;
+
+        if (ReceiveRequest(Conn, &Request, Fds, &FdCount)) {
+            for (int Index = 0; Index < FdCount; Index++) {
+                close(Fds[Index]);
+            }
+
+            return;
+        }
+
+        memset(&Response, 0, sizeof (Response));
+        memset(&RomInfo, 0, sizeof (RomInfo));
+        memset(&Stats, 0, sizeof (Stats));
+        strcpy(Path, "<fd>");
+
+        // The server's own flags stay, a request can only add hardening
+        Ctx->DecompressFlags = Server->DecompressFlags;
+
+        if ((Request.Flags & SERVER_REQUEST_HARDENED) != 0) {
+            Ctx->DecompressFlags |= DECOMPRESS_HARDENED;
+        }
+
+        if ((Request.Flags & SERVER_REQUEST_INPUT_FD) != 0 && FdCount == 2) {
+            InFd = Fds[0];
+            OutFd = Fds[1];
+        } else if ((Request.Flags & SERVER_REQUEST_INPUT_FD) == 0) {
+            // Opening the path would read it with the server's rights instead of the client's
+            if (Request.PathLength >= sizeof (Path) || ReadExact(Conn, Path, Request.PathLength)) {
+                for (int Index = 0; Index < FdCount; Index++) {
+                    close(Fds[Index]);
+                }
+
+                return;
+            }
+
+            Path[Request.PathLength] = 0;
+            fprintf(stderr, "%s: path requests are not served, pass the input descriptor\n", Path);
+        }
+
+        if (InFd < 0 || OutFd < 0) {
+            Response.Result = -1;
+        } else if (Server->Budget == NULL) {
+            if (LoadInputFd(InFd, InBuffer, InCapacity, &InSize)) {
+                Response.Result = -1;
+            } else {
+                Response.Result = ExtractEfiImageFromBuffer(Ctx, *InBuffer, InSize, &RomInfo, &Stats);
+            }
+        } else {
+            ExtractStatsInit(&Stats);
+
+            // Waiting for memory counts as allocating it
+            PhaseBegin(&Stats, EXTRACT_PHASE_SCRATCH);
+            Response.Result = BudgetLoadInput(Server->Budget, Ctx, InFd, InBuffer, InCapacity, &InSize);
+            PhaseEnd(&Stats);
+
+            if (Response.Result == 0) {
+                Response.Result = LocateEfiStream(Ctx, *InBuffer, InSize, &RomInfo, &Stats);
+            }
+
+            if (Response.Result == 0) {
+                PhaseBegin(&Stats, EXTRACT_PHASE_SCRATCH);
+                Response.Result = BudgetAdmitImage(Server->Budget, Ctx, InFd, InBuffer, InCapacity, &InSize, &RomInfo,
+                                                   &Stats);
+            }
+
+            if (Response.Result == 0) {
+                Response.Result = DecodeEfiStream(Ctx, *InBuffer, InSize, &RomInfo, &Stats);
+            }
+
+            PhaseEnd(&Stats);
+        }
+
+        if (Response.Result == 0) {
+            PhaseBegin(&Stats, EXTRACT_PHASE_WRITE);
+
+            if (WriteImage(OutFd, Ctx->OutBuffer, RomInfo.OrigSize)) {
+                Response.Result = -9;
+            }
+
+            PhaseEnd(&Stats);
+        }
+
+        if (Server->Budget != NULL) {
+            BudgetFinishImage(Server->Budget, Ctx, InBuffer, InCapacity);
+        }
+
+        if (Response.Result != 0) {
+            fprintf(stderr, "%s: extraction failed (error %d)\n", Path, Response.Result);
+        }
+
+        ReportImage(Server->Report, Path, &RomInfo, &Stats, Response.Result);
+
+        Response.RomOffset = RomInfo.RomOffset;
+        Response.OrigSize = Response.Result == 0 ? RomInfo.OrigSize : 0;
+        Response.VendorId = RomInfo.VendorId;
+        Response.DeviceId = RomInfo.DeviceId;
+        Response.DecodeNs = Stats.WallNs[EXTRACT_PHASE_DECODE];
+
+        for (int Index = 0; Index < FdCount; Index++) {
+            close(Fds[Index]);
+        }
+
+        if (WriteExact(Conn, &Response, sizeof (Response))) {
+            return;
+        }
+    }
+}
+
+static void *ServerWorker(void *Arg) {
+    SERVER *Server = Arg;
+    EXTRACT_CONTEXT Ctx;
+    BUFFER_ARENA Arena;
+    uint8_t *InBuffer = NULL;
+    uint32_t InCapacity = 0;
+
+    if (ExtractContextInit(&Ctx)) {
+        fprintf(stderr, "Worker context allocation failed!\n");
+        return NULL;
+    }
+
+    // Budgeted buffers are malloc'd to their exact size so the charge matches
+    ArenaInit(&Arena, gArenaFlags);
+    Ctx.Arena = Server->Budget == NULL ? &Arena : NULL;
+    Ctx.DecompressFlags = Server->DecompressFlags;
+
+    for (;;) {
+        int Conn = accept4(Server->Listen, NULL, NULL, SOCK_CLOEXEC);
+
+        if (Conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        ServeConnection(Server, &Ctx, &InBuffer, &InCapacity, Conn);
+        close(Conn);
+    }
+
+    if (Server->Budget != NULL) {
+        BudgetLeave(Server->Budget, &Ctx, &InBuffer, &InCapacity);
+    }
+
+    free(InBuffer);
+    ExtractContextFree(&Ctx);
+    ArenaDestroy(&Arena);
+
+    return NULL;
+}
+
+int ServerRun(const char *SocketPath, int Workers, uint32_t DecompressFlags, uint64_t MemoryLimit, EXTRACT_REPORT *Report) {
+    struct sockaddr_un Addr;
+    struct stat St;
+    MEMORY_BUDGET Budget;
+    SERVER Server;
+
+    if (strlen(SocketPath) >= sizeof (Addr.sun_path)) {
+        Print("Socket path %s is too long!\n", SocketPath);
+        return -10;
+    }
+
+    if (Workers <= 0) {
+        long Cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Workers = Cpus > 0 ? (int) Cpus : 1;
+    }
+
+    memset(&Addr, 0, sizeof (Addr));
+    Addr.sun_family = AF_UNIX;
+    strcpy(Addr.sun_path, SocketPath);
+
+    if (MemoryLimit != 0 && BudgetInit(&Budget, MemoryLimit, Workers)) {
+        Print("Memory budget of %llu bytes is too small for %d workers!\n", (unsigned long long) MemoryLimit, Workers);
+        return -10;
+    }
+
+    Server.Report = Report;
+    Server.Budget = MemoryLimit != 0 ? &Budget : NULL;
+    Server.DecompressFlags = DecompressFlags;
+    // A socket left behind by a previous run would make bind fail, anything else is not ours to remove
+    if (lstat(SocketPath, &St) == 0) {
+        if (!S_ISSOCK(St.st_mode)) {
+            Print("%s exists and is not a socket!\n", SocketPath);
+            return -10;
+        }
+
+        unlink(SocketPath);
+    }
+
+    Server.Listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    // No other thread runs yet, so the process umask can be swapped for the bind
+    mode_t Mask = umask(~SERVER_SOCKET_MODE & 0777);
+    int Bound = Server.Listen >= 0 ? bind(Server.Listen, (struct sockaddr *) &Addr, sizeof (Addr)) : -1;
+
+    umask(Mask);
+
+    if (Bound != 0 || listen(Server.Listen, 128) != 0) {
+        Print("Failed to listen on %s: %s\n", SocketPath, strerror(errno));
+        return -10;
+    }
+
+    mSocketPath = SocketPath;
+    signal(SIGINT, ServerTerminate);
+    signal(SIGTERM, ServerTerminate);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t *Threads = calloc((size_t) Workers, sizeof (pthread_t));
+
+    if (Threads == NULL) {
+        Print("Worker allocation failed!\n");
+        return -10;
+    }
+
+    Print("Listening on %s with %d workers\n", SocketPath, Workers);
+
+    // Per-request chatter would only slow the workers down
+    fflush(gStatusOut);
+    gStatusOut = NULL;
+
+    for (int Index = 0; Index < Workers; Index++) {
+        if (pthread_create(&Threads[Index], NULL, ServerWorker, &Server) != 0) {
+            fprintf(stderr, "Failed to start worker %d!\n", Index);
+            Workers = Index;
+            break;
+        }
+    }
+
+    for (int Index = 0; Index < Workers; Index++) {
+        pthread_join(Threads[Index], NULL);
+    }
+
+    free(Threads);
+    unlink(SocketPath);
+
+    if (Server.Budget != NULL) {
+        BudgetFree(Server.Budget);
+    }
+
+    return -10;
+}
+
+int ClientConnect(const char *SocketPath) {
+    struct sockaddr_un Addr;
+
+    if (strlen(SocketPath) >= sizeof (Addr.sun_path)) {
+        return -1;
+    }
+
+    memset(&Addr, 0, sizeof (Addr));
+    Addr.sun_family = AF_UNIX;
+    strcpy(Addr.sun_path, SocketPath);
+
+    int Sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (Sock < 0) {
+        return -1;
+    }
+
+    if (connect(Sock, (struct sockaddr *) &Addr, sizeof (Addr)) != 0) {
+        close(Sock);
+        return -1;
+    }
+
+    return Sock;
+}
+
+int ClientRequest(int Sock, int InFd, int OutFd, uint32_t Flags, SERVER_RESPONSE *Response) {
+    union {
+        char Buffer[CMSG_SPACE(2 * sizeof (int))];
+        struct cmsghdr Align;
+    } Control;
+    SERVER_REQUEST Request = { SERVER_MAGIC, SERVER_REQUEST_INPUT_FD | Flags, 0, 0 };
+    struct iovec Iov = { &Request, sizeof (Request) };
+    struct msghdr Msg;
+    int Fds[2] = { InFd, OutFd };
+    ssize_t Sent;
+
+    memset(&Control, 0, sizeof (Control));
+    memset(&Msg, 0, sizeof (Msg));
+    Msg.msg_iov = &Iov;
+    Msg.msg_iovlen = 1;
+    Msg.msg_control = Control.Buffer;
+    Msg.msg_controllen = sizeof (Control.Buffer);
+
+    struct cmsghdr *Cmsg = CMSG_FIRSTHDR(&Msg);
+    Cmsg->cmsg_level = SOL_SOCKET;
+    Cmsg->cmsg_type = SCM_RIGHTS;
+    Cmsg->cmsg_len = CMSG_LEN(sizeof (Fds));
+    memcpy(CMSG_DATA(Cmsg), Fds, sizeof (Fds));
+
+    do {
+        Sent = sendmsg(Sock, &Msg, MSG_NOSIGNAL);
+    } while (Sent < 0 && errno == EINTR);
+
+    if (Sent != (ssize_t) sizeof (Request)) {
+        return -1;
+    }
+
+    return ReadExact(Sock, Response, sizeof (*Response));
+}
+
+static int CompareLatency(const void *A, const void *B) {
+    uint64_t La = *(const uint64_t *) A;
+    uint64_t Lb = *(const uint64_t *) B;
+
+    return La < Lb ? -1 : La > Lb;
+}
+
+// Run one extraction the way a shell loop would: a fresh process per file
+static int SpawnExtraction(const char *Self, const char *InFile, const char *OutFile, uint32_t Flags) {
+    int Status;
+    pid_t Pid = fork();
+
+    if (Pid < 0) {
+        return -1;
+    }
+
+    if (Pid == 0) {
+        int Null = open("/dev/null", O_WRONLY);
+
+        if (Null >= 0) {
+            dup2(Null, STDOUT_FILENO);
+        }
+
+        if ((Flags & SERVER_REQUEST_HARDENED) != 0) {
+            execl(Self, Self, "-H", InFile, OutFile, (char *) NULL);
+        } else {
+            execl(Self, Self, InFile, OutFile, (char *) NULL);
+        }
+
+        _exit(127);
+    }
+
+    if (waitpid(Pid, &Status, 0) != Pid || !WIFEXITED(Status)) {
+        return -1;
+    }
+
+    return (int8_t) WEXITSTATUS(Status);
+}
+
+int LoadTest(const char *SocketPath, const char *Self, const char *InFile, const char *OutFile, int Count, uint32_t Flags) {
+    int Sock = -1;
+    int InFd = -1;
+    int OutFd = -1;
+    int Failed = 0;
+    struct timespec Start;
+    struct timespec End;
+    struct timespec RunStart;
+    struct timespec RunEnd;
+
+    uint64_t *Latency = calloc((size_t) Count, sizeof (uint64_t));
+
+    if (Latency == NULL) {
+        Print("Latency buffer allocation failed!\n");
+        return -1;
+    }
+
+    if (SocketPath != NULL) {
+        Sock = ClientConnect(SocketPath);
+        InFd = open(InFile, O_RDONLY | O_CLOEXEC);
+        OutFd = open(OutFile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (Sock < 0 || InFd < 0 || OutFd < 0) {
+            Print("Failed to set up connection to %s!\n", SocketPath);
+            free(Latency);
+            return -10;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &RunStart);
+
+    for (int Index = 0; Index < Count; Index++) {
+        SERVER_RESPONSE Response;
+        int Result;
+
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+
+        if (SocketPath != NULL) {
+            Result = ClientRequest(Sock, InFd, OutFd, Flags, &Response) ? -10 : Response.Result;
+        } else {
+            Result = SpawnExtraction(Self, InFile, OutFile, Flags);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &End);
+
+        Latency[Index] = ElapsedNs(&Start, &End);
+        Failed += Result != 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &RunEnd);
+
+    qsort(Latency, (size_t) Count, sizeof (uint64_t), CompareLatency);
+
+    uint64_t Total = ElapsedNs(&RunStart, &RunEnd);
+    uint64_t Sum = 0;
+
+    for (int Index = 0; Index < Count; Index++) {
+        Sum += Latency[Index];
+    }
+
+    printf("%s: %d requests, %d failed\n", SocketPath != NULL ? "server" : "process per file", Count, Failed);
+    printf("latency us: min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+           Latency[0] / 1e3, Sum / 1e3 / Count, Latency[Count / 2] / 1e3,
+           Latency[(Count * 99) / 100] / 1e3, Latency[Count - 1] / 1e3);
+    printf("throughput: %.1f requests/s\n", Count / (Total / 1e9));
+
+    free(Latency);
+
+    if (SocketPath != NULL) {
+        close(Sock);
+        close(InFd);
+        close(OutFd);
+    }
+
+    return Failed != 0 ? -10 : 0;
+}
@@ -0,0 +1,111 @@
+//
+//  server.h
+//  UEFIRomExtract
+//
+//  Long-running extraction daemon on a Unix domain socket, its client and
+//  a load generator to compare it with one process per file.
+//
+
+#ifndef UEFIRomExtract_server_h
+#define UEFIRomExtract_server_h
+
+#include <stdint.h>
+#include "report.h"
+
+#define SERVER_MAGIC 0x52464555  // "UEFR"
+
+//
+// The input travels as the first passed descriptor. Requests without it
+// name an input path instead, which the server refuses: it would open the
+// file with its own rights rather than the client's.
+//
+#define SERVER_REQUEST_INPUT_FD  0x0001
+
+//
+// Decode this request hardened, as -H does, so one server can take both
+// trusted and untrusted callers. A server started with -H hardens every
+// request whether it is set or not.
+//
+#define SERVER_REQUEST_HARDENED  0x0002
+
+//
+// Longest path a refused path request may carry before the connection is dropped.
+//
+#define SERVER_MAX_PATH 4096
+
+//
+// Access to the socket, whatever the umask of the server: owner and group.
+//
+#define SERVER_SOCKET_MODE 0660
+
+//
+// Sent with SCM_RIGHTS carrying the input descriptor followed by the
+// output descriptor, with SERVER_REQUEST_INPUT_FD set and PathLength 0.
+// The image is written to the output descriptor at offset 0 and a regular
+// file or memfd is truncated to its size, so a memfd doubles as shared memory.
+//
+typedef struct {
+    uint32_t Magic;
+    uint32_t Flags;
+    uint32_t PathLength;
+    uint32_t Reserved;
+} SERVER_REQUEST;
+
+typedef struct {
+    int32_t Result;          // 0 or the exit code a one-shot run would return
+    uint32_t RomOffset;
+    uint32_t OrigSize;       // Bytes written to the output descriptor
+    uint16_t VendorId;
+    uint16_t DeviceId;
+    uint64_t DecodeNs;
+} SERVER_RESPONSE;
+
+/**
+ Listen on SocketPath and serve extraction requests until terminated.
+
+ Every worker thread owns a warm EXTRACT_CONTEXT and accepts connections
+ itself; a connection may carry any number of requests.
+
+ @param  SocketPath The Unix socket to create, replacing a stale socket
+                    but no other kind of file.
+ @param  Workers    The number of worker threads, 0 for one per CPU.
+ @param  DecompressFlags Flags for UefiDecompressEx().
+ @param  MemoryLimit Bytes of input and output buffers the workers may hold
+                    at once, see MEMORY_BUDGET; 0 for no limit.
+ @param  Report     The report to add a record per request to, or NULL.
+
+ @retval  <0 The server could not be started.
+ **/
+int ServerRun(const char *SocketPath, int Workers, uint32_t DecompressFlags, uint64_t MemoryLimit, EXTRACT_REPORT *Report);
+
+int ClientConnect(const char *SocketPath);
+
+/**
+ Send one request passing InFd and OutFd and wait for its response.
+
+ @param  Sock     The connection to the server.
+ @param  InFd     The input.
+ @param  OutFd    The output.
+ @param  Flags    SERVER_REQUEST_* flags to add to SERVER_REQUEST_INPUT_FD.
+ @param  Response Receives the response.
+
+ @retval  0 A response was received, its Result tells how the extraction went.
+ @retval  -1 The request could not be delivered.
+ **/
+int ClientRequest(int Sock, int InFd, int OutFd, uint32_t Flags, SERVER_RESPONSE *Response);
+
+/**
+ Extract InFile into OutFile Count times and print latency and throughput.
+
+ @param  SocketPath The server to use, or NULL to start one process per
+                    extraction like a plain command line run.
+ @param  Self       Path of this executable, for the process per file model.
+ @param  InFile     The input file.
+ @param  OutFile    The output file.
+ @param  Count      The number of extractions.
+ @param  Flags      SERVER_REQUEST_* flags for every request; with
+                    SERVER_REQUEST_HARDENED each process is run with -H.
+ **/
+int LoadTest(const char *SocketPath, const char *Self, const char *InFile, const char *OutFile, int Count, uint32_t Flags);
+
+#endif
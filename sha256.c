@@ -0,0 +1,145 @@
+//
+//  sha256.c
+//  UEFIRomExtract
+//
+//  SHA-256 content hashing for deduplication and manifests.
+//
+#include <string.h>
+#include "sha256.h"
+
+static const uint32_t mRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(Value, Bits) (((Value) >> (Bits)) | ((Value) << (32 - (Bits))))
+
+static void Sha256Block(SHA256_CONTEXT *Ctx, const uint8_t *Block) {
+    uint32_t W[64];
+    uint32_t S[8];
+
+    for (int Index = 0; Index < 16; Index++) {
+        W[Index] = ((uint32_t) Block[Index * 4] << 24) | ((uint32_t) Block[Index * 4 + 1] << 16) |
+                   ((uint32_t) Block[Index * 4 + 2] << 8) | (uint32_t) Block[Index * 4 + 3];
+    }
+
+    for (int Index = 16; Index < 64; Index++) {
+        uint32_t S0 = ROTR(W[Index - 15], 7) ^ ROTR(W[Index - 15], 18) ^ (W[Index - 15] >> 3);
+        uint32_t S1 = ROTR(W[Index - 2], 17) ^ ROTR(W[Index - 2], 19) ^ (W[Index - 2] >> 10);
+
+        W[Index] = W[Index - 16] + S0 + W[Index - 7] + S1;
+    }
+
+    memcpy(S, Ctx->mState, sizeof (S));
+
+    for (int Index = 0; Index < 64; Index++) {
+        uint32_t S1 = ROTR(S[4], 6) ^ ROTR(S[4], 11) ^ ROTR(S[4], 25);
+        uint32_t Ch = (S[4] & S[5]) ^ (~S[4] & S[6]);
+        uint32_t T1 = S[7] + S1 + Ch + mRoundConstants[Index] + W[Index];
+        uint32_t S0 = ROTR(S[0], 2) ^ ROTR(S[0], 13) ^ ROTR(S[0], 22);
+        uint32_t Maj = (S[0] & S[1]) ^ (S[0] & S[2]) ^ (S[1] & S[2]);
+        uint32_t T2 = S0 + Maj;
+
+        S[7] = S[6];
+        S[6] = S[5];
+        S[5] = S[4];
+        S[4] = S[3] + T1;
+        S[3] = S[2];
+        S[2] = S[1];
+        S[1] = S[0];
+        S[0] = T1 + T2;
+    }
+
+    for (int Index = 0; Index < 8; Index++) {
+        Ctx->mState[Index] += S[Index];
+    }
+}
+
+void Sha256Init(SHA256_CONTEXT *Ctx) {
+    static const uint32_t InitialState[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(Ctx->mState, InitialState, sizeof (InitialState));
+    Ctx->mLength = 0;
+    Ctx->mBlockUsed = 0;
+}
+
+void Sha256Update(SHA256_CONTEXT *Ctx, const void *Data, size_t Size) {
+    const uint8_t *Bytes = Data;
+
+    Ctx->mLength += Size;
+
+    if (Ctx->mBlockUsed != 0) {
+        size_t Take = 64 - Ctx->mBlockUsed < Size ? 64 - Ctx->mBlockUsed : Size;
+
+        memcpy(Ctx->mBlock + Ctx->mBlockUsed, Bytes, Take);
+        Ctx->mBlockUsed += (uint32_t) Take;
+        Bytes += Take;
+        Size -= Take;
+
+        if (Ctx->mBlockUsed < 64) {
+            return;
+        }
+
+        Sha256Block(Ctx, Ctx->mBlock);
+        Ctx->mBlockUsed = 0;
+    }
+
+    for (; Size >= 64; Bytes += 64, Size -= 64) {
+        Sha256Block(Ctx, Bytes);
+    }
+
+    memcpy(Ctx->mBlock, Bytes, Size);
+    Ctx->mBlockUsed = (uint32_t) Size;
+}
+
+void Sha256Final(SHA256_CONTEXT *Ctx, uint8_t Digest[SHA256_DIGEST_SIZE]) {
+    uint64_t Bits = Ctx->mLength * 8;
+    uint8_t Pad = 0x80;
+
+    Sha256Update(Ctx, &Pad, 1);
+
+    Pad = 0;
+    while (Ctx->mBlockUsed != 56) {
+        Sha256Update(Ctx, &Pad, 1);
+    }
+
+    for (int Index = 7; Index >= 0; Index--) {
+        uint8_t Byte = (uint8_t) (Bits >> (Index * 8));
+
+        Sha256Update(Ctx, &Byte, 1);
+    }
+
+    for (int Index = 0; Index < 8; Index++) {
+        Digest[Index * 4] = (uint8_t) (Ctx->mState[Index] >> 24);
+        Digest[Index * 4 + 1] = (uint8_t) (Ctx->mState[Index] >> 16);
+        Digest[Index * 4 + 2] = (uint8_t) (Ctx->mState[Index] >> 8);
+        Digest[Index * 4 + 3] = (uint8_t) Ctx->mState[Index];
+    }
+}
+
+void Sha256(const void *Data, size_t Size, uint8_t Digest[SHA256_DIGEST_SIZE]) {
+    SHA256_CONTEXT Ctx;
+
+    Sha256Init(&Ctx);
+    Sha256Update(&Ctx, Data, Size);
+    Sha256Final(&Ctx, Digest);
+}
+
+void Sha256Hex(const uint8_t Digest[SHA256_DIGEST_SIZE], char Hex[SHA256_HEX_SIZE]) {
+    static const char Digits[] = "0123456789abcdef";
+
+    for (int Index = 0; Index < SHA256_DIGEST_SIZE; Index++) {
+        Hex[Index * 2] = Digits[Digest[Index] >> 4];
+        Hex[Index * 2 + 1] = Digits[Digest[Index] & 0xf];
+    }
+
+    Hex[SHA256_HEX_SIZE - 1] = 0;
+}
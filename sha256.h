@@ -0,0 +1,40 @@
+//
+//  sha256.h
+//  UEFIRomExtract
+//
+//  SHA-256 content hashing for deduplication and manifests.
+//
+
+#ifndef UEFIRomExtract_sha256_h
+#define UEFIRomExtract_sha256_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE    (2 * SHA256_DIGEST_SIZE + 1)
+
+typedef struct {
+    uint32_t mState[8];
+    uint64_t mLength;
+    uint8_t mBlock[64];
+    uint32_t mBlockUsed;
+} SHA256_CONTEXT;
+
+void Sha256Init(SHA256_CONTEXT *Ctx);
+
+void Sha256Update(SHA256_CONTEXT *Ctx, const void *Data, size_t Size);
+
+void Sha256Final(SHA256_CONTEXT *Ctx, uint8_t Digest[SHA256_DIGEST_SIZE]);
+
+void Sha256(const void *Data, size_t Size, uint8_t Digest[SHA256_DIGEST_SIZE]);
+
+/**
+ Format a digest as lower case hex.
+
+ @param  Digest The digest.
+ @param  Hex    Receives SHA256_HEX_SIZE characters including the terminator.
+ **/
+void Sha256Hex(const uint8_t Digest[SHA256_DIGEST_SIZE], char Hex[SHA256_HEX_SIZE]);
+
+#endif
@@ -0,0 +1,491 @@
+//
+//  shard.c
+//  UEFIRomExtract
+//
+//  Deterministic partitioning of a batch over several processes or hosts,
+//  and merging of the deduplicated output directories of the shards.
+//
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "shard.h"
+#include "dedupe.h"
+#include "manifest.h"
+
+typedef struct {
+    int Number;                // Position in the argument list
+    uint64_t Size;
+    uint8_t Key[SHA256_DIGEST_SIZE];
+} SHARD_INPUT;
+
+typedef struct {
+    SHARD Shard;
+    const char *Dir;
+} SHARD_SOURCE;
+
+int ShardParse(const char *Text, SHARD *Shard) {
+    char Tail;
+
+    if (sscanf(Text, "%d/%d%c", &Shard->Index, &Shard->Count, &Tail) != 2) {
+        return -1;
+    }
+
+    return Shard->Index >= 1 && Shard->Index <= Shard->Count ? 0 : -1;
+}
+
+void ShardManifestName(const SHARD *Shard, char *Name, size_t NameSize) {
+    snprintf(Name, NameSize, SHARD_MANIFEST_FORMAT, Shard->Index, Shard->Count);
+}
+
+// Largest first, then by path hash, so the order does not depend on the argument order
+static int ShardInputCompare(const void *Left, const void *Right) {
+    const SHARD_INPUT *A = Left;
+    const SHARD_INPUT *B = Right;
+
+    if (A->Size != B->Size) {
+        return A->Size > B->Size ? -1 : 1;
+    }
+
+    return memcmp(A->Key, B->Key, SHA256_DIGEST_SIZE);
+}
+
+int ShardSelect(const SHARD *Shard, const char *const *InFiles, int InCount, const char ***Selected, int *SelectedCount) {
+    SHARD_INPUT *Inputs = malloc((size_t) InCount * sizeof (SHARD_INPUT) + 1);
+    uint64_t *Bytes = calloc((size_t) Shard->Count, sizeof (uint64_t));
+    int *Counts = calloc((size_t) Shard->Count, sizeof (int));
+    uint8_t *Mine = calloc((size_t) InCount + 1, 1);
+    uint64_t Total = 0;
+
+    *Selected = malloc((size_t) InCount * sizeof (const char *) + 1);
+    *SelectedCount = 0;
+
+    if (Inputs == NULL || Bytes == NULL || Counts == NULL || Mine == NULL || *Selected == NULL) {
+        Print("Shard allocation failed!\n");
+        free(Inputs);
+        free(Bytes);
+        free(Counts);
+        free(Mine);
+        free(*Selected);
+        *Selected = NULL;
+        return -7;
+    }
+
+    for (int Index = 0; Index < InCount; Index++) {
+        struct stat St;
+
+        Inputs[Index].Number = Index;
+        Inputs[Index].Size = 0;
+
+        // Every shard must see the same sizes, so one that cannot is told
+        if (strcmp(InFiles[Index], "-") == 0) {
+            Print("Warning: stdin cannot be sized, counted as empty\n");
+        } else if (stat(InFiles[Index], &St) != 0) {
+            Print("Warning: cannot stat %s, counted as empty\n", InFiles[Index]);
+        } else {
+            Inputs[Index].Size = (uint64_t) St.st_size;
+        }
+
+        Sha256(InFiles[Index], strlen(InFiles[Index]), Inputs[Index].Key);
+        Total += Inputs[Index].Size;
+    }
+
+    qsort(Inputs, (size_t) InCount, sizeof (SHARD_INPUT), ShardInputCompare);
+
+    // Greedy largest-first packing, within 4/3 of the best split by size
+    for (int Index = 0; Index < InCount; Index++) {
+        int Least = 0;
+
+        for (int Other = 1; Other < Shard->Count; Other++) {
+            if (Bytes[Other] < Bytes[Least] || (Bytes[Other] == Bytes[Least] && Counts[Other] < Counts[Least])) {
+                Least = Other;
+            }
+        }
+
+        Bytes[Least] += Inputs[Index].Size;
+        Counts[Least]++;
+        Mine[Inputs[Index].Number] = Least == Shard->Index - 1;
+    }
+
+    for (int Index = 0; Index < InCount; Index++) {
+        if (Mine[Index]) {
+            (*Selected)[(*SelectedCount)++] = InFiles[Index];
+        }
+    }
+
+    Print("Shard %d of %d: %d of %d inputs, %llu of %llu bytes\n", Shard->Index, Shard->Count, *SelectedCount, InCount,
+          (unsigned long long) Bytes[Shard->Index - 1], (unsigned long long) Total);
+
+    free(Inputs);
+    free(Bytes);
+    free(Counts);
+    free(Mine);
+
+    return 0;
+}
+
+// Copy a file next to Path and rename it into place, for when it cannot be linked
+static int ShardCopyFile(const char *Source, const char *Path) {
+    char TempPath[4096];
+    uint8_t Buffer[65536];
+    ssize_t Got = 0;
+    int Status = 0;
+
+    if ((size_t) snprintf(TempPath, sizeof (TempPath), "%s%s", Path, MANIFEST_TEMP_SUFFIX) >= sizeof (TempPath)) {
+        return -9;
+    }
+
+    int In = open(Source, O_RDONLY);
+
+    if (In < 0) {
+        return -1;
+    }
+
+    int Out = open(TempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (Out < 0) {
+        close(In);
+        return -9;
+    }
+
+    while (Status == 0 && (Got = read(In, Buffer, sizeof (Buffer))) != 0) {
+        if (Got < 0) {
+            Status = errno == EINTR ? 0 : -1;
+            continue;
+        }
+
+        for (ssize_t Done = 0; Status == 0 && Done < Got;) {
+            ssize_t Put = write(Out, Buffer + Done, (size_t) (Got - Done));
+
+            if (Put > 0) {
+                Done += Put;
+            } else if (Put == 0 || errno != EINTR) {
+                Status = -9;
+            }
+        }
+    }
+
+    close(In);
+
+    if (Status == 0 && fsync(Out) != 0) {
+        Status = -9;
+    }
+
+    if (close(Out) != 0 && Status == 0) {
+        Status = -9;
+    }
+
+    if (Status == 0 && rename(TempPath, Path) != 0) {
+        Status = -9;
+    }
+
+    if (Status != 0) {
+        unlink(TempPath);
+    }
+
+    return Status;
+}
+
+/**
+ Put the image of a shard in place in the merged directory, hard linked if
+ possible and copied otherwise. Content addressed, so a complete image
+ already there is right; one of the wrong size is torn and replaced.
+
+ @retval  0 OK.
+ @retval  -1 The image of the shard is missing or torn.
+ @retval  -9 The image could not be written.
+ **/
+static int ShardPlaceImage(const char *Source, const char *Path, uint32_t Size) {
+    char TempPath[4096];
+
+    if (DedupeImagePresent(Path, Size)) {
+        return 0;
+    }
+
+    if (!DedupeImagePresent(Source, Size)) {
+        return -1;
+    }
+
+    if ((size_t) snprintf(TempPath, sizeof (TempPath), "%s%s", Path, MANIFEST_TEMP_SUFFIX) >= sizeof (TempPath)) {
+        return -9;
+    }
+
+    // Linked under the temporary name first, so a torn image is replaced in one rename
+    unlink(TempPath);
+
+    if (link(Source, TempPath) != 0) {
+        return ShardCopyFile(Source, Path);
+    }
+
+    if (rename(TempPath, Path) != 0) {
+        unlink(TempPath);
+        return -9;
+    }
+
+    return 0;
+}
+
+// Find the shard manifests in each directory and check they make one complete split
+static int ShardFindSources(const char *const *ShardDirs, int DirCount, SHARD_SOURCE **Sources, int *SourceCount) {
+    int Count = 0;
+
+    *Sources = NULL;
+    *SourceCount = 0;
+
+    for (int Index = 0; Index < DirCount; Index++) {
+        DIR *Dir = opendir(ShardDirs[Index]);
+        struct dirent *Entry;
+
+        if (Dir == NULL) {
+            Print("Error opening shard directory %s!\n", ShardDirs[Index]);
+            return -1;
+        }
+
+        while ((Entry = readdir(Dir)) != NULL) {
+            SHARD Shard;
+            int Length = -1;
+
+            if (sscanf(Entry->d_name, SHARD_MANIFEST_FORMAT "%n", &Shard.Index, &Shard.Count, &Length) != 2 ||
+                Length != (int) strlen(Entry->d_name) || Shard.Index < 1 || Shard.Index > Shard.Count) {
+                continue;
+            }
+
+            if (Count != 0 && Shard.Count != (*Sources)[0].Shard.Count) {
+                Print("Shard %d of %d in %s is from a split into %d!\n", Shard.Index, Shard.Count, ShardDirs[Index],
+                      (*Sources)[0].Shard.Count);
+                closedir(Dir);
+                return -1;
+            }
+
+            SHARD_SOURCE *Grown = realloc(*Sources, (size_t) (Count + 1) * sizeof (SHARD_SOURCE));
+
+            if (Grown == NULL) {
+                closedir(Dir);
+                return -7;
+            }
+
+            *Sources = Grown;
+            (*Sources)[Count].Shard = Shard;
+            (*Sources)[Count].Dir = ShardDirs[Index];
+            Count++;
+        }
+
+        closedir(Dir);
+    }
+
+    if (Count == 0) {
+        Print("No shard manifests found!\n");
+        return -1;
+    }
+
+    // Merged in shard order, so the result does not depend on the directory order
+    for (int Index = 1; Index <= (*Sources)[0].Shard.Count; Index++) {
+        int Found = -1;
+
+        for (int Source = 0; Source < Count; Source++) {
+            if ((*Sources)[Source].Shard.Index != Index) {
+                continue;
+            }
+
+            if (Found >= 0) {
+                Print("Shard %d of %d found in both %s and %s!\n", Index, (*Sources)[0].Shard.Count,
+                      (*Sources)[Found].Dir, (*Sources)[Source].Dir);
+                return -1;
+            }
+
+            Found = Source;
+        }
+
+        if (Found < 0) {
+            Print("Shard %d of %d is missing!\n", Index, (*Sources)[0].Shard.Count);
+            return -1;
+        }
+
+        SHARD_SOURCE Swap = (*Sources)[Index - 1];
+
+        (*Sources)[Index - 1] = (*Sources)[Found];
+        (*Sources)[Found] = Swap;
+    }
+
+    *SourceCount = Count;
+
+    return 0;
+}
+
+int MergeShards(const char *OutDir, const char *const *ShardDirs, int DirCount) {
+    SHARD_SOURCE *Sources;
+    DIGEST_INDEX Inputs;
+    DIGEST_INDEX Images;
+    char ManifestPath[4096];
+    char TempPath[4096];
+    char Name[64];
+    char Path[4096];
+    char Source[4096];
+    int SourceCount;
+    int Status;
+    uint32_t Records = 0;
+    int Failed = 0;
+    int Overlaps = 0;
+    int Redecoded = 0;
+
+    Status = ShardFindSources(ShardDirs, DirCount, &Sources, &SourceCount);
+
+    if (Status != 0) {
+        free(Sources);
+        return Status;
+    }
+
+    if (mkdir(OutDir, 0755) != 0 && errno != EEXIST) {
+        Print("Failed to create output directory %s!\n", OutDir);
+        free(Sources);
+        return -9;
+    }
+
+    if ((size_t) snprintf(ManifestPath, sizeof (ManifestPath), "%s/%s", OutDir, DEDUPE_MANIFEST) >= sizeof (ManifestPath) ||
+        (size_t) snprintf(TempPath, sizeof (TempPath), "%s%s", ManifestPath, MANIFEST_TEMP_SUFFIX) >= sizeof (TempPath)) {
+        Print("Manifest path in %s is too long!\n", OutDir);
+        free(Sources);
+        return -9;
+    }
+
+    FILE *Manifest = fopen(TempPath, "w");
+
+    if (Manifest == NULL) {
+        Print("Error opening manifest %s!\n", TempPath);
+        free(Sources);
+        return -9;
+    }
+
+    DigestIndexInit(&Inputs);
+    DigestIndexInit(&Images);
+
+    for (int Index = 0; Index < SourceCount && Status == 0; Index++) {
+        const SHARD *Shard = &Sources[Index].Shard;
+        MANIFEST Part;
+        uint64_t Bytes = 0;
+
+        ShardManifestName(Shard, Name, sizeof (Name));
+        ManifestInit(&Part);
+
+        if ((size_t) snprintf(Source, sizeof (Source), "%s/%s", Sources[Index].Dir, Name) >= sizeof (Source)) {
+            Print("Manifest path in %s is too long!\n", Sources[Index].Dir);
+            Status = -1;
+        } else if (ManifestLoad(&Part, Source)) {
+            Print("Failed to load manifest %s!\n", Source);
+            Status = -7;
+        }
+
+        for (uint32_t Number = 0; Number < Part.mCount && Status == 0; Number++) {
+            const MANIFEST_RECORD *Record = &Part.mRecords[Number];
+            uint8_t Key[SHA256_DIGEST_SIZE];
+            uint8_t Value[SHA256_DIGEST_SIZE];
+            char Hex[SHA256_HEX_SIZE];
+
+            // Only happens when the shards were not given the same inputs
+            Sha256(Record->Input, strlen(Record->Input), Key);
+
+            DIGEST_ENTRY *Seen = DigestIndexFind(&Inputs, Key);
+
+            if (Seen != NULL) {
+                int First;
+
+                memcpy(&First, Seen->Value, sizeof (First));
+                Print("%s is in shards %d and %d, keeping the first\n", Record->Input, First, Shard->Index);
+                Overlaps++;
+                continue;
+            }
+
+            // The shard number rides in the value, for the messages above and below
+            memset(Value, 0, sizeof (Value));
+            memcpy(Value, &Shard->Index, sizeof (Shard->Index));
+
+            if (DigestIndexInsert(&Inputs, Key, Value)) {
+                Status = -7;
+                break;
+            }
+
+            Bytes += Record->Size;
+
+            if (Record->Result != 0 || !Record->HasContent) {
+                ManifestWriteRecord(Manifest, Record);
+                Failed++;
+                Records++;
+                continue;
+            }
+
+            DIGEST_ENTRY *Known = DigestIndexFind(&Images, Record->Content);
+
+            if (Known != NULL) {
+                // Every shard decodes its own copy of an image the others have too
+                if (Record->Decoded && memcmp(Known->Value, Value, sizeof (Shard->Index)) != 0) {
+                    Redecoded++;
+                }
+            } else {
+                Sha256Hex(Record->Content, Hex);
+
+                if ((size_t) snprintf(Path, sizeof (Path), "%s/%s.efi", OutDir, Hex) >= sizeof (Path) ||
+                    (size_t) snprintf(Source, sizeof (Source), "%s/%s.efi", Sources[Index].Dir, Hex) >= sizeof (Source)) {
+                    Print("Image path of %s is too long!\n", Record->Input);
+                    Status = -9;
+                    break;
+                }
+
+                int Result = ShardPlaceImage(Source, Path, Record->RomInfo.OrigSize);
+
+                if (Result != 0) {
+                    Print(Result == -1 ? "Image %s of %s is missing or torn!\n" : "Failed to write image %s of %s!\n",
+                          Source, Record->Input);
+                    Status = Result;
+                    break;
+                }
+
+                if (DigestIndexInsert(&Images, Record->Content, Value)) {
+                    Status = -7;
+                    break;
+                }
+            }
+
+            ManifestWriteRecord(Manifest, Record);
+            Records++;
+        }
+
+        if (Status == 0) {
+            Print("Shard %d of %d: %u inputs, %llu bytes\n", Shard->Index, Shard->Count, Part.mCount,
+                  (unsigned long long) Bytes);
+        }
+
+        ManifestFree(&Part);
+    }
+
+    if (Status == 0) {
+        Print("%d shards, %u inputs, %d failed, %u distinct images, %d decoded again by another shard\n",
+              SourceCount, Records, Failed, Images.mCount, Redecoded);
+    }
+
+    if (Status == 0 && Overlaps != 0) {
+        Print("%d inputs were processed by more than one shard\n", Overlaps);
+    }
+
+    DigestIndexFree(&Inputs);
+    DigestIndexFree(&Images);
+    free(Sources);
+
+    // Only a complete merge replaces the manifest
+    int WriteFailed = fflush(Manifest) != 0 || fsync(fileno(Manifest)) != 0;
+
+    if (fclose(Manifest) != 0 || WriteFailed || (Status == 0 && rename(TempPath, ManifestPath) != 0)) {
+        Print("Failed to write manifest!\n");
+        Status = Status != 0 ? Status : -9;
+    }
+
+    if (Status != 0) {
+        unlink(TempPath);
+    }
+
+    return Status;
+}
@@ -0,0 +1,76 @@
+//
+//  shard.h
+//  UEFIRomExtract
+//
+//  Deterministic partitioning of a batch over several processes or hosts,
+//  and merging of the deduplicated output directories of the shards.
+//
+
+#ifndef UEFIRomExtract_shard_h
+#define UEFIRomExtract_shard_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// The manifest a sharded -D run writes instead of DEDUPE_MANIFEST, so the
+// merge can tell which shard of how many each directory holds.
+//
+#define SHARD_MANIFEST_FORMAT "manifest.%d-of-%d.ndjson"
+
+typedef struct {
+    int Index;                 // 1 to Count
+    int Count;
+} SHARD;
+
+/**
+ Parse a shard given as <i>/<N>.
+
+ @retval  0 OK.
+ @retval  -1 Not two numbers with 1 <= i <= N.
+ **/
+int ShardParse(const char *Text, SHARD *Shard);
+
+/**
+ Format the name of the manifest of a shard.
+ **/
+void ShardManifestName(const SHARD *Shard, char *Name, size_t NameSize);
+
+/**
+ Pick the inputs of one shard. Inputs are taken largest first, ties broken
+ by the SHA-256 of their path, and each goes to the shard with the fewest
+ bytes so far, then the fewest inputs. The split only depends on the paths
+ and sizes, so every shard given the same inputs in any order agrees on it.
+ Inputs that cannot be stat'ed count as empty, with a warning.
+
+ @param  Shard         The shard to select for.
+ @param  InFiles       All input files.
+ @param  InCount       The number of input files.
+ @param  Selected      Returns the malloc'd inputs of the shard, in their original order.
+ @param  SelectedCount Returns the number of inputs of the shard.
+
+ @retval  0 OK.
+ @retval  -7 Out of memory.
+ **/
+int ShardSelect(const SHARD *Shard, const char *const *InFiles, int InCount, const char ***Selected, int *SelectedCount);
+
+/**
+ Merge the output directories of every shard of a sharded -D run into one
+ deduplicated directory, as if the whole batch had been extracted there:
+ one manifest with the records of all shards, and each distinct image once,
+ hard linked from the shard directory where possible and copied otherwise.
+ An image already in OutDir is kept if it has the size its record gives
+ and replaced otherwise. A shard directory may be OutDir itself.
+
+ @param  OutDir    The directory to merge into, created if missing.
+ @param  ShardDirs The directories holding the shard manifests and images.
+ @param  DirCount  The number of shard directories.
+
+ @retval  0 Every shard was merged.
+ @retval  -1 A shard is missing, given twice or from a different split, or an image is missing or torn.
+ @retval  -7 Out of memory.
+ @retval  -9 The output could not be written.
+ **/
+int MergeShards(const char *OutDir, const char *const *ShardDirs, int DirCount);
+
+#endif
@@ -0,0 +1,507 @@
+//
+//  watch.c
+//  UEFIRomExtract
+//
+//  Spool directory watcher: extracts every ROM dump completed in the
+//  directory as soon as it lands, on a pool of warm worker threads.
+//
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include "watch.h"
+#include "budget.h"
+
+//
+// Closed after writing or renamed into place; the watch itself going away
+// ends the run.
+//
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct {
+    char *Name;                 // Relative to the spool
+    struct timespec Seen;       // When the event arrived, for the latency
+} WATCH_JOB;
+
+typedef struct {
+    pthread_mutex_t mLock;
+    pthread_cond_t mWake;
+    WATCH_JOB *mJobs;           // FIFO ring of files waiting to be extracted
+    uint32_t mHead;
+    uint32_t mCount;
+    uint32_t mCapacity;
+    int mStopping;              // Set once no more jobs will be queued
+
+    const char *SpoolDir;
+    const char *OutDir;
+    mode_t OutMode;             // 0666 less the umask, read once before the workers start
+    uint32_t DecompressFlags;
+    EXTRACT_REPORT *Report;
+    MEMORY_BUDGET *Budget;      // NULL when unlimited
+    FILE *Status;               // Where the status line per file goes, NULL for none
+} WATCH;
+
+static int WatchQueue(WATCH *Watch, const char *Name, const struct timespec *Seen) {
+    char *Copy = strdup(Name);
+
+    if (Copy == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&Watch->mLock);
+
+    if (Watch->mCount == Watch->mCapacity) {
+        uint32_t Capacity = Watch->mCapacity != 0 ? Watch->mCapacity * 2 : 64;
+        WATCH_JOB *Jobs = malloc(Capacity * sizeof (WATCH_JOB));
+
+        if (Jobs == NULL) {
+            pthread_mutex_unlock(&Watch->mLock);
+            free(Copy);
+            return -1;
+        }
+
+        // Unwrap the ring into the front of the new one
+        for (uint32_t Index = 0; Index < Watch->mCount; Index++) {
+            Jobs[Index] = Watch->mJobs[(Watch->mHead + Index) % Watch->mCapacity];
+        }
+
+        free(Watch->mJobs);
+        Watch->mJobs = Jobs;
+        Watch->mHead = 0;
+        Watch->mCapacity = Capacity;
+    }
+
+    WATCH_JOB *Job = &Watch->mJobs[(Watch->mHead + Watch->mCount++) % Watch->mCapacity];
+
+    Job->Name = Copy;
+    Job->Seen = *Seen;
+
+    pthread_cond_signal(&Watch->mWake);
+    pthread_mutex_unlock(&Watch->mLock);
+
+    return 0;
+}
+
+/**
+ Queue every spooled file whose output is missing or older than it, for the
+ files that landed while nobody was watching. Runs with status output
+ silenced, so problems go to stderr like the workers'.
+ **/
+static void WatchScan(WATCH *Watch) {
+    struct timespec Now;
+    struct dirent *Entry;
+    char InPath[4096];
+    char OutPath[4096];
+
+    DIR *Dir = opendir(Watch->SpoolDir);
+
+    if (Dir == NULL) {
+        fprintf(stderr, "Failed to list spool %s!\n", Watch->SpoolDir);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    while ((Entry = readdir(Dir)) != NULL) {
+        struct stat In;
+        struct stat Out;
+
+        if (Entry->d_name[0] == WATCH_HIDDEN_PREFIX ||
+            (size_t) snprintf(InPath, sizeof (InPath), "%s/%s", Watch->SpoolDir, Entry->d_name) >= sizeof (InPath) ||
+            stat(InPath, &In) != 0 || !S_ISREG(In.st_mode)) {
+            continue;
+        }
+
+        if ((size_t) snprintf(OutPath, sizeof (OutPath), "%s/%s.efi", Watch->OutDir, Entry->d_name) >= sizeof (OutPath)) {
+            continue;
+        }
+
+        if (stat(OutPath, &Out) == 0 && (Out.st_mtim.tv_sec > In.st_mtim.tv_sec ||
+            (Out.st_mtim.tv_sec == In.st_mtim.tv_sec && Out.st_mtim.tv_nsec >= In.st_mtim.tv_nsec))) {
+            continue;
+        }
+
+        if (WatchQueue(Watch, Entry->d_name, &Now)) {
+            fprintf(stderr, "Queue allocation failed!\n");
+            break;
+        }
+    }
+
+    closedir(Dir);
+}
+
+// Write the image next to its final name and rename it into place
+static int WatchWriteOutput(const WATCH *Watch, const char *Name, const uint8_t *Data, uint32_t Size) {
+    char OutPath[4096];
+    char TempPath[4096];
+
+    if ((size_t) snprintf(OutPath, sizeof (OutPath), "%s/%s.efi", Watch->OutDir, Name) >= sizeof (OutPath) ||
+        (size_t) snprintf(TempPath, sizeof (TempPath), "%s/%c%s.efi.XXXXXX", Watch->OutDir, WATCH_HIDDEN_PREFIX, Name) >= sizeof (TempPath)) {
+        return -9;
+    }
+
+    int Fd = mkostemp(TempPath, O_CLOEXEC);
+
+    if (Fd < 0) {
+        return -9;
+    }
+
+    int Failed = fchmod(Fd, Watch->OutMode) != 0;
+
+    for (uint32_t Done = 0; !Failed && Done < Size;) {
+        ssize_t Put = write(Fd, Data + Done, Size - Done);
+
+        if (Put < 0 && errno == EINTR) {
+            continue;
+        }
+
+        Failed = Put <= 0;
+        Done += Put > 0 ? (uint32_t) Put : 0;
+    }
+
+    Failed |= close(Fd) != 0;
+
+    if (Failed || rename(TempPath, OutPath) != 0) {
+        unlink(TempPath);
+        return -9;
+    }
+
+    return 0;
+}
+
+static void WatchExtract(WATCH *Watch, EXTRACT_CONTEXT *Ctx, uint8_t **InBuffer, uint32_t *InCapacity, const WATCH_JOB *Job) {
+    EFI_ROM_INFO RomInfo;
+    EXTRACT_STATS Stats;
+    struct timespec Done;
+    char InPath[4096];
+    uint32_t InSize = 0;
+    int Result = -1;
+
+    memset(&RomInfo, 0, sizeof (RomInfo));
+    ExtractStatsInit(&Stats);
+    PhaseBegin(&Stats, EXTRACT_PHASE_PARSE);
+
+    snprintf(InPath, sizeof (InPath), "%s/%s", Watch->SpoolDir, Job->Name);
+
+    int Fd = open(InPath, O_RDONLY | O_CLOEXEC);
+
+    // Waiting for memory counts as allocating it
+    if (Fd >= 0 && Watch->Budget != NULL) {
+        PhaseBegin(&Stats, EXTRACT_PHASE_SCRATCH);
+        Result = BudgetLoadInput(Watch->Budget, Ctx, Fd, InBuffer, InCapacity, &InSize);
+        PhaseBegin(&Stats, EXTRACT_PHASE_PARSE);
+    } else if (Fd >= 0) {
+        Result = LoadInputFd(Fd, InBuffer, InCapacity, &InSize) == 0 ? 0 : -1;
+    }
+
+    if (Result == 0) {
+        Result = LocateEfiStream(Ctx, *InBuffer, InSize, &RomInfo, &Stats);
+    }
+
+    // The input is read again from Fd if admitting its output has to wait
+    if (Result == 0 && Watch->Budget != NULL) {
+        PhaseBegin(&Stats, EXTRACT_PHASE_SCRATCH);
+        Result = BudgetAdmitImage(Watch->Budget, Ctx, Fd, InBuffer, InCapacity, &InSize, &RomInfo, &Stats);
+    }
+
+    if (Fd >= 0) {
+        close(Fd);
+    }
+
+    if (Result == 0) {
+        Result = DecodeEfiStream(Ctx, *InBuffer, InSize, &RomInfo, &Stats);
+    }
+
+    if (Result == 0) {
+        PhaseBegin(&Stats, EXTRACT_PHASE_WRITE);
+        Result = WatchWriteOutput(Watch, Job->Name, Ctx->OutBuffer, RomInfo.OrigSize);
+    }
+
+    PhaseEnd(&Stats);
+
+    if (Watch->Budget != NULL) {
+        BudgetFinishImage(Watch->Budget, Ctx, InBuffer, InCapacity);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &Done);
+
+    ReportImage(Watch->Report, InPath, &RomInfo, &Stats, Result);
+
+    if (Watch->Status != NULL) {
+        double Ms = ElapsedNs(&Job->Seen, &Done) / 1e6;
+
+        // One call per line, so workers finishing together do not interleave
+        if (Result == 0) {
+            fprintf(Watch->Status, "%s: %u bytes to %s/%s.efi in %.2f ms\n", InPath, RomInfo.OrigSize, Watch->OutDir, Job->Name, Ms);
+        } else {
+            fprintf(Watch->Status, "%s: extraction failed (error %d) in %.2f ms\n", InPath, Result, Ms);
+        }
+
+        fflush(Watch->Status);
+    }
+}
+
+static void *WatchWorker(void *Arg) {
+    WATCH *Watch = Arg;
+    EXTRACT_CONTEXT Ctx;
+    BUFFER_ARENA Arena;
+    uint8_t *InBuffer = NULL;
+    uint32_t InCapacity = 0;
+
+    // Without scratch LocateEfiStream() fails every file with -6, which is still reported
+    ExtractContextInit(&Ctx);
+
+    // Budgeted buffers are malloc'd to their exact size so the charge matches
+    ArenaInit(&Arena, gArenaFlags);
+    Ctx.Arena = Watch->Budget == NULL ? &Arena : NULL;
+    Ctx.DecompressFlags = Watch->DecompressFlags;
+
+    pthread_mutex_lock(&Watch->mLock);
+
+    for (;;) {
+        while (Watch->mCount == 0 && !Watch->mStopping) {
+            pthread_cond_wait(&Watch->mWake, &Watch->mLock);
+        }
+
+        if (Watch->mCount == 0) {
+            break;
+        }
+
+        WATCH_JOB Job = Watch->mJobs[Watch->mHead];
+
+        Watch->mHead = (Watch->mHead + 1) % Watch->mCapacity;
+        Watch->mCount--;
+
+        pthread_mutex_unlock(&Watch->mLock);
+        WatchExtract(Watch, &Ctx, &InBuffer, &InCapacity, &Job);
+        free(Job.Name);
+        pthread_mutex_lock(&Watch->mLock);
+    }
+
+    pthread_mutex_unlock(&Watch->mLock);
+
+    if (Watch->Budget != NULL) {
+        BudgetLeave(Watch->Budget, &Ctx, &InBuffer, &InCapacity);
+    }
+
+    free(InBuffer);
+    ExtractContextFree(&Ctx);
+    ArenaDestroy(&Arena);
+
+    return NULL;
+}
+
+// Read inotify events until a signal arrives or the spool goes away
+static int WatchLoop(WATCH *Watch, int Inotify, int Signals) {
+    _Alignas(struct inotify_event) char Events[16 * 1024];
+    struct pollfd Fds[2] = {
+        { .fd = Inotify, .events = POLLIN },
+        { .fd = Signals, .events = POLLIN }
+    };
+
+    for (;;) {
+        // Blocks with no cost at all while the spool is idle
+        if (poll(Fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (Fds[1].revents != 0) {
+            struct signalfd_siginfo Info;
+
+            // Consumed here, or it would be delivered once the mask is restored
+            if (read(Signals, &Info, sizeof (Info)) == (ssize_t) sizeof (Info)) {
+                fprintf(stderr, "Stopping on signal %u\n", Info.ssi_signo);
+            }
+
+            return 0;
+        }
+
+        ssize_t Got = read(Inotify, Events, sizeof (Events));
+
+        if (Got < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+
+        if (Got <= 0) {
+            fprintf(stderr, "Reading spool events failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        struct timespec Seen;
+
+        clock_gettime(CLOCK_MONOTONIC, &Seen);
+
+        for (char *Next = Events; Next < Events + Got;) {
+            const struct inotify_event *Event = (const struct inotify_event *) Next;
+
+            Next += sizeof (struct inotify_event) + Event->len;
+
+            if ((Event->mask & IN_Q_OVERFLOW) != 0) {
+                fprintf(stderr, "Spool events overflowed, rescanning %s\n", Watch->SpoolDir);
+                WatchScan(Watch);
+                continue;
+            }
+
+            if ((Event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) != 0) {
+                fprintf(stderr, "Spool %s went away!\n", Watch->SpoolDir);
+                return -1;
+            }
+
+            if ((Event->mask & IN_ISDIR) != 0 || Event->len == 0 || Event->name[0] == WATCH_HIDDEN_PREFIX) {
+                continue;
+            }
+
+            if (WatchQueue(Watch, Event->name, &Seen)) {
+                fprintf(stderr, "Queue allocation failed!\n");
+                return -7;
+            }
+        }
+    }
+}
+
+int WatchSpool(const char *SpoolDir, const char *OutDir, int Workers, uint32_t DecompressFlags, uint64_t MemoryLimit,
+               EXTRACT_REPORT *Report) {
+    MEMORY_BUDGET Budget;
+    struct stat Spool;
+    struct stat Out;
+    sigset_t Stop;
+    sigset_t Previous;
+    WATCH Watch;
+
+    if (mkdir(OutDir, 0755) != 0 && errno != EEXIST) {
+        Print("Failed to create output directory %s!\n", OutDir);
+        return -9;
+    }
+
+    // Outputs renamed into the spool would be picked up as dumps themselves
+    if (stat(SpoolDir, &Spool) != 0 || stat(OutDir, &Out) != 0 || (Spool.st_dev == Out.st_dev && Spool.st_ino == Out.st_ino)) {
+        Print("Spool %s must be an existing directory other than %s!\n", SpoolDir, OutDir);
+        return -1;
+    }
+
+    if (Workers <= 0) {
+        long Cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Workers = Cpus > 0 ? (int) Cpus : 1;
+    }
+
+    if (MemoryLimit != 0 && BudgetInit(&Budget, MemoryLimit, Workers)) {
+        Print("Memory budget of %llu bytes is too small for %d workers!\n", (unsigned long long) MemoryLimit, Workers);
+        return -1;
+    }
+
+    memset(&Watch, 0, sizeof (Watch));
+    Watch.Budget = MemoryLimit != 0 ? &Budget : NULL;
+    Watch.SpoolDir = SpoolDir;
+    Watch.OutDir = OutDir;
+    Watch.DecompressFlags = DecompressFlags;
+    Watch.Report = Report;
+
+    mode_t Mask = umask(0);
+
+    umask(Mask);
+    Watch.OutMode = 0666 & ~Mask;
+
+    // Files are opened by path: a descriptor held on the spool would keep its removal from reporting IN_DELETE_SELF
+    int Inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    // The watch goes in before the scan, so a file landing in between is seen by one or both
+    if (Inotify < 0 || inotify_add_watch(Inotify, SpoolDir, WATCH_EVENTS) < 0) {
+        Print("Failed to watch %s: %s\n", SpoolDir, strerror(errno));
+
+        if (Inotify >= 0) {
+            close(Inotify);
+        }
+
+        if (Watch.Budget != NULL) {
+            BudgetFree(Watch.Budget);
+        }
+
+        return -1;
+    }
+
+    // Blocked before the workers start so they inherit it; the loop takes the signals through a descriptor
+    sigemptyset(&Stop);
+    sigaddset(&Stop, SIGINT);
+    sigaddset(&Stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &Stop, &Previous);
+
+    int Signals = signalfd(-1, &Stop, SFD_CLOEXEC);
+
+    pthread_mutex_init(&Watch.mLock, NULL);
+    pthread_cond_init(&Watch.mWake, NULL);
+
+    pthread_t *Threads = calloc((size_t) Workers, sizeof (pthread_t));
+    int Started = 0;
+
+    while (Threads != NULL && Started < Workers && pthread_create(&Threads[Started], NULL, WatchWorker, &Watch) == 0) {
+        Started++;
+    }
+
+    int Status = 0;
+
+    if (Signals < 0 || Started == 0) {
+        Print("Failed to start the watch workers!\n");
+        Status = -1;
+    } else {
+        Print("Watching %s with %d workers\n", SpoolDir, Started);
+
+        // Workers print a status line per file instead of the extraction chatter
+        fflush(gStatusOut);
+        Watch.Status = gStatusOut;
+        gStatusOut = NULL;
+
+        WatchScan(&Watch);
+        Status = WatchLoop(&Watch, Inotify, Signals);
+    }
+
+    // Let the workers finish what is queued, then stop
+    pthread_mutex_lock(&Watch.mLock);
+    Watch.mStopping = 1;
+    pthread_cond_broadcast(&Watch.mWake);
+    pthread_mutex_unlock(&Watch.mLock);
+
+    for (int Index = 0; Index < Started; Index++) {
+        pthread_join(Threads[Index], NULL);
+    }
+
+    // Only once no worker can print any more
+    if (Watch.Status != NULL) {
+        gStatusOut = Watch.Status;
+    }
+
+    free(Threads);
+    free(Watch.mJobs);
+    pthread_cond_destroy(&Watch.mWake);
+    pthread_mutex_destroy(&Watch.mLock);
+
+    if (Watch.Budget != NULL) {
+        Print("Memory budget: peak %llu of %llu bytes, %llu admissions waited, %llu images rejected\n",
+              (unsigned long long) Budget.Peak, (unsigned long long) Budget.Limit,
+              (unsigned long long) Budget.Waits, (unsigned long long) Budget.Rejected);
+        BudgetFree(Watch.Budget);
+    }
+
+    if (Signals >= 0) {
+        close(Signals);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &Previous, NULL);
+    close(Inotify);
+
+    return Status;
+}
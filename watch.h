@@ -0,0 +1,45 @@
+//
+//  watch.h
+//  UEFIRomExtract
+//
+//  Spool directory watcher: extracts every ROM dump completed in the
+//  directory as soon as it lands, on a pool of warm worker threads.
+//
+
+#ifndef UEFIRomExtract_watch_h
+#define UEFIRomExtract_watch_h
+
+#include <stdint.h>
+#include "report.h"
+
+//
+// Spooled names starting with this are still being written by their
+// producer and are left alone until renamed.
+//
+#define WATCH_HIDDEN_PREFIX '.'
+
+/**
+ Watch SpoolDir with inotify and extract every file closed after writing
+ or renamed into it to <OutDir>/<name>.efi, replacing the output atomically.
+ Files already in the spool whose output is missing or older are extracted
+ at startup and after an event queue overflow. Runs until SIGINT or SIGTERM,
+ then finishes the files already queued.
+
+ Every worker owns a warm EXTRACT_CONTEXT. A status line per file goes to
+ the status stream, with the time from the event to the finished output.
+
+ @param  SpoolDir   The directory to watch.
+ @param  OutDir     The directory to write to, created if missing.
+ @param  Workers    The number of worker threads, 0 for one per CPU.
+ @param  DecompressFlags Flags for UefiDecompressEx().
+ @param  MemoryLimit Bytes of input and output buffers the workers may hold
+                    at once, see MEMORY_BUDGET; 0 for no limit.
+ @param  Report     The report to add a record per file to, or NULL.
+
+ @retval  0 Stopped by a signal.
+ @retval  <0 The spool could not be watched, or it went away.
+ **/
+int WatchSpool(const char *SpoolDir, const char *OutDir, int Workers, uint32_t DecompressFlags, uint64_t MemoryLimit,
+               EXTRACT_REPORT *Report);
+
+#endif